@@ -5,7 +5,6 @@
 #include"chiredis/connect.h"
 
 void disconnect_after_connect(){
-    init_global();
     clusterInfo *cluster = connectRedis("127.0.0.1",6667);
     if(cluster != NULL) {
         printf("connected to cluster\n");
@@ -15,12 +14,11 @@ void disconnect_after_connect(){
     char key[10] = "key";
     char value[10] = "value";
     
-    set(cluster,key,value,1,1);
-    get(cluster,key,value,1,1);
+    set(cluster,key,value,1);
+    get(cluster,key,value,1);
     printf("get value= %s\n",value);
     
     disconnectDatabase(cluster);
-    release_global();
 }
 
 int main() {
@@ -48,25 +48,25 @@ void *__db_function(void* thread_input) {
 
   sprintf(value,"%s","aaaaa");
 
-  sum += set(cluster,key,value,1,my_tid);
-  sum += get(cluster,key,value,1,my_tid);
+  sum += set(cluster,key,value,1);
+  sum += get(cluster,key,value,1);
   printf("get %s: %s\n",key,value);
 
 
   sprintf(value,"%s","ffffff");
-  sum += set(cluster,key,value,1,my_tid);
-  sum += get(cluster,key,value,1,my_tid);
+  sum += set(cluster,key,value,1);
+  sum += get(cluster,key,value,1);
   printf("get %s:%s\n",key,value);
 
 
   sprintf(value,"%s","aefde");
-  sum += set(cluster,key,value,1,my_tid);
-  sum += get(cluster,key,value,1,my_tid);
+  sum += set(cluster,key,value,1);
+  sum += get(cluster,key,value,1);
   printf("get %s: %s\n",key,value);
 
   sprintf(value,"%s","abcdefads");
-  sum += set(cluster,key,value,1,my_tid);
-  sum += get(cluster,key,value,1,my_tid);
+  sum += set(cluster,key,value,1);
+  sum += get(cluster,key,value,1);
   printf("get %s: %s\n",key,value);
   
   if(sum == 0)
@@ -93,7 +93,6 @@ void test_with_multiple_threads(char*ip,int port) {
     thread_input[i].tid = i;
  }
 
- init_global();//shared memory which allows less than 16 threads
 
  int thread[16]={1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16};
  for(i=0;i<16;i++){ 
@@ -113,7 +112,6 @@ void test_with_multiple_threads(char*ip,int port) {
      }
   }
 
-  release_global();
 
 }
 
@@ -0,0 +1,110 @@
+/*
+*sets per second from one thread, with blocking setn and with an asyncCluster keeping a growing number
+*of commands in flight. The cluster is a mock process forked by the benchmark, no redis cluster is needed:
+*    ./asyncBench [sets]
+*/
+#include"chiredis/connect.h"
+#include"chiredis/async_connect.h"
+#include"benchmarkHelp.h"
+#include<stdio.h>
+#include<string.h>
+#include<stdlib.h>
+
+#define MOCK_BASE_PORT 17300
+#define MOCK_NODES 3
+
+typedef struct asyncRun{
+    asyncCluster* cluster;
+    asyncEventLoop* loop;
+    char** keys;
+    unsigned long total;
+    unsigned long sent;
+    unsigned long done;
+}asyncRun;
+
+static void __on_set(asyncCluster* cluster, redisReply* reply, void* privdata);
+
+//every reply makes room for the next set, so the number in flight stays the same until the end
+static void __send_next(asyncRun* run) {
+    if(run->sent == run->total)
+        return;
+    const char* key = run->keys[run->sent++];
+    if(async_setn(run->cluster,__on_set,run,key,strlen(key),"value",5) != 0) {
+        printf("async_setn failed\n");
+        exit(1);
+    }
+}
+
+static void __on_set(asyncCluster* cluster, redisReply* reply, void* privdata) {
+    asyncRun* run = (asyncRun*)privdata;
+    if(reply == NULL || reply->type != REDIS_REPLY_STATUS) {
+        printf("set failed\n");
+        exit(1);
+    }
+    run->done++;
+    if(run->done == run->total)
+        async_loop_stop(run->loop);
+    else
+        __send_next(run);
+}
+
+static double __time_blocking(clusterInfo* cluster, char** keys, unsigned long total) {
+    unsigned long i;
+    long long start = us_time();
+    for(i=0;i<total;i++){
+        if(setn(cluster,keys[i],strlen(keys[i]),"value",5,-1) != 0){
+            printf("setn failed\n");
+            exit(1);
+        }
+    }
+    return (double)total*1000000/(us_time()-start);
+}
+
+static double __time_async(asyncEventLoop* loop, char** keys, unsigned long total, int in_flight) {
+    asyncRun run = {NULL,loop,keys,total,0,0};
+    run.cluster = async_connect("127.0.0.1",MOCK_BASE_PORT,NULL,loop);
+    if(run.cluster == NULL)
+        exit(1);
+    int i;
+    long long start = us_time();
+    for(i=0;i<in_flight;i++)
+        __send_next(&run);
+    async_loop_run(loop);
+    long long end = us_time();
+    async_disconnect(run.cluster);
+    async_loop_run_once(loop,100);
+    return (double)total*1000000/(end-start);
+}
+
+int main(int argc, char** argv) {
+    unsigned long total = argc > 1 ? strtoul(argv[1],NULL,10) : 200000;
+    int in_flight[] = {1,10,100,1000,10000};
+    unsigned long i;
+
+    char** keys = (char**)malloc(sizeof(char*)*total);
+    for(i=0;i<total;i++){
+        keys[i] = (char*)malloc(32);
+        sprintf(keys[i],"key:%lu",i);
+    }
+
+    int pid = startMockCluster(MOCK_NODES,MOCK_BASE_PORT);
+    if(pid < 0)
+        return 1;
+    clusterInfo* cluster = connectRedis("127.0.0.1",MOCK_BASE_PORT);
+    if(cluster == NULL)
+        return 1;
+    asyncEventLoop* loop = async_loop_create();
+
+    printf("%10s %14s\n","in flight","sets/s");
+    printf("%10s %14.0f\n","blocking",__time_blocking(cluster,keys,total));
+    for(i=0;i<sizeof(in_flight)/sizeof(int);i++)
+        printf("%10d %14.0f\n",in_flight[i],__time_async(loop,keys,total,in_flight[i]));
+
+    async_loop_release(loop);
+    disconnectDatabase(cluster);
+    stopMockCluster(pid);
+    for(i=0;i<total;i++)
+        free(keys[i]);
+    free(keys);
+    return 0;
+}
@@ -7,6 +7,13 @@
 #include<dirent.h>
 #include<errno.h>
 #include<sys/stat.h>
+#include<signal.h>
+#include<poll.h>
+#include<sys/wait.h>
+#include<sys/socket.h>
+#include<netinet/in.h>
+#include<arpa/inet.h>
+#include<netinet/tcp.h>
 #include"benchmarkHelp.h"
 
 static void __process_kv_config (benchmarkConfig *config, char *key, char *value);
@@ -262,3 +269,208 @@ benchmarkConfig *init_config() {
 
     return config;
 }
+
+/*
+*build the RESP text of a cluster slots reply for a cluster of nodeCount masters. Each master
+*owns rangesPerNode ranges which are not adjacent, as after a rebalance. Feed it to a redisReader
+*to benchmark the layout code without a real cluster.
+*/
+char* fakeSlotsReply(int nodeCount, int rangesPerNode, size_t* len) {
+    return fakeSlotsReplyAt(nodeCount,rangesPerNode,7000,len);
+}
+
+/*
+*same as fakeSlotsReply, node i listens on basePort+i
+*/
+char* fakeSlotsReplyAt(int nodeCount, int rangesPerNode, int basePort, size_t* len) {
+    int ranges = nodeCount*rangesPerNode;
+    char* buf = (char*)malloc((size_t)ranges*128 + 32);
+    if(buf == NULL){
+        printf("malloc fail %s %d\n",__FILE__,__LINE__);
+        return NULL;
+    }
+    size_t used = 0;
+    int i;
+    used += sprintf(buf+used,"*%d\r\n",ranges);
+    for(i=0;i<ranges;i++){
+        int start = (int)((long)16384*i/ranges);
+        int end = (int)((long)16384*(i+1)/ranges) - 1;
+        int node = i % nodeCount;
+        char id[48];
+        sprintf(id,"%040d",node);
+        used += sprintf(buf+used,"*3\r\n:%d\r\n:%d\r\n*3\r\n$9\r\n127.0.0.1\r\n:%d\r\n$40\r\n%s\r\n",start,end,basePort+node,id);
+    }
+    *len = used;
+    return buf;
+}
+
+/*
+*length of the first request in buf, 0 if it is not complete yet. name points at the command name,
+*argc_out gets the number of arguments including the name.
+*/
+static size_t __mock_request(char* buf, size_t len, char** name, long* name_len, long* argc_out) {
+    char* end = buf+len;
+    char* p = memchr(buf,'\n',len);
+    if(buf[0] != '*' || p == NULL)
+        return 0;
+    long argc = strtol(buf+1,NULL,10);
+    *argc_out = argc;
+    p++;
+    long i;
+    for(i=0;i<argc;i++){
+        char* line = memchr(p,'\n',end-p);
+        if(p >= end || *p != '$' || line == NULL)
+            return 0;
+        long arg_len = strtol(p+1,NULL,10);
+        p = line+1;
+        if(end-p < arg_len+2)
+            return 0;
+        if(i == 0){
+            *name = p;
+            *name_len = arg_len;
+        }
+        p += arg_len+2;
+    }
+    return p-buf;
+}
+
+//an array of count nils, the answer to an MGET of keys that don't exist
+static void __mock_nils(int fd, long count) {
+    char* out = (char*)malloc(32 + count*5);
+    size_t used = sprintf(out,"*%ld\r\n",count);
+    long i;
+    for(i=0;i<count;i++){
+        memcpy(out+used,"$-1\r\n",5);
+        used += 5;
+    }
+    write(fd,out,used);
+    free(out);
+}
+
+typedef struct mockClient {
+    char buf[16384];
+    size_t used;
+} mockClient;
+
+static void __mock_serve(int nodeCount, int basePort) {
+    size_t slots_len;
+    char* slots = fakeSlotsReplyAt(nodeCount,1,basePort,&slots_len);
+    int capacity = nodeCount*4 + 16;
+    struct pollfd* fds = (struct pollfd*)calloc(capacity,sizeof(struct pollfd));
+    mockClient** clients = (mockClient**)calloc(capacity,sizeof(mockClient*));
+    int count = 0;
+    int i;
+
+    for(i=0;i<nodeCount;i++){
+        int fd = socket(AF_INET,SOCK_STREAM,0);
+        int on = 1;
+        setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on));
+        struct sockaddr_in addr;
+        memset(&addr,0,sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(basePort+i);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if(bind(fd,(struct sockaddr*)&addr,sizeof(addr)) != 0 || listen(fd,128) != 0){
+            printf("mock node unable to listen on %d\n",basePort+i);
+            _exit(1);
+        }
+        fds[count].fd = fd;
+        fds[count].events = POLLIN;
+        count++;
+    }
+
+    while(poll(fds,count,-1) >= 0){
+        for(i=0;i<count;i++){
+            if(!(fds[i].revents & (POLLIN|POLLHUP|POLLERR)))
+                continue;
+            if(i < nodeCount){
+                int fd = accept(fds[i].fd,NULL,NULL);
+                if(fd < 0)
+                    continue;
+                if(count == capacity){
+                    //one client per thread and node when many threads connect each on their own
+                    capacity *= 2;
+                    fds = (struct pollfd*)realloc(fds,sizeof(struct pollfd)*capacity);
+                    clients = (mockClient**)realloc(clients,sizeof(mockClient*)*capacity);
+                }
+                //like redis, replies written one by one must not wait for delayed ACKs
+                int on = 1;
+                setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on));
+                fds[count].fd = fd;
+                fds[count].events = POLLIN;
+                fds[count].revents = 0;
+                clients[count] = (mockClient*)calloc(1,sizeof(mockClient));
+                count++;
+                continue;
+            }
+            mockClient* c = clients[i];
+            ssize_t n = read(fds[i].fd,c->buf+c->used,sizeof(c->buf)-c->used);
+            if(n <= 0){
+                close(fds[i].fd);
+                free(c);
+                count--;
+                fds[i] = fds[count];
+                clients[i] = clients[count];
+                i--;
+                continue;
+            }
+            c->used += n;
+            char* name = NULL;
+            long name_len = 0;
+            long argc;
+            size_t request_len;
+            while(c->used > 0 && (request_len = __mock_request(c->buf,c->used,&name,&name_len,&argc)) > 0){
+                if(name_len == 7 && strncasecmp(name,"cluster",7) == 0)
+                    write(fds[i].fd,slots,slots_len);
+                else if(name_len == 3 && strncasecmp(name,"get",3) == 0)
+                    write(fds[i].fd,"$-1\r\n",5);
+                else if(name_len == 4 && strncasecmp(name,"mget",4) == 0)
+                    __mock_nils(fds[i].fd,argc-1);
+                else
+                    write(fds[i].fd,"+OK\r\n",5);
+                memmove(c->buf,c->buf+request_len,c->used-request_len);
+                c->used -= request_len;
+            }
+        }
+    }
+    _exit(0);
+}
+
+/*
+*fork a process which pretends to be a cluster of nodeCount masters listening on basePort and up.
+*It answers cluster slots with fakeSlotsReplyAt, get and mget with nil and anything else with OK, enough
+*to measure the client side of connecting and routing. returns the pid for stopMockCluster, -1 on errors.
+*/
+int startMockCluster(int nodeCount, int basePort) {
+    pid_t pid = fork();
+    if(pid < 0){
+        printf("fork fail %s %d\n",__FILE__,__LINE__);
+        return -1;
+    }
+    if(pid == 0)
+        __mock_serve(nodeCount,basePort);
+
+    //wait until the last node accepts connections
+    int tries;
+    for(tries=0;tries<200;tries++){
+        int fd = socket(AF_INET,SOCK_STREAM,0);
+        struct sockaddr_in addr;
+        memset(&addr,0,sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(basePort+nodeCount-1);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int ok = connect(fd,(struct sockaddr*)&addr,sizeof(addr)) == 0;
+        close(fd);
+        if(ok)
+            return pid;
+        usleep(10000);
+    }
+    printf("mock cluster did not start\n");
+    stopMockCluster(pid);
+    return -1;
+}
+
+void stopMockCluster(int pid) {
+    kill(pid,SIGTERM);
+    waitpid(pid,NULL,0);
+}
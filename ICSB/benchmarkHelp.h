@@ -58,4 +58,10 @@ void setFileName(benchmarkInfo* benchmark,char* name);
 benchmarkConfig *init_config();
 
 void show_config();
+
+char* fakeSlotsReply(int nodeCount, int rangesPerNode, size_t* len);
+char* fakeSlotsReplyAt(int nodeCount, int rangesPerNode, int basePort, size_t* len);
+
+int startMockCluster(int nodeCount, int basePort);
+void stopMockCluster(int pid);
 #endif
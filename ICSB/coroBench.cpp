@@ -0,0 +1,160 @@
+/*
+*sets per second from one thread through an asyncCluster, with callbacks and with the C++20 coroutines of
+*async_connect.hpp keeping the same number of sets in flight. The cluster is a mock process forked by the
+*benchmark, no redis cluster is needed:
+*    ./coroBench [sets]
+*/
+#include "chiredis/async_connect.hpp"
+extern "C" {
+#include "benchmarkHelp.h"
+}
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#define MOCK_BASE_PORT 17400
+#define MOCK_NODES 3
+
+struct callbackRun {
+    asyncCluster* cluster;
+    asyncEventLoop* loop;
+    const std::vector<std::string>* keys;
+    size_t sent;
+    size_t done;
+};
+
+static void __on_set(asyncCluster* cluster,redisReply* reply,void* privdata);
+
+static void __send_next(callbackRun* run) {
+    if(run->sent == run->keys->size())
+        return;
+    const std::string& key = (*run->keys)[run->sent++];
+    if(async_setn(run->cluster,__on_set,run,key.data(),key.size(),"value",5) != 0){
+        printf("async_setn failed\n");
+        exit(1);
+    }
+}
+
+static void __on_set(asyncCluster* cluster,redisReply* reply,void* privdata) {
+    callbackRun* run = static_cast<callbackRun*>(privdata);
+    if(reply == NULL || reply->type != REDIS_REPLY_STATUS){
+        printf("set failed\n");
+        exit(1);
+    }
+    if(++run->done == run->keys->size())
+        async_loop_stop(run->loop);
+    else
+        __send_next(run);
+}
+
+static double __time_callbacks(asyncEventLoop* loop,const std::vector<std::string>& keys,int in_flight) {
+    callbackRun run = {async_connect("127.0.0.1",MOCK_BASE_PORT,NULL,loop),loop,&keys,0,0};
+    if(run.cluster == NULL)
+        exit(1);
+    long long start = us_time();
+    for(int i=0;i<in_flight;i++)
+        __send_next(&run);
+    async_loop_run(loop);
+    long long end = us_time();
+    async_disconnect(run.cluster);
+    async_loop_run_once(loop,100);
+    return (double)keys.size()*1000000/(end-start);
+}
+
+struct coroRun {
+    asyncEventLoop* loop;
+    const std::vector<std::string>* keys;
+    size_t next;
+    int running;
+};
+
+//every coroutine takes the next key once its set is answered, like a callback sending the next one
+static chiredis::Task __setter(chiredis::Cluster& cluster,coroRun& run) {
+    while(run.next < run.keys->size()){
+        const std::string& key = (*run.keys)[run.next++];
+        chiredis::Reply reply = co_await cluster.set(key,"value");
+        if(!reply || reply.type() != REDIS_REPLY_STATUS){
+            printf("set failed\n");
+            exit(1);
+        }
+    }
+    if(--run.running == 0)
+        async_loop_stop(run.loop);
+}
+
+static double __time_coroutines(asyncEventLoop* loop,const std::vector<std::string>& keys,int in_flight) {
+    coroRun run = {loop,&keys,0,in_flight};
+    double rate;
+    {
+        chiredis::Cluster cluster("127.0.0.1",MOCK_BASE_PORT,loop);
+        if(!cluster)
+            exit(1);
+        long long start = us_time();
+        for(int i=0;i<in_flight;i++)
+            __setter(cluster,run);
+        async_loop_run(loop);
+        rate = (double)keys.size()*1000000/(us_time()-start);
+    }
+    async_loop_run_once(loop,100);
+    return rate;
+}
+
+//one coroutine sending batches of in_flight sets with when_all
+static chiredis::Task __batcher(chiredis::Cluster& cluster,coroRun& run,int in_flight) {
+    std::vector<chiredis::Request> batch;
+    batch.reserve(in_flight);
+    while(run.next < run.keys->size()){
+        batch.clear();
+        for(int i=0;i<in_flight && run.next<run.keys->size();i++)
+            batch.push_back(cluster.set((*run.keys)[run.next++],"value"));
+        if(co_await chiredis::when_all(batch) != 0){
+            printf("set failed\n");
+            exit(1);
+        }
+    }
+    async_loop_stop(run.loop);
+}
+
+static double __time_when_all(asyncEventLoop* loop,const std::vector<std::string>& keys,int in_flight) {
+    coroRun run = {loop,&keys,0,1};
+    double rate;
+    {
+        chiredis::Cluster cluster("127.0.0.1",MOCK_BASE_PORT,loop);
+        if(!cluster)
+            exit(1);
+        long long start = us_time();
+        __batcher(cluster,run,in_flight);
+        async_loop_run(loop);
+        rate = (double)keys.size()*1000000/(us_time()-start);
+    }
+    async_loop_run_once(loop,100);
+    return rate;
+}
+
+int main(int argc,char** argv) {
+    size_t total = argc > 1 ? strtoul(argv[1],NULL,10) : 200000;
+    int in_flight[] = {1,10,100,1000};
+
+    std::vector<std::string> keys;
+    keys.reserve(total);
+    for(size_t i=0;i<total;i++)
+        keys.push_back("key:" + std::to_string(i));
+
+    int pid = startMockCluster(MOCK_NODES,MOCK_BASE_PORT);
+    if(pid < 0)
+        return 1;
+    asyncEventLoop* loop = async_loop_create();
+
+    printf("%10s %14s %14s %14s\n","in flight","callbacks/s","co_await/s","when_all/s");
+    for(size_t i=0;i<sizeof(in_flight)/sizeof(int);i++){
+        double callbacks = __time_callbacks(loop,keys,in_flight[i]);
+        double coroutines = __time_coroutines(loop,keys,in_flight[i]);
+        double batches = __time_when_all(loop,keys,in_flight[i]);
+        printf("%10d %14.0f %14.0f %14.0f\n",in_flight[i],callbacks,coroutines,batches);
+    }
+
+    async_loop_release(loop);
+    stopMockCluster(pid);
+    return 0;
+}
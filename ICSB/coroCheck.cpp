@@ -0,0 +1,200 @@
+/*
+*checks the C++20 coroutines of async_connect.hpp against the redirecting mock of redirectMock.h: every
+*co_await and every Request of a when_all has to resume with the reply of its own command while MOVED
+*and ASK are followed below it. The mock is forked by the check, no redis cluster is needed:
+*    ./coroCheck
+*prints every mismatch and exits with 1 if there was any. It needs g++ with -std=c++20.
+*/
+#include "chiredis/async_connect.hpp"
+extern "C" {
+#include "chiredis/crc16.h"
+#include "redirectMock.h"
+}
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#define CHECK_BASE_PORT 17800
+//a quarter of the keys in each kind of slot
+#define CHECK_KEYS 256
+#define CHECK_COROUTINES 32
+//pairs of the MSET sent as one command, more arguments than Request::inline_args
+#define CHECK_LONG_PAIRS 12
+
+enum {KIND_MOVED,KIND_ASK,KIND_OUTSIDE,KIND_PLAIN,KINDS};
+static const char* kind_tags[KINDS] = {"{moved}","{ask}","{outside}",""};
+
+struct checkRun {
+    asyncEventLoop* loop;
+    int slots[KINDS-1];
+    std::vector<std::string> keys;
+    int running;
+    int failures;
+};
+
+static std::string __value(int round,const std::string& key) {
+    return "round:" + std::to_string(round) + ":" + key;
+}
+
+static int __kind(const checkRun& run,const std::string& key) {
+    int slot = keyHashSlot(key.data(),(int)key.size());
+    for(int kind=0;kind<KIND_PLAIN;kind++){
+        if(run.slots[kind] == slot)
+            return kind;
+    }
+    return KIND_PLAIN;
+}
+
+static void __finished(checkRun& run) {
+    if(--run.running == 0)
+        async_loop_stop(run.loop);
+}
+
+/*
+*a node outside the layout is not followed, its ASK is what the coroutine resumes with. Anything else
+*has to be value, or OK for a set.
+*/
+static bool __expected(const checkRun& run,const std::string& key,int type,std::string_view str,const std::string* value) {
+    if(__kind(run,key) == KIND_OUTSIDE)
+        return type == REDIS_REPLY_ERROR && str.substr(0,4) == "ASK ";
+    if(value == nullptr)
+        return type == REDIS_REPLY_STATUS;
+    return type == REDIS_REPLY_STRING && str == *value;
+}
+
+//every coroutine sets a key and reads it back right away, the read follows the redirect of the set
+static chiredis::Task __set_get(chiredis::Cluster& cluster,checkRun& run,int first,int round) {
+    for(size_t i=first;i<run.keys.size();i+=CHECK_COROUTINES){
+        const std::string& key = run.keys[i];
+        std::string value = __value(round,key);
+        chiredis::Reply set = co_await cluster.set(key,value);
+        if(!__expected(run,key,set.type(),set.str(),nullptr)){
+            printf("co_await set of %s got %.*s\n",key.c_str(),(int)set.str().size(),set.str().data());
+            run.failures++;
+        }
+        chiredis::Reply get = co_await cluster.get(key);
+        if(!__expected(run,key,get.type(),get.str(),&value)){
+            printf("co_await get of %s got %.*s, expected %s\n",key.c_str(),(int)get.str().size(),get.str().data(),
+                   value.c_str());
+            run.failures++;
+        }
+    }
+    __finished(run);
+}
+
+//every get of the round at once, each Request has to keep the value of its own key
+static chiredis::Task __get_all(chiredis::Cluster& cluster,checkRun& run,int round) {
+    std::vector<chiredis::Request> batch;
+    batch.reserve(run.keys.size());
+    for(const std::string& key : run.keys)
+        batch.push_back(cluster.get(key));
+    if(co_await chiredis::when_all(batch) != 0){
+        printf("when_all lost replies\n");
+        run.failures++;
+    }
+    for(size_t i=0;i<batch.size();i++){
+        std::string value = __value(round,run.keys[i]);
+        const chiredis::Value& got = batch[i].value();
+        if(!__expected(run,run.keys[i],got.type,got.str,&value)){
+            printf("when_all get of %s got %s, expected %s\n",run.keys[i].c_str(),got.str.c_str(),value.c_str());
+            run.failures++;
+        }
+    }
+    __finished(run);
+}
+
+//an MSET of keys sharing a redirected slot, sent from the arrays sized when its Request is made
+static chiredis::Task __long_mset(chiredis::Cluster& cluster,checkRun& run,int kind) {
+    std::vector<std::string> words;
+    words.reserve(1+2*CHECK_LONG_PAIRS);
+    words.push_back("mset");
+    for(int i=0;i<CHECK_LONG_PAIRS;i++){
+        words.push_back(std::string(kind_tags[kind]) + "long:" + std::to_string(i));
+        words.push_back("long:" + std::to_string(i));
+    }
+    std::vector<std::string_view> args(words.begin(),words.end());
+    chiredis::Reply reply = co_await cluster.command(args);
+    if(!reply || reply.type() != REDIS_REPLY_STATUS){
+        printf("co_await mset of %s keys got %.*s\n",kind_tags[kind],(int)reply.str().size(),reply.str().data());
+        run.failures++;
+    }
+    for(int i=0;i<CHECK_LONG_PAIRS;i++){
+        const std::string& key = words[1+2*i];
+        chiredis::Reply get = co_await cluster.get(key);
+        if(get.type() != REDIS_REPLY_STRING || get.str() != words[2+2*i]){
+            printf("co_await get of %s got %.*s, expected %s\n",key.c_str(),(int)get.str().size(),get.str().data(),
+                   words[2+2*i].c_str());
+            run.failures++;
+        }
+    }
+    __finished(run);
+}
+
+static int __redirects(long long& moved,long long& asked) {
+    long long stray;
+    if(redirectMockStats(CHECK_BASE_PORT,&moved,&asked,&stray) != 0)
+        return 1;
+    if(stray != 0){
+        printf("%lld ASKING were not followed by the command they were sent for\n",stray);
+        return 1;
+    }
+    return 0;
+}
+
+int main() {
+    checkRun run;
+    run.running = 0;
+    run.failures = 0;
+    for(int i=0;i<KINDS-1;i++){
+        //the tag without its braces
+        run.slots[i] = keyHashSlot(kind_tags[i]+1,(int)strlen(kind_tags[i])-2);
+        for(int j=0;j<i;j++){
+            if(run.slots[i] == run.slots[j]){
+                printf("%s and %s hash to the same slot\n",kind_tags[i],kind_tags[j]);
+                return 1;
+            }
+        }
+    }
+    for(int i=0;i<CHECK_KEYS;i++)
+        run.keys.push_back(std::string(kind_tags[i%KINDS]) + "key:" + std::to_string(i));
+
+    int pid = startRedirectMock(CHECK_BASE_PORT,run.slots[KIND_MOVED],run.slots[KIND_ASK],run.slots[KIND_OUTSIDE]);
+    if(pid < 0)
+        return 1;
+    run.loop = async_loop_create();
+    {
+        chiredis::Cluster cluster("127.0.0.1",CHECK_BASE_PORT,run.loop);
+        if(!cluster){
+            async_loop_release(run.loop);
+            stopRedirectMock(pid);
+            return 1;
+        }
+        for(int round=0;round<2;round++){
+            run.running = CHECK_COROUTINES;
+            for(int i=0;i<CHECK_COROUTINES;i++)
+                __set_get(cluster,run,i,round);
+            async_loop_run(run.loop);
+            run.running = 1;
+            __get_all(cluster,run,round);
+            async_loop_run(run.loop);
+        }
+        run.running = 2;
+        __long_mset(cluster,run,KIND_MOVED);
+        __long_mset(cluster,run,KIND_ASK);
+        async_loop_run(run.loop);
+    }
+    async_loop_run_once(run.loop,100);
+    async_loop_release(run.loop);
+
+    long long moved = 0,asked = 0;
+    run.failures += __redirects(moved,asked);
+    if(moved == 0 || asked == 0){
+        printf("the mock sent %lld MOVED and %lld ASK, expected both\n",moved,asked);
+        run.failures++;
+    }
+    stopRedirectMock(pid);
+    printf(run.failures == 0 ? "coroCheck passed\n" : "coroCheck failed\n");
+    return run.failures == 0 ? 0 : 1;
+}
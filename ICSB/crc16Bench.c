@@ -0,0 +1,94 @@
+/*
+*compare the crc16 kernels on keys of 4 to 1024 bytes: the old byte at a time loop, slicing-by-8,
+*carry-less multiply folding when the CPU has PCLMULQDQ, and crc16() which dispatches between them.
+*the last column hashes whole arrays of keys into slots with keyHashSlots, to be compared with
+*keyHashSlot called once per key. every kernel is checked against the old loop first.
+*no redis cluster is needed:
+*    ./crc16Bench [keys per length]
+*/
+#include<stdio.h>
+#include<string.h>
+#include<stdlib.h>
+#include"chiredis/crc16.h"
+#include"benchmarkHelp.h"
+
+#define KEY_COUNT 1024
+
+typedef uint16_t (*crcKernel)(const char* buf, int len);
+
+//returns M keys per second
+static double __run(crcKernel kernel, char** keys, int len, long rounds, unsigned long* sum) {
+    long i;
+    long long start = us_time();
+    for(i=0;i<rounds;i++)
+        *sum += kernel(keys[i&(KEY_COUNT-1)],len);
+    long long end = us_time();
+    return (double)rounds/(end-start);
+}
+
+static double __run_single(char** keys, int len, long rounds, unsigned long* sum) {
+    long i;
+    long long start = us_time();
+    for(i=0;i<rounds;i++)
+        *sum += keyHashSlot(keys[i&(KEY_COUNT-1)],len);
+    long long end = us_time();
+    return (double)rounds/(end-start);
+}
+
+static double __run_batch(char** keys, int len, long rounds, unsigned long* sum) {
+    int lens[KEY_COUNT];
+    uint16_t slots[KEY_COUNT];
+    long i;
+    int j;
+    for(j=0;j<KEY_COUNT;j++)
+        lens[j] = len;
+    long long start = us_time();
+    for(i=0;i<rounds;i+=KEY_COUNT){
+        keyHashSlots((const char**)keys,lens,KEY_COUNT,slots);
+        *sum += slots[i&(KEY_COUNT-1)];
+    }
+    long long end = us_time();
+    return (double)i/(end-start);
+}
+
+int main(int argc, char** argv) {
+    long rounds = argc > 1 ? atol(argv[1]) : 2000000;
+    int lengths[] = {4,8,16,32,40,64,100,128,200,256,512,1024};
+    int n = sizeof(lengths)/sizeof(int);
+    char* keys[KEY_COUNT];
+    unsigned long sum = 0;
+    int i,j;
+
+    for(i=0;i<KEY_COUNT;i++){
+        keys[i] = (char*)malloc(1024);
+        for(j=0;j<1024;j++)
+            keys[i][j] = 'a' + rand()%26;
+    }
+    for(i=0;i<n;i++){
+        for(j=0;j<KEY_COUNT;j++){
+            uint16_t expect = crc16_bytewise(keys[j],lengths[i]);
+            if(crc16_slice8(keys[j],lengths[i]) != expect || crc16_clmul(keys[j],lengths[i]) != expect ||
+               crc16(keys[j],lengths[i]) != expect){
+                printf("crc mismatch for a key of %d bytes\n",lengths[i]);
+                return 1;
+            }
+        }
+    }
+
+    printf("M keys/s, pclmulqdq %s\n",crc16_has_clmul() ? "available" : "not available");
+    printf("%6s %10s %10s %10s %10s %10s %10s\n","bytes","bytewise","slice8","clmul","crc16","slot","slots");
+    for(i=0;i<n;i++){
+        int len = lengths[i];
+        //longer keys get fewer rounds so every row takes about the same time
+        long r = rounds*16/(len+16);
+        double bytewise = __run(crc16_bytewise,keys,len,r,&sum);
+        double slice8 = __run(crc16_slice8,keys,len,r,&sum);
+        double clmul = __run(crc16_clmul,keys,len,r,&sum);
+        double dispatch = __run(crc16,keys,len,r,&sum);
+        double single = __run_single(keys,len,r,&sum);
+        double batch = __run_batch(keys,len,r,&sum);
+        printf("%6d %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",len,bytewise,slice8,clmul,dispatch,single,batch);
+    }
+    printf("checksum %lu\n",sum);
+    return 0;
+}
@@ -0,0 +1,113 @@
+/*
+*measure what it costs to encode one SET into RESP, the way set and the pipelines used to do it
+*with a "set %s %s" format string, with the binary-safe "%b" format, and with the argv and
+*length arrays the library uses now. The frame built from argv is parsed back to check that a
+*value holding '\0' and "\r\n" survives. no redis cluster is needed:
+*    ./encodeBench [commands per size]
+*/
+#include<stdio.h>
+#include<string.h>
+#include<stdlib.h>
+#include<hiredis/hiredis.h>
+#include"benchmarkHelp.h"
+
+#define KEY_LEN 16
+
+//returns ns per command
+static double __run_format(const char* key, const char* value, long rounds, long* sum) {
+    long i;
+    char* cmd;
+    long long start = us_time();
+    for(i=0;i<rounds;i++){
+        *sum += redisFormatCommand(&cmd,"set %s %s",key,value);
+        free(cmd);
+    }
+    long long end = us_time();
+    return (double)(end-start)*1000/rounds;
+}
+
+static double __run_binary_format(const char* key, const char* value, size_t valuelen, long rounds, long* sum) {
+    long i;
+    char* cmd;
+    long long start = us_time();
+    for(i=0;i<rounds;i++){
+        *sum += redisFormatCommand(&cmd,"set %b %b",key,(size_t)KEY_LEN,value,valuelen);
+        free(cmd);
+    }
+    long long end = us_time();
+    return (double)(end-start)*1000/rounds;
+}
+
+static double __run_argv(const char* key, const char* value, size_t valuelen, long rounds, long* sum) {
+    long i;
+    char* cmd;
+    const char* argv[3] = {"set",key,value};
+    size_t argvlen[3] = {3,KEY_LEN,valuelen};
+    long long start = us_time();
+    for(i=0;i<rounds;i++){
+        *sum += redisFormatCommandArgv(&cmd,3,argv,argvlen);
+        free(cmd);
+    }
+    long long end = us_time();
+    return (double)(end-start)*1000/rounds;
+}
+
+//encode with argv and read the frame back as the server would, returns 0 if the value is intact
+static int __check_round_trip(const char* key, const char* value, size_t valuelen) {
+    char* cmd;
+    const char* argv[3] = {"set",key,value};
+    size_t argvlen[3] = {3,KEY_LEN,valuelen};
+    int len = redisFormatCommandArgv(&cmd,3,argv,argvlen);
+
+    redisReader* reader = redisReaderCreate();
+    void* reply = NULL;
+    redisReaderFeed(reader,cmd,len);
+    int ok = redisReaderGetReply(reader,&reply) == REDIS_OK && reply != NULL;
+    redisReply* r = (redisReply*)reply;
+    ok = ok && r->type == REDIS_REPLY_ARRAY && r->elements == 3 &&
+         (size_t)r->element[2]->len == valuelen && memcmp(r->element[2]->str,value,valuelen) == 0;
+    if(reply != NULL)
+        freeReplyObject(reply);
+    redisReaderFree(reader);
+    free(cmd);
+    return ok ? 0 : -1;
+}
+
+int main(int argc, char** argv) {
+    long rounds = argc > 1 ? atol(argv[1]) : 1000000;
+    int sizes[] = {8,64,512,4096,32768};
+    int n = sizeof(sizes)/sizeof(int);
+    int i,j;
+    long sum = 0;
+
+    char key[KEY_LEN+1];
+    for(j=0;j<KEY_LEN;j++)
+        key[j] = 'a' + j;
+    key[KEY_LEN] = '\0';
+
+    printf("%8s %14s %14s %14s\n","bytes","\"%s\" ns/op","\"%b\" ns/op","argv ns/op");
+    for(i=0;i<n;i++){
+        //printable so that "%s" encodes the whole value as well
+        char* value = (char*)malloc(sizes[i]+1);
+        for(j=0;j<sizes[i];j++)
+            value[j] = 'a' + j%26;
+        value[sizes[i]] = '\0';
+
+        long r = sizes[i] > 4096 ? rounds/8 : rounds;
+        double fmt = __run_format(key,value,r,&sum);
+        double bin = __run_binary_format(key,value,sizes[i],r,&sum);
+        double arg = __run_argv(key,value,sizes[i],r,&sum);
+        printf("%8d %14.1f %14.1f %14.1f\n",sizes[i],fmt,bin,arg);
+
+        //the same size with the bytes "%s" can't carry
+        for(j=0;j<sizes[i];j++)
+            value[j] = (char)(j*131);
+        if(__check_round_trip(key,value,sizes[i]) != 0){
+            printf("value of %d bytes corrupted by the argv encoding\n",sizes[i]);
+            return 1;
+        }
+        free(value);
+    }
+    printf("binary values round-trip through argv (checksum %ld)\n",sum);
+    return 0;
+}
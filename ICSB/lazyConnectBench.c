@@ -0,0 +1,49 @@
+/*
+*time from connecting to the first completed get, with every node connected up front (connectRedis)
+*and with nodes connected on first use (connectRedisLazy). The clusters are mock processes forked by
+*the benchmark, no redis cluster is needed:
+*    ./lazyConnectBench [rounds]
+*/
+#include"chiredis/connect.h"
+#include"benchmarkHelp.h"
+#include<stdio.h>
+#include<string.h>
+#include<stdlib.h>
+
+#define MOCK_BASE_PORT 17000
+
+static double __time_to_first_op(int port, int lazy, int rounds) {
+    char value[64];
+    long long total = 0;
+    int i;
+    for(i=0;i<rounds;i++){
+        long long start = us_time();
+        clusterInfo* cluster = lazy ? connectRedisLazy("127.0.0.1",port) : connectRedis("127.0.0.1",port);
+        if(cluster == NULL || get(cluster,"key:0",value,1) != 0){
+            printf("first get failed\n");
+            exit(1);
+        }
+        total += us_time() - start;
+        disconnectDatabase(cluster);
+    }
+    return (double)total/rounds;
+}
+
+int main(int argc, char** argv) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 20;
+    int node_counts[] = {3,30,300};
+    int n = sizeof(node_counts)/sizeof(int);
+    int i;
+
+    printf("%8s %16s %16s\n","nodes","eager us","lazy us");
+    for(i=0;i<n;i++){
+        int pid = startMockCluster(node_counts[i],MOCK_BASE_PORT);
+        if(pid < 0)
+            return 1;
+        double eager = __time_to_first_op(MOCK_BASE_PORT,0,rounds);
+        double lazy = __time_to_first_op(MOCK_BASE_PORT,1,rounds);
+        printf("%8d %16.1f %16.1f\n",node_counts[i],eager,lazy);
+        stopMockCluster(pid);
+    }
+    return 0;
+}
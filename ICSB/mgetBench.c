@@ -0,0 +1,80 @@
+/*
+*time to read a batch of keys spread over the cluster, with one get per key and with cluster_mget,
+*which sends one MGET per slot to every node before reading any reply. The clusters are mock
+*processes forked by the benchmark, no redis cluster is needed:
+*    ./mgetBench [rounds]
+*/
+#include"chiredis/connect.h"
+#include"benchmarkHelp.h"
+#include<stdio.h>
+#include<string.h>
+#include<stdlib.h>
+
+#define MOCK_BASE_PORT 17100
+#define MAX_KEYS 500
+
+static double __time_gets(clusterInfo* cluster, const char** keys, char** values, int count, int rounds) {
+    int i,j;
+    long long start = us_time();
+    for(i=0;i<rounds;i++){
+        for(j=0;j<count;j++){
+            if(get(cluster,keys[j],values[j],1) != 0){
+                printf("get failed\n");
+                exit(1);
+            }
+        }
+    }
+    return (double)(us_time()-start)/rounds;
+}
+
+static double __time_mget(clusterInfo* cluster, const char** keys, char** values, int count, int rounds) {
+    int i;
+    size_t valuelens[MAX_KEYS];
+    int status[MAX_KEYS];
+    long long start = us_time();
+    for(i=0;i<rounds;i++){
+        if(cluster_mget(cluster,keys,count,values,64,valuelens,status,1) != 0){
+            printf("cluster_mget failed\n");
+            exit(1);
+        }
+    }
+    return (double)(us_time()-start)/rounds;
+}
+
+int main(int argc, char** argv) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 50;
+    int node_counts[] = {3,30};
+    int key_counts[] = {50,500};
+    int i,j;
+
+    const char* keys[MAX_KEYS];
+    char* values[MAX_KEYS];
+    for(i=0;i<MAX_KEYS;i++){
+        char* key = (char*)malloc(32);
+        sprintf(key,"key:%d",i);
+        keys[i] = key;
+        values[i] = (char*)malloc(64);
+    }
+
+    printf("%8s %8s %16s %16s\n","nodes","keys","get loop us","cluster_mget us");
+    for(i=0;i<2;i++){
+        int pid = startMockCluster(node_counts[i],MOCK_BASE_PORT);
+        if(pid < 0)
+            return 1;
+        clusterInfo* cluster = connectRedis("127.0.0.1",MOCK_BASE_PORT);
+        if(cluster == NULL)
+            return 1;
+        for(j=0;j<2;j++){
+            double loop = __time_gets(cluster,keys,values,key_counts[j],rounds);
+            double mget = __time_mget(cluster,keys,values,key_counts[j],rounds);
+            printf("%8d %8d %16.1f %16.1f\n",node_counts[i],key_counts[j],loop,mget);
+        }
+        disconnectDatabase(cluster);
+        stopMockCluster(pid);
+    }
+    for(i=0;i<MAX_KEYS;i++){
+        free((void*)keys[i]);
+        free(values[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,138 @@
+/*
+*checks cluster_mset, cluster_mget and their single slot versions against a mock cluster that
+*redirects: one slot has moved to the next node without the layout saying so (MOVED), another is
+*being migrated to the next node (ASK, served there only after ASKING). The mock is forked by the
+*check, no redis cluster is needed:
+*    ./mgetCheck
+*prints every mismatch and exits with 1 if there was any.
+*/
+#include"chiredis/connect.h"
+#include"chiredis/crc16.h"
+#include"redirectMock.h"
+#include<stdio.h>
+#include<string.h>
+#include<stdlib.h>
+
+#define CHECK_BASE_PORT 17600
+#define CHECK_KEYS 64
+#define CHECK_DB 1
+
+//the slot of a key as set and get store it, behind the db prefix
+static int __stored_slot(const char* key) {
+    char prefixed[64];
+    int len = snprintf(prefixed,sizeof(prefixed),"%d\b%s",CHECK_DB,key);
+    return keyHashSlot(prefixed,len);
+}
+
+static int __check_mget(clusterInfo* cluster, const char** keys, const char** expected, int count, size_t capacity,
+                        const char* round) {
+    char* values[CHECK_KEYS+1];
+    size_t valuelens[CHECK_KEYS+1];
+    int status[CHECK_KEYS+1];
+    int i,failures = 0;
+    for(i=0;i<count;i++)
+        values[i] = (char*)malloc(capacity > 0 ? capacity : 1);
+
+    int re = cluster_mget(cluster,keys,count,values,capacity,valuelens,status,CHECK_DB);
+    int want_re = 0;
+    for(i=0;i<count;i++){
+        size_t len = expected[i] != NULL ? strlen(expected[i]) : 0;
+        int want = expected[i] == NULL ? 1 : (len > capacity ? -1 : 0);
+        if(want < 0)
+            want_re = -1;
+        if(status[i] != want || valuelens[i] != len ||
+           (want == 0 && memcmp(values[i],expected[i],len) != 0)){
+            printf("%s: %s got status %d length %lu, expected status %d length %lu\n",round,keys[i],
+                   status[i],(unsigned long)valuelens[i],want,(unsigned long)len);
+            failures++;
+        }
+    }
+    if(re != want_re){
+        printf("%s: cluster_mget returned %d, expected %d\n",round,re,want_re);
+        failures++;
+    }
+    for(i=0;i<count;i++)
+        free(values[i]);
+    return failures;
+}
+
+int main() {
+    const char* keys[CHECK_KEYS+1];
+    const char* values[CHECK_KEYS+1];
+    int i;
+    for(i=0;i<CHECK_KEYS;i++){
+        char* key = (char*)malloc(32);
+        char* value = (char*)malloc(32);
+        sprintf(key,"key:%d",i);
+        sprintf(value,"value:%d",i);
+        keys[i] = key;
+        values[i] = value;
+    }
+    //a stored "nil" has to come back as a value, not as a missing key
+    strcpy((char*)values[1],"nil");
+
+    int moved_slot = __stored_slot(keys[0]);
+    int ask_slot = -1;
+    for(i=1;i<CHECK_KEYS && ask_slot < 0;i++){
+        if(__stored_slot(keys[i]) != moved_slot)
+            ask_slot = __stored_slot(keys[i]);
+    }
+
+    int pid = startRedirectMock(CHECK_BASE_PORT,moved_slot,ask_slot,-1);
+    if(pid < 0)
+        return 1;
+    clusterInfo* cluster = connectRedis("127.0.0.1",CHECK_BASE_PORT);
+    if(cluster == NULL){
+        stopRedirectMock(pid);
+        return 1;
+    }
+
+    int failures = 0;
+    if(cluster_mset(cluster,keys,values,CHECK_KEYS,CHECK_DB) != 0){
+        printf("cluster_mset failed\n");
+        failures++;
+    }
+    //the MOVED slot is patched by the first round, the ASK slot is redirected every time
+    failures += __check_mget(cluster,keys,values,CHECK_KEYS,64,"first mget");
+    failures += __check_mget(cluster,keys,values,CHECK_KEYS,64,"second mget");
+
+    keys[CHECK_KEYS] = "missing";
+    values[CHECK_KEYS] = NULL;
+    failures += __check_mget(cluster,keys,values,CHECK_KEYS+1,64,"missing key");
+    //"value:10" and longer don't fit in 7 bytes, the shorter values still come back
+    failures += __check_mget(cluster,keys,values,CHECK_KEYS+1,7,"small capacity");
+
+    //keys sharing a {hash tag}
+    const char* tagged[3] = {"{key:1}:a","{key:1}:b","{key:1}:c"};
+    const char* tagged_values[3] = {"a","nil","a longer value"};
+    char a[8],b[8],c[8];
+    char* tagged_out[3] = {a,b,c};
+    size_t tagged_lens[3];
+    int tagged_status[3];
+    if(cluster_slot_mset(cluster,tagged,tagged_values,2,CHECK_DB) != 0){
+        printf("cluster_slot_mset failed\n");
+        failures++;
+    }
+    //the third key is missing, the first two fit in 8 bytes
+    if(cluster_slot_mget(cluster,tagged,3,tagged_out,sizeof(a),tagged_lens,tagged_status,CHECK_DB) != 0 ||
+       tagged_status[0] != 0 || tagged_lens[0] != 1 || memcmp(a,"a",1) != 0 ||
+       tagged_status[1] != 0 || tagged_lens[1] != 3 || memcmp(b,"nil",3) != 0 || tagged_status[2] != 1){
+        printf("cluster_slot_mget returned wrong values\n");
+        failures++;
+    }
+    if(cluster_slot_mset(cluster,tagged+2,tagged_values+2,1,CHECK_DB) != 0 ||
+       cluster_slot_mget(cluster,tagged,3,tagged_out,sizeof(a),tagged_lens,tagged_status,CHECK_DB) != -1 ||
+       tagged_status[2] != -1 || tagged_lens[2] != strlen(tagged_values[2])){
+        printf("cluster_slot_mget didn't report a value longer than capacity\n");
+        failures++;
+    }
+
+    disconnectDatabase(cluster);
+    stopRedirectMock(pid);
+    for(i=0;i<CHECK_KEYS;i++){
+        free((void*)keys[i]);
+        free((void*)values[i]);
+    }
+    printf(failures == 0 ? "mgetCheck passed\n" : "mgetCheck failed\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -49,7 +49,7 @@ void *__db_function (void* thread_input){
   for(i=0;i<count;i++){
       long long start = us_time();
       tempPair = getKvPair(benchmark);
-      set(cluster,tempPair->key,tempPair->value,1,my_tid);
+      set(cluster,tempPair->key,tempPair->value,1);
       long long end = us_time();
       addDuration(benchmark,end - start);
   }
@@ -91,7 +91,6 @@ void test_normal_with_multiple_threads (char *ip,int port) {
         thread_input[i].tid = (i+1);
         thread_input[i].bc = bc;
     }
-    init_global();
 
     for(i=0;i<thread_count;i++) { 
         res = pthread_create(&th[i],NULL,__db_function,(void*)(&thread_input[i]));
@@ -0,0 +1,400 @@
+/*
+*checks that the clients which follow redirects on their own give every reply to the command it
+*belongs to, sharedCluster from many threads and asyncCluster with every command in flight at once,
+*and that clusterStream hands redirects over in order and routes by the MOVED ones. The mock of redirectMock.h is forked by the check, no redis cluster is needed:
+*    ./redirectCheck
+*prints every mismatch and exits with 1 if there was any.
+*/
+#include"chiredis/connect.h"
+#include"chiredis/crc16.h"
+#include"chiredis/shared_connect.h"
+#include"chiredis/async_connect.h"
+#include"redirectMock.h"
+#include<stdio.h>
+#include<string.h>
+#include<stdlib.h>
+#include<pthread.h>
+
+#define CHECK_BASE_PORT 17700
+#define CHECK_THREADS 8
+//keys per thread, a quarter of them in each kind of slot
+#define CHECK_KEYS 256
+#define CHECK_ROUNDS 2
+//the key of the checks after the one of sharedCluster, whose threads have the ids below CHECK_THREADS
+#define CHECK_STREAM_ID CHECK_THREADS
+#define CHECK_STREAM_WINDOW 8
+#define CHECK_ASYNC_ID (CHECK_THREADS+1)
+
+//the kinds of slot of the mock, by the hash tag of the key
+enum {KIND_MOVED,KIND_ASK,KIND_OUTSIDE,KIND_PLAIN,KINDS};
+static const char* kind_tags[KINDS] = {"{moved}","{ask}","{outside}",""};
+
+static int __key(char* buf, int tid, int i) {
+    return sprintf(buf,"%skey:%d:%d",kind_tags[i%KINDS],tid,i);
+}
+
+static int __value(char* buf, int round, const char* key) {
+    return sprintf(buf,"round:%d:%s",round,key);
+}
+
+static int __kind(const char* key, int keylen, const int* slots) {
+    int slot = keyHashSlot(key,keylen);
+    int kind;
+    for(kind=0;kind<KIND_PLAIN;kind++){
+        if(slots[kind] == slot)
+            return kind;
+    }
+    return KIND_PLAIN;
+}
+
+static int __is_error(redisReply* reply, const char* prefix) {
+    return reply != NULL && reply->type == REDIS_REPLY_ERROR && !strncmp(reply->str,prefix,strlen(prefix));
+}
+
+static const char* __describe(redisReply* reply) {
+    if(reply == NULL)
+        return "no reply";
+    return reply->str != NULL ? reply->str : "nil";
+}
+
+//the redirects the mock has sent since the last call, and the stray ASKING since it started
+static int __redirects(const char* section, long long* moved, long long* asked) {
+    static long long last_moved,last_asked;
+    long long total_moved,total_asked,stray;
+    if(redirectMockStats(CHECK_BASE_PORT,&total_moved,&total_asked,&stray) != 0)
+        return -1;
+    *moved = total_moved-last_moved;
+    *asked = total_asked-last_asked;
+    last_moved = total_moved;
+    last_asked = total_asked;
+    if(stray != 0){
+        printf("%s: %lld ASKING were not followed by the command they were sent for\n",section,stray);
+        return -1;
+    }
+    return 0;
+}
+
+typedef struct sharedRun{
+    sharedCluster* shared;
+    int tid;
+    int failures;
+}sharedRun;
+
+/*
+*every thread sets and reads its own keys at once, so the ASKING and the command of one thread share
+*a node connection with the commands of the others.
+*/
+static void* __shared_client(void* arg) {
+    sharedRun* run = (sharedRun*)arg;
+    char key[64],value[64];
+    int round,i;
+    for(round=0;round<CHECK_ROUNDS;round++){
+        for(i=0;i<CHECK_KEYS;i++){
+            int keylen = __key(key,run->tid,i);
+            int valuelen = __value(value,round,key);
+            if(shared_setn(run->shared,key,keylen,value,valuelen) != 0){
+                printf("shared_setn of %s failed\n",key);
+                run->failures++;
+            }
+        }
+        for(i=0;i<CHECK_KEYS;i++){
+            int keylen = __key(key,run->tid,i);
+            int valuelen = __value(value,round,key);
+            redisReply* reply = shared_getn(run->shared,key,keylen);
+            if(reply == NULL || reply->type != REDIS_REPLY_STRING || reply->len != (size_t)valuelen ||
+               memcmp(reply->str,value,valuelen) != 0){
+                printf("shared_getn of %s got %s, expected %s\n",key,__describe(reply),value);
+                run->failures++;
+            }
+            if(reply != NULL)
+                freeReplyObject(reply);
+        }
+    }
+    return NULL;
+}
+
+static int __check_shared() {
+    sharedCluster* shared = shared_connect("127.0.0.1",CHECK_BASE_PORT);
+    if(shared == NULL){
+        printf("shared_connect failed\n");
+        return 1;
+    }
+    pthread_t tids[CHECK_THREADS];
+    sharedRun runs[CHECK_THREADS];
+    int i,failures = 0;
+    for(i=0;i<CHECK_THREADS;i++){
+        runs[i].shared = shared;
+        runs[i].tid = i;
+        runs[i].failures = 0;
+        pthread_create(&tids[i],NULL,__shared_client,&runs[i]);
+    }
+    for(i=0;i<CHECK_THREADS;i++){
+        pthread_join(tids[i],NULL);
+        failures += runs[i].failures;
+    }
+    shared_disconnect(shared);
+
+    long long moved,asked;
+    if(__redirects("sharedCluster",&moved,&asked) != 0)
+        return failures+1;
+    if(moved == 0 || asked == 0){
+        printf("sharedCluster: the mock sent %lld MOVED and %lld ASK, expected both\n",moved,asked);
+        failures++;
+    }
+    return failures;
+}
+
+/*
+*the replies of the stream are handed out in the order the commands were submitted, so each one is
+*checked against the key it was submitted for. The moved slot answers MOVED until a MOVED reply is
+*read, the migrating slots always answer ASK. moved[i] is set for every set answered with MOVED.
+*/
+static int __check_stream_sets(clusterStream* stream, const int* slots, int round, int* moved, int only_moved) {
+    char key[64],value[64];
+    int i,count = 0,failures = 0;
+    for(i=0;i<CHECK_KEYS;i++){
+        if(only_moved && !moved[i])
+            continue;
+        int keylen = __key(key,CHECK_STREAM_ID,i);
+        int valuelen = __value(value,round,key);
+        if(cluster_stream_setn(stream,key,keylen,value,valuelen) != 0){
+            printf("cluster_stream_setn of %s failed\n",key);
+            return failures+1;
+        }
+        count++;
+    }
+    for(i=0;i<CHECK_KEYS && count > 0;i++){
+        if(only_moved && !moved[i])
+            continue;
+        count--;
+        int keylen = __key(key,CHECK_STREAM_ID,i);
+        int kind = __kind(key,keylen,slots);
+        redisReply* reply = NULL;
+        if(cluster_stream_next(stream,&reply,1) != 1){
+            printf("cluster_stream_next lost the reply of %s\n",key);
+            return failures+1;
+        }
+        moved[i] = 0;
+        if(kind == KIND_MOVED && !only_moved && __is_error(reply,"MOVED ")){
+            moved[i] = 1;
+        }else if(kind == KIND_ASK || kind == KIND_OUTSIDE){
+            if(!__is_error(reply,"ASK ")){
+                printf("cluster_stream_setn of %s got %s, expected ASK\n",key,__describe(reply));
+                failures++;
+            }
+        }else if(reply == NULL || reply->type != REDIS_REPLY_STATUS){
+            printf("cluster_stream_setn of %s got %s, expected OK\n",key,__describe(reply));
+            failures++;
+        }
+        if(reply != NULL)
+            freeReplyObject(reply);
+    }
+    return failures;
+}
+
+static int __check_stream_gets(clusterStream* stream, const int* slots, int round) {
+    char key[64],value[64];
+    int i,failures = 0;
+    for(i=0;i<CHECK_KEYS;i++){
+        int keylen = __key(key,CHECK_STREAM_ID,i);
+        if(cluster_stream_getn(stream,key,keylen) != 0){
+            printf("cluster_stream_getn of %s failed\n",key);
+            return failures+1;
+        }
+    }
+    for(i=0;i<CHECK_KEYS;i++){
+        int keylen = __key(key,CHECK_STREAM_ID,i);
+        int valuelen = __value(value,round,key);
+        int kind = __kind(key,keylen,slots);
+        redisReply* reply = NULL;
+        if(cluster_stream_next(stream,&reply,1) != 1){
+            printf("cluster_stream_next lost the reply of %s\n",key);
+            return failures+1;
+        }
+        if(kind == KIND_ASK || kind == KIND_OUTSIDE){
+            if(!__is_error(reply,"ASK ")){
+                printf("cluster_stream_getn of %s got %s, expected ASK\n",key,__describe(reply));
+                failures++;
+            }
+        }else if(reply == NULL || reply->type != REDIS_REPLY_STRING || reply->len != (size_t)valuelen ||
+                 memcmp(reply->str,value,valuelen) != 0){
+            printf("cluster_stream_getn of %s got %s, expected %s\n",key,__describe(reply),value);
+            failures++;
+        }
+        if(reply != NULL)
+            freeReplyObject(reply);
+    }
+    return failures;
+}
+
+static int __check_stream(const int* slots) {
+    clusterInfo* cluster = connectRedis("127.0.0.1",CHECK_BASE_PORT);
+    if(cluster == NULL){
+        printf("connectRedis failed\n");
+        return 1;
+    }
+    clusterStream* stream = cluster_stream_open(cluster,CHECK_STREAM_WINDOW);
+    if(stream == NULL){
+        disconnectDatabase(cluster);
+        return 1;
+    }
+    int moved[CHECK_KEYS];
+    int round,i,failures = 0;
+    for(round=0;round<CHECK_ROUNDS;round++){
+        failures += __check_stream_sets(stream,slots,round,moved,0);
+        //the sets answered with MOVED are sent again, the layout has been patched by now
+        failures += __check_stream_sets(stream,slots,round,moved,1);
+        for(i=0;i<CHECK_KEYS;i++){
+            if(moved[i]){
+                printf("cluster_stream_setn of key %d was answered with MOVED again\n",i);
+                failures++;
+            }
+        }
+        failures += __check_stream_gets(stream,slots,round);
+    }
+    cluster_stream_close(stream);
+    disconnectDatabase(cluster);
+
+    long long moved_count,asked;
+    if(__redirects("clusterStream",&moved_count,&asked) != 0)
+        return failures+1;
+    if(moved_count == 0 || asked == 0){
+        printf("clusterStream: the mock sent %lld MOVED and %lld ASK, expected both\n",moved_count,asked);
+        failures++;
+    }
+    return failures;
+}
+
+typedef struct asyncCheck{
+    const int* slots;
+    int round;
+    int failures;
+}asyncCheck;
+
+//where the callbacks count their failures, their privdata is the index of the key
+static asyncCheck* async_check;
+
+static void __on_async_set(asyncCluster* cluster, redisReply* reply, void* privdata) {
+    (void)cluster;
+    char key[64];
+    int keylen = __key(key,CHECK_ASYNC_ID,(int)(long)privdata);
+    //a node outside the layout is not followed, its ASK goes to the callback
+    if(__kind(key,keylen,async_check->slots) == KIND_OUTSIDE){
+        if(!__is_error(reply,"ASK ")){
+            printf("async_setn of %s got %s, expected ASK\n",key,__describe(reply));
+            async_check->failures++;
+        }
+    }else if(reply == NULL || reply->type != REDIS_REPLY_STATUS){
+        printf("async_setn of %s got %s, expected OK\n",key,__describe(reply));
+        async_check->failures++;
+    }
+}
+
+static void __on_async_get(asyncCluster* cluster, redisReply* reply, void* privdata) {
+    (void)cluster;
+    char key[64],value[64];
+    int keylen = __key(key,CHECK_ASYNC_ID,(int)(long)privdata);
+    int valuelen = __value(value,async_check->round,key);
+    if(__kind(key,keylen,async_check->slots) == KIND_OUTSIDE){
+        if(!__is_error(reply,"ASK ")){
+            printf("async_getn of %s got %s, expected ASK\n",key,__describe(reply));
+            async_check->failures++;
+        }
+    }else if(reply == NULL || reply->type != REDIS_REPLY_STRING || reply->len != (size_t)valuelen ||
+             memcmp(reply->str,value,valuelen) != 0){
+        printf("async_getn of %s got %s, expected %s\n",key,__describe(reply),value);
+        async_check->failures++;
+    }
+}
+
+//run the loop until every callback has run
+static int __async_drain(asyncCluster* cluster, asyncEventLoop* loop) {
+    int idle = 0;
+    while(async_pending(cluster) > 0 && idle < 50){
+        if(async_loop_run_once(loop,100) == 0)
+            idle++;
+    }
+    if(async_pending(cluster) > 0){
+        printf("asyncCluster: %lld callbacks never ran\n",async_pending(cluster));
+        return 1;
+    }
+    return 0;
+}
+
+/*
+*every set of a round is sent before any reply is read, so the ASKING and the command of one key are
+*queued among the commands of the others.
+*/
+static int __check_async(const int* slots) {
+    asyncEventLoop* loop = async_loop_create();
+    if(loop == NULL)
+        return 1;
+    asyncCluster* cluster = async_connect("127.0.0.1",CHECK_BASE_PORT,NULL,loop);
+    if(cluster == NULL){
+        printf("async_connect failed\n");
+        async_loop_release(loop);
+        return 1;
+    }
+    asyncCheck check = {slots,0,0};
+    async_check = &check;
+    char key[64],value[64];
+    int round,i;
+    for(round=0;round<CHECK_ROUNDS;round++){
+        check.round = round;
+        for(i=0;i<CHECK_KEYS;i++){
+            int keylen = __key(key,CHECK_ASYNC_ID,i);
+            int valuelen = __value(value,round,key);
+            if(async_setn(cluster,__on_async_set,(void*)(long)i,key,keylen,value,valuelen) != 0){
+                printf("async_setn of %s failed\n",key);
+                check.failures++;
+            }
+        }
+        check.failures += __async_drain(cluster,loop);
+        for(i=0;i<CHECK_KEYS;i++){
+            int keylen = __key(key,CHECK_ASYNC_ID,i);
+            if(async_getn(cluster,__on_async_get,(void*)(long)i,key,keylen) != 0){
+                printf("async_getn of %s failed\n",key);
+                check.failures++;
+            }
+        }
+        check.failures += __async_drain(cluster,loop);
+    }
+    async_disconnect(cluster);
+    async_loop_run_once(loop,100);
+    async_loop_release(loop);
+
+    long long moved,asked;
+    if(__redirects("asyncCluster",&moved,&asked) != 0)
+        return check.failures+1;
+    if(moved == 0 || asked == 0){
+        printf("asyncCluster: the mock sent %lld MOVED and %lld ASK, expected both\n",moved,asked);
+        check.failures++;
+    }
+    return check.failures;
+}
+
+int main() {
+    int slots[KINDS-1];
+    int i,j;
+    for(i=0;i<KINDS-1;i++){
+        //the tag without its braces
+        slots[i] = keyHashSlot(kind_tags[i]+1,(int)strlen(kind_tags[i])-2);
+        for(j=0;j<i;j++){
+            if(slots[i] == slots[j]){
+                printf("%s and %s hash to the same slot\n",kind_tags[i],kind_tags[j]);
+                return 1;
+            }
+        }
+    }
+
+    int pid = startRedirectMock(CHECK_BASE_PORT,slots[KIND_MOVED],slots[KIND_ASK],slots[KIND_OUTSIDE]);
+    if(pid < 0)
+        return 1;
+    int failures = 0;
+    failures += __check_shared();
+    failures += __check_stream(slots);
+    failures += __check_async(slots);
+    stopRedirectMock(pid);
+    printf(failures == 0 ? "redirectCheck passed\n" : "redirectCheck failed\n");
+    return failures == 0 ? 0 : 1;
+}
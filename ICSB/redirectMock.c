@@ -0,0 +1,324 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+#include<poll.h>
+#include<signal.h>
+#include<sys/wait.h>
+#include<sys/socket.h>
+#include<netinet/in.h>
+#include<netinet/tcp.h>
+#include<hiredis/hiredis.h>
+#include"chiredis/crc16.h"
+#include"benchmarkHelp.h"
+#include"redirectMock.h"
+
+#define REDIRECT_MOCK_MAX_ARGS 512
+
+typedef struct redirectClient{
+    int node;
+    //1 right after ASKING, for the next command only
+    int asking;
+    char buf[65536];
+    size_t used;
+}redirectClient;
+
+typedef struct redirectEntry{
+    char* key;
+    size_t keylen;
+    char* value;
+    size_t valuelen;
+}redirectEntry;
+
+//the state of the forked mock
+static int base_port;
+static int moved_slot;
+static int ask_slot;
+static int outside_slot;
+static long long moved_count;
+static long long ask_count;
+static long long stray_count;
+static redirectEntry* store;
+static int stored;
+static int store_capacity;
+
+int redirectMockOwner(int slot) {
+    int i;
+    for(i=0;i<REDIRECT_MOCK_NODES;i++){
+        if(slot < (int)((long)16384*(i+1)/REDIRECT_MOCK_NODES))
+            return i;
+    }
+    return REDIRECT_MOCK_NODES-1;
+}
+
+static redirectEntry* __find(const char* key, size_t keylen) {
+    int i;
+    for(i=0;i<stored;i++){
+        if(store[i].keylen == keylen && memcmp(store[i].key,key,keylen) == 0)
+            return &store[i];
+    }
+    return NULL;
+}
+
+static void __store(const char* key, size_t keylen, const char* value, size_t valuelen) {
+    redirectEntry* e = __find(key,keylen);
+    if(e == NULL){
+        if(stored == store_capacity){
+            store_capacity = store_capacity == 0 ? 256 : store_capacity*2;
+            store = (redirectEntry*)realloc(store,sizeof(redirectEntry)*store_capacity);
+        }
+        e = &store[stored++];
+        e->key = (char*)malloc(keylen);
+        memcpy(e->key,key,keylen);
+        e->keylen = keylen;
+    }else{
+        free(e->value);
+    }
+    e->value = (char*)malloc(valuelen);
+    memcpy(e->value,value,valuelen);
+    e->valuelen = valuelen;
+}
+
+static void __reply_value(int fd, const char* key, size_t keylen) {
+    redirectEntry* e = __find(key,keylen);
+    char head[32];
+    if(e == NULL){
+        write(fd,"$-1\r\n",5);
+        return;
+    }
+    write(fd,head,sprintf(head,"$%lu\r\n",(unsigned long)e->valuelen));
+    write(fd,e->value,e->valuelen);
+    write(fd,"\r\n",2);
+}
+
+/*
+*length of the first request in buf, 0 if it is not complete yet. the arguments point into buf.
+*/
+static size_t __parse(char* buf, size_t len, char** argv, size_t* argvlen, int* argc) {
+    char* end = buf+len;
+    char* p = memchr(buf,'\n',len);
+    if(buf[0] != '*' || p == NULL)
+        return 0;
+    long n = strtol(buf+1,NULL,10);
+    if(n > REDIRECT_MOCK_MAX_ARGS)
+        n = REDIRECT_MOCK_MAX_ARGS;
+    p++;
+    long i;
+    for(i=0;i<n;i++){
+        char* line = p < end ? memchr(p,'\n',end-p) : NULL;
+        if(line == NULL || *p != '$')
+            return 0;
+        long arg_len = strtol(p+1,NULL,10);
+        p = line+1;
+        if(end-p < arg_len+2)
+            return 0;
+        argv[i] = p;
+        argvlen[i] = arg_len;
+        p += arg_len+2;
+    }
+    *argc = (int)n;
+    return p-buf;
+}
+
+static void __handle(redirectClient* c, int fd, char** argv, size_t* argvlen, int argc, const char* slots, size_t slots_len) {
+    char out[128];
+    if(argvlen[0] == 7 && strncasecmp(argv[0],"cluster",7) == 0){
+        write(fd,slots,slots_len);
+        return;
+    }
+    if(argvlen[0] == 9 && strncasecmp(argv[0],"mockstats",9) == 0){
+        write(fd,out,sprintf(out,"*3\r\n:%lld\r\n:%lld\r\n:%lld\r\n",moved_count,ask_count,stray_count));
+        return;
+    }
+    if(argvlen[0] == 6 && strncasecmp(argv[0],"asking",6) == 0){
+        if(c->asking)
+            stray_count++;
+        c->asking = 1;
+        write(fd,"+OK\r\n",5);
+        return;
+    }
+    int asking = c->asking;
+    c->asking = 0;
+    if(argc < 2){
+        if(asking)
+            stray_count++;
+        write(fd,"+OK\r\n",5);
+        return;
+    }
+
+    int slot = keyHashSlot(argv[1],(int)argvlen[1]);
+    int owner = redirectMockOwner(slot);
+    int migrating = slot == ask_slot || slot == outside_slot;
+    if(asking && !migrating)
+        stray_count++;
+    if(slot == moved_slot)
+        owner = (owner+1) % REDIRECT_MOCK_NODES;
+    //the node the slot is being migrated to
+    int target = slot == outside_slot ? REDIRECT_MOCK_NODES : (owner+1) % REDIRECT_MOCK_NODES;
+    if(migrating && c->node == owner){
+        ask_count++;
+        write(fd,out,sprintf(out,"-ASK %d 127.0.0.1:%d\r\n",slot,base_port+target));
+        return;
+    }
+    int serves = migrating ? c->node == target && asking : c->node == owner;
+    if(!serves){
+        moved_count++;
+        write(fd,out,sprintf(out,"-MOVED %d 127.0.0.1:%d\r\n",slot,base_port+owner));
+        return;
+    }
+
+    int i;
+    if(argvlen[0] == 3 && strncasecmp(argv[0],"get",3) == 0){
+        __reply_value(fd,argv[1],argvlen[1]);
+    }else if(argvlen[0] == 4 && strncasecmp(argv[0],"mget",4) == 0){
+        write(fd,out,sprintf(out,"*%d\r\n",argc-1));
+        for(i=1;i<argc;i++)
+            __reply_value(fd,argv[i],argvlen[i]);
+    }else if(argvlen[0] == 3 && strncasecmp(argv[0],"set",3) == 0 && argc >= 3){
+        __store(argv[1],argvlen[1],argv[2],argvlen[2]);
+        write(fd,"+OK\r\n",5);
+    }else if(argvlen[0] == 4 && strncasecmp(argv[0],"mset",4) == 0){
+        for(i=1;i+1<argc;i+=2)
+            __store(argv[i],argvlen[i],argv[i+1],argvlen[i+1]);
+        write(fd,"+OK\r\n",5);
+    }else{
+        write(fd,"+OK\r\n",5);
+    }
+}
+
+static void __serve() {
+    size_t slots_len;
+    char* slots = fakeSlotsReplyAt(REDIRECT_MOCK_NODES,1,base_port,&slots_len);
+    //the nodes of the layout and the one outside it
+    int listeners = REDIRECT_MOCK_NODES+1;
+    int capacity = listeners + 64;
+    struct pollfd* fds = (struct pollfd*)calloc(capacity,sizeof(struct pollfd));
+    redirectClient** clients = (redirectClient**)calloc(capacity,sizeof(redirectClient*));
+    int count = 0;
+    int i;
+    for(i=0;i<listeners;i++){
+        int fd = socket(AF_INET,SOCK_STREAM,0);
+        int on = 1;
+        setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on));
+        struct sockaddr_in addr;
+        memset(&addr,0,sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(base_port+i);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if(bind(fd,(struct sockaddr*)&addr,sizeof(addr)) != 0 || listen(fd,128) != 0){
+            printf("mock node unable to listen on %d\n",base_port+i);
+            _exit(1);
+        }
+        fds[count].fd = fd;
+        fds[count].events = POLLIN;
+        count++;
+    }
+
+    char* argv[REDIRECT_MOCK_MAX_ARGS];
+    size_t argvlen[REDIRECT_MOCK_MAX_ARGS];
+    while(poll(fds,count,-1) >= 0){
+        for(i=0;i<count;i++){
+            if(!(fds[i].revents & (POLLIN|POLLHUP|POLLERR)))
+                continue;
+            if(i < listeners){
+                int fd = accept(fds[i].fd,NULL,NULL);
+                if(fd < 0)
+                    continue;
+                if(count == capacity){
+                    capacity *= 2;
+                    fds = (struct pollfd*)realloc(fds,sizeof(struct pollfd)*capacity);
+                    clients = (redirectClient**)realloc(clients,sizeof(redirectClient*)*capacity);
+                }
+                int on = 1;
+                setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on));
+                fds[count].fd = fd;
+                fds[count].events = POLLIN;
+                fds[count].revents = 0;
+                clients[count] = (redirectClient*)calloc(1,sizeof(redirectClient));
+                clients[count]->node = i;
+                count++;
+                continue;
+            }
+            redirectClient* c = clients[i];
+            ssize_t n = read(fds[i].fd,c->buf+c->used,sizeof(c->buf)-c->used);
+            if(n <= 0){
+                close(fds[i].fd);
+                free(c);
+                count--;
+                fds[i] = fds[count];
+                clients[i] = clients[count];
+                i--;
+                continue;
+            }
+            c->used += n;
+            int argc;
+            size_t request_len;
+            while(c->used > 0 && (request_len = __parse(c->buf,c->used,argv,argvlen,&argc)) > 0){
+                __handle(c,fds[i].fd,argv,argvlen,argc,slots,slots_len);
+                memmove(c->buf,c->buf+request_len,c->used-request_len);
+                c->used -= request_len;
+            }
+        }
+    }
+    _exit(0);
+}
+
+int startRedirectMock(int basePort, int movedSlot, int askSlot, int outsideSlot) {
+    base_port = basePort;
+    moved_slot = movedSlot;
+    ask_slot = askSlot;
+    outside_slot = outsideSlot;
+    pid_t pid = fork();
+    if(pid < 0){
+        printf("fork fail %s %d\n",__FILE__,__LINE__);
+        return -1;
+    }
+    if(pid == 0)
+        __serve();
+
+    //wait until the node outside the layout, the last one to listen, accepts connections
+    int tries;
+    for(tries=0;tries<200;tries++){
+        int fd = socket(AF_INET,SOCK_STREAM,0);
+        struct sockaddr_in addr;
+        memset(&addr,0,sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(basePort+REDIRECT_MOCK_NODES);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int ok = connect(fd,(struct sockaddr*)&addr,sizeof(addr)) == 0;
+        close(fd);
+        if(ok)
+            return pid;
+        usleep(10000);
+    }
+    printf("mock cluster did not start\n");
+    stopRedirectMock(pid);
+    return -1;
+}
+
+void stopRedirectMock(int pid) {
+    kill(pid,SIGKILL);
+    waitpid(pid,NULL,0);
+}
+
+int redirectMockStats(int basePort, long long* moved, long long* asked, long long* stray) {
+    redisContext* c = redisConnect("127.0.0.1",basePort);
+    if(c == NULL || c->err){
+        printf("unable to reach the mock on %d\n",basePort);
+        if(c != NULL)
+            redisFree(c);
+        return -1;
+    }
+    redisReply* reply = (redisReply*)redisCommand(c,"mockstats");
+    int re = -1;
+    if(reply != NULL && reply->type == REDIS_REPLY_ARRAY && reply->elements == 3){
+        *moved = reply->element[0]->integer;
+        *asked = reply->element[1]->integer;
+        *stray = reply->element[2]->integer;
+        re = 0;
+    }
+    if(reply != NULL)
+        freeReplyObject(reply);
+    redisFree(c);
+    return re;
+}
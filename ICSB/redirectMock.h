@@ -0,0 +1,30 @@
+#ifndef REDIRECT_MOCK
+#define REDIRECT_MOCK
+
+/*
+*a mock cluster of REDIRECT_MOCK_NODES masters that keeps what is set and redirects like a cluster in
+*the middle of a resharding, for the checks of ICSB. Node i listens on basePort+i and the layout it
+*hands out is fakeSlotsReplyAt(REDIRECT_MOCK_NODES,1,basePort):
+*    movedSlot   has moved to the next node without the layout saying so, the owner in the layout
+*                answers MOVED
+*    askSlot     is being migrated to the next node, the owner answers ASK and the next node serves
+*                it only right after ASKING
+*    outsideSlot the same as askSlot, but migrated to a node the layout doesn't list, listening on
+*                basePort+REDIRECT_MOCK_NODES
+*-1 leaves a kind of redirect out. It answers cluster slots, asking, get, mget, set, mset, and
+*mockstats with redirectMockStats' counters, anything else with OK.
+*/
+#define REDIRECT_MOCK_NODES 3
+
+//returns the pid for stopRedirectMock, -1 on errors
+int startRedirectMock(int basePort, int movedSlot, int askSlot, int outsideSlot);
+void stopRedirectMock(int pid);
+/*
+*the MOVED and ASK replies the mock has sent so far, and stray, the ASKING not followed by a command of
+*askSlot or outsideSlot on the same connection. returns 0, -1 if the mock can't be asked.
+*/
+int redirectMockStats(int basePort, long long* moved, long long* asked, long long* stray);
+//the node the layout of the mock gives the slot to
+int redirectMockOwner(int slot);
+
+#endif
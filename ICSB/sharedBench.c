@@ -0,0 +1,93 @@
+/*
+*sets per second from a growing number of threads, each thread with its own clusterInfo and all of them
+*through one sharedCluster. The cluster is a mock process forked by the benchmark, no redis cluster is needed:
+*    ./sharedBench [sets per thread]
+*/
+#include"chiredis/connect.h"
+#include"chiredis/shared_connect.h"
+#include"benchmarkHelp.h"
+#include<stdio.h>
+#include<string.h>
+#include<stdlib.h>
+#include<pthread.h>
+
+#define MOCK_BASE_PORT 17500
+#define MOCK_NODES 3
+
+typedef struct sharedRun{
+    sharedCluster* shared;
+    unsigned long sets;
+    int tid;
+}sharedRun;
+
+static void* __own_client(void* arg) {
+    sharedRun* run = (sharedRun*)arg;
+    clusterInfo* cluster = connectRedis("127.0.0.1",MOCK_BASE_PORT);
+    if(cluster == NULL)
+        exit(1);
+    char key[32];
+    unsigned long i;
+    for(i=0;i<run->sets;i++){
+        sprintf(key,"key:%d:%lu",run->tid,i);
+        if(setn(cluster,key,strlen(key),"value",5,-1) != 0){
+            printf("setn failed\n");
+            exit(1);
+        }
+    }
+    disconnectDatabase(cluster);
+    return NULL;
+}
+
+static void* __shared_client(void* arg) {
+    sharedRun* run = (sharedRun*)arg;
+    char key[32];
+    unsigned long i;
+    for(i=0;i<run->sets;i++){
+        sprintf(key,"key:%d:%lu",run->tid,i);
+        if(shared_setn(run->shared,key,strlen(key),"value",5) != 0){
+            printf("shared_setn failed\n");
+            exit(1);
+        }
+    }
+    return NULL;
+}
+
+static double __time_threads(void* (*fn)(void*), sharedCluster* shared, int threads, unsigned long sets) {
+    pthread_t tids[threads];
+    sharedRun runs[threads];
+    int i;
+    long long start = us_time();
+    for(i=0;i<threads;i++){
+        runs[i].shared = shared;
+        runs[i].sets = sets;
+        runs[i].tid = i;
+        pthread_create(&tids[i],NULL,fn,&runs[i]);
+    }
+    for(i=0;i<threads;i++)
+        pthread_join(tids[i],NULL);
+    return (double)threads*sets*1000000/(us_time()-start);
+}
+
+int main(int argc, char** argv) {
+    unsigned long sets = argc > 1 ? strtoul(argv[1],NULL,10) : 20000;
+    int threads[] = {1,4,16,64};
+    unsigned long i;
+
+    int pid = startMockCluster(MOCK_NODES,MOCK_BASE_PORT);
+    if(pid < 0)
+        return 1;
+    sharedCluster* shared = shared_connect("127.0.0.1",MOCK_BASE_PORT);
+    if(shared == NULL)
+        return 1;
+
+    printf("%8s %14s %8s %14s %8s\n","threads","own sets/s","sockets","shared sets/s","sockets");
+    for(i=0;i<sizeof(threads)/sizeof(int);i++){
+        double own = __time_threads(__own_client,NULL,threads[i],sets);
+        double together = __time_threads(__shared_client,shared,threads[i],sets);
+        printf("%8d %14.0f %8d %14.0f %8d\n",threads[i],own,threads[i]*MOCK_NODES,together,shared->len);
+    }
+
+    shared_disconnect(shared);
+    stopMockCluster(pid);
+    return 0;
+}
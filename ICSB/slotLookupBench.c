@@ -0,0 +1,93 @@
+/*
+*measure slot lookups per second with the old routing layout and with the current one.
+*no redis cluster is needed:
+*    ./slotLookupBench [nodes] [lookups]
+*
+*old: void* slot_to_host[16384] pointing at a per-node struct which also carried char slots[16384]
+*new: uint16_t slot_to_node[16384] indexing a dense array of parseArgv
+*/
+#include"chiredis/connect.h"
+#include"benchmarkHelp.h"
+#include<stdio.h>
+#include<string.h>
+#include<stdlib.h>
+#include<hiredis/hiredis.h>
+
+//the node structure as it was before the slot bitmaps were removed
+typedef struct oldParseArgv{
+    char * ip;
+    int port;
+    redisContext * context;
+    int start_slot;
+    int end_slot;
+    char slots[16384];
+    int pipe_mode;
+    int pipe_pending;
+}oldParseArgv;
+
+static redisReply* __parse_reply(char* buf, size_t len) {
+    redisReader* reader = redisReaderCreate();
+    void* reply = NULL;
+    redisReaderFeed(reader,buf,len);
+    if(redisReaderGetReply(reader,&reply) != REDIS_OK)
+        printf("unable to parse the fake reply %s %d\n",__FILE__,__LINE__);
+    redisReaderFree(reader);
+    return (redisReply*)reply;
+}
+
+int main(int argc, char** argv) {
+    int node_count = argc > 1 ? atoi(argv[1]) : 30;
+    long lookups = argc > 2 ? atol(argv[2]) : 50000000;
+    long i;
+    int j;
+
+    size_t len;
+    char* buf = fakeSlotsReply(node_count,4,&len);
+    redisReply* reply = __parse_reply(buf,len);
+    clusterTopology* topology = topology_from_slots_reply(reply,"127.0.0.1");
+
+    //the same layout in both forms, with a fake context per node so the lookup has something to read
+    void** slot_to_host = (void**)malloc(sizeof(void*)*16384);
+    oldParseArgv** old_nodes = (oldParseArgv**)malloc(sizeof(oldParseArgv*)*node_count);
+    parseArgv** parse = (parseArgv**)malloc(sizeof(parseArgv*)*node_count);
+    for(j=0;j<node_count;j++){
+        old_nodes[j] = (oldParseArgv*)calloc(1,sizeof(oldParseArgv));
+        old_nodes[j]->context = (redisContext*)(long)(j+1);
+        parse[j] = (parseArgv*)calloc(1,sizeof(parseArgv));
+        parse[j]->context = (redisContext*)(long)(j+1);
+    }
+    for(j=0;j<16384;j++){
+        int owner = topology->slot_to_node[j];
+        slot_to_host[j] = old_nodes[owner];
+        old_nodes[owner]->slots[j] = 1;
+    }
+
+    //the keys of a real workload land on random slots
+    int* slots = (int*)malloc(sizeof(int)*65536);
+    for(j=0;j<65536;j++)
+        slots[j] = rand() & 16383;
+
+    long sum = 0;
+    long long start = us_time();
+    for(i=0;i<lookups;i++){
+        oldParseArgv* node = (oldParseArgv*)slot_to_host[slots[i&65535]];
+        sum += (long)node->context;
+    }
+    long long mid = us_time();
+    for(i=0;i<lookups;i++){
+        parseArgv* node = parse[topology->slot_to_node[slots[i&65535]]];
+        sum += (long)node->context;
+    }
+    long long end = us_time();
+
+    printf("nodes=%d lookups=%ld (checksum %ld)\n",node_count,lookups,sum);
+    printf("old pointer table + bitmaps: %8.1f M lookups/s, %lu KB of routing state\n",
+           (double)lookups/(mid-start),(unsigned long)(sizeof(void*)*16384 + sizeof(oldParseArgv)*node_count)/1024);
+    printf("uint16_t index table:        %8.1f M lookups/s, %lu KB of routing state\n",
+           (double)lookups/(end-mid),(unsigned long)(sizeof(topology->slot_to_node) + sizeof(parseArgv*)*node_count)/1024);
+
+    topology_release(topology);
+    freeReplyObject(reply);
+    free(buf);
+    return 0;
+}
@@ -52,7 +52,7 @@ void *__db_function (void* thread_input){
   for(i=0;i<count;i++){
       long long start = us_time();
       tempPair = getKvPair(benchmark);
-      set(cluster,tempPair->key,tempPair->value,1,my_tid);
+      set(cluster,tempPair->key,tempPair->value,1);
       long long end = us_time();
       addDuration(benchmark,end - start);
   }
@@ -94,7 +94,6 @@ void test_normal_with_multiple_threads (char *ip,int port) {
         thread_input[i].tid = (i+1);
         thread_input[i].bc = bc;
     }
-    init_global();
 
     for(i=0;i<thread_count;i++) { 
         res = pthread_create(&th[i],NULL,__db_function,(void*)(&thread_input[i]));
@@ -244,6 +243,120 @@ void test_pipeline_with_multiple_threads (char *ip,int port) {
 }
 
 
+/*
+*one client writing the same keys with pipelines of growing depth, each depth as many sets as
+*the deepest one so the numbers compare. Shows where a deeper pipeline stops paying off.
+*/
+static int pipe_depths[] = {1,10,100,1000,10000};
+
+static double __pipeline_depth_run(clusterInfo* cluster,benchmarkInfo* benchmark,int depth) {
+    clusterPipe *mypipe = get_pipeline();
+    bind_pipeline_to_cluster(cluster,mypipe);
+    unsigned long total = benchmark->count;
+    unsigned long done = 0;
+    int i;
+
+    long long start = us_time();
+    while(done < total) {
+        int n = total-done < (unsigned long)depth ? (int)(total-done) : depth;
+        set_pipeline_count(mypipe,n);
+        for(i=0;i<n;i++) {
+            kvPair *tempPair = benchmark->kvPairToUse[done+i];
+            if(cluster_pipeline_set(cluster,mypipe,tempPair->key,tempPair->value) != 0) {
+                printf("pipeline set failed at depth %d\n",depth);
+                exit(1);
+            }
+        }
+        cluster_pipeline_flushBuffer(cluster,mypipe);
+        for(i=0;i<n;i++) {
+            redisReply *reply = cluster_pipeline_getReply(cluster,mypipe);
+            if(reply == NULL)
+                printf("NULL reply at depth %d\n",depth);
+            else
+                freeReplyObject(reply);
+        }
+        cluster_pipeline_complete(cluster,mypipe);
+        done += n;
+    }
+    long long end = us_time();
+
+    release_pipeline(mypipe);
+    return (double)total*1000000/(end-start);
+}
+
+void test_pipeline_depth_sweep(char *ip,int port,unsigned long total) {
+    clusterInfo *cluster = connectRedis(ip,port);
+    if(cluster == NULL) {
+        printf("unable to connect to cluster\n");
+        return;
+    }
+    benchmarkInfo *benchmark = initBenchmark(total);
+    benchmark = loadData(benchmark);
+
+    int n = sizeof(pipe_depths)/sizeof(int);
+    int i;
+    printf("%8s %14s\n","depth","sets/s");
+    for(i=0;i<n;i++)
+        printf("%8d %14.0f\n",pipe_depths[i],__pipeline_depth_run(cluster,benchmark,pipe_depths[i]));
+    disconnectDatabase(cluster);
+}
+
+/*
+*the same sets through a clusterStream, each window bounding the commands in flight per node.
+*Replies are taken as soon as they are there instead of once per batch, compare with the depth sweep.
+*/
+static int stream_windows[] = {1,10,100,1000};
+
+static double __stream_window_run(clusterInfo* cluster,benchmarkInfo* benchmark,int window) {
+    clusterStream *stream = cluster_stream_open(cluster,window);
+    unsigned long total = benchmark->count;
+    unsigned long i;
+    redisReply *reply;
+
+    long long start = us_time();
+    for(i=0;i<total;i++) {
+        kvPair *tempPair = benchmark->kvPairToUse[i];
+        if(cluster_stream_setn(stream,tempPair->key,strlen(tempPair->key),tempPair->value,strlen(tempPair->value)) != 0) {
+            printf("stream set failed at window %d\n",window);
+            exit(1);
+        }
+        while(cluster_stream_next(stream,&reply,0) == 1) {
+            if(reply == NULL)
+                printf("NULL reply at window %d\n",window);
+            else
+                freeReplyObject(reply);
+        }
+    }
+    while(cluster_stream_next(stream,&reply,1) == 1) {
+        if(reply == NULL)
+            printf("NULL reply at window %d\n",window);
+        else
+            freeReplyObject(reply);
+    }
+    long long end = us_time();
+
+    cluster_stream_close(stream);
+    return (double)total*1000000/(end-start);
+}
+
+void test_stream_window_sweep(char *ip,int port,unsigned long total) {
+    clusterInfo *cluster = connectRedis(ip,port);
+    if(cluster == NULL) {
+        printf("unable to connect to cluster\n");
+        return;
+    }
+    benchmarkInfo *benchmark = initBenchmark(total);
+    benchmark = loadData(benchmark);
+
+    int n = sizeof(stream_windows)/sizeof(int);
+    int i;
+    printf("%8s %14s\n","window","sets/s");
+    for(i=0;i<n;i++)
+        printf("%8d %14.0f\n",stream_windows[i],__stream_window_run(cluster,benchmark,stream_windows[i]));
+    disconnectDatabase(cluster);
+}
+
+
 int main(int argc, char ** argv){
     if(argc <2 ){
         printf("argc < 2\n");
@@ -261,6 +374,14 @@ int main(int argc, char ** argv){
             }else if(strcasecmp(argv[4],"normal")==0){
                 printf("start normal test\n");
                 test_normal_with_multiple_threads(ip,port);
+            }else if(strcasecmp(argv[4],"depth")==0){
+                unsigned long total = argc > 5 ? strtoul(argv[5],NULL,10) : 100000;
+                printf("start pipeline depth sweep, %lu sets per depth\n",total);
+                test_pipeline_depth_sweep(ip,port,total);
+            }else if(strcasecmp(argv[4],"stream")==0){
+                unsigned long total = argc > 5 ? strtoul(argv[5],NULL,10) : 100000;
+                printf("start stream window sweep, %lu sets per window\n",total);
+                test_stream_window_sweep(ip,port,total);
             }else{
                 printf("unknown test %s\n",argv[4]);
             }
@@ -7,7 +7,6 @@ functionStruct* functions;
 //TODO:
 void *init(void* myinput) {
     printf("init\n");
-    init_global();    
     return (void*)0;
 }
 
@@ -31,11 +30,10 @@ void *prepare(void *thread_input,void* myinput){
 void *operation(void *kv,void* thread_input,void *prepare_out) {
 
     kvPair* lkv = (kvPair*)kv;
-    int tid = ((thread_struct*)thread_input)->tid;
     clusterInfo *cluster = (clusterInfo*)prepare_out;
-    set(cluster,lkv->key,lkv->value,1,tid);
+    set(cluster,lkv->key,lkv->value,1);
     char * re  = (char*)malloc(100);
-    get(cluster,lkv->key,re,1,tid);
+    get(cluster,lkv->key,re,1);
     printf("re = %s\n",re);
     return (void*)0;
 }
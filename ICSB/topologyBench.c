@@ -0,0 +1,54 @@
+/*
+*measure how long it takes to turn a reply of cluster slots into a clusterTopology.
+*the reply is generated locally, so no redis cluster is needed:
+*    ./topologyBench [iterations]
+*/
+#include"chiredis/topology.h"
+#include"benchmarkHelp.h"
+#include<stdio.h>
+#include<string.h>
+#include<stdlib.h>
+#include<hiredis/hiredis.h>
+
+#define RANGES_PER_NODE 4
+
+static redisReply* __parse_reply(char* buf, size_t len) {
+    redisReader* reader = redisReaderCreate();
+    void* reply = NULL;
+    redisReaderFeed(reader,buf,len);
+    if(redisReaderGetReply(reader,&reply) != REDIS_OK)
+        printf("unable to parse the fake reply %s %d\n",__FILE__,__LINE__);
+    redisReaderFree(reader);
+    return (redisReply*)reply;
+}
+
+int main(int argc, char** argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 200;
+    int node_counts[] = {3,30,100,300,1000,3000};
+    int n = sizeof(node_counts)/sizeof(int);
+    int i,j;
+
+    printf("%8s %8s %14s %14s\n","nodes","ranges","us/load","us/load/node");
+    for(i=0;i<n;i++){
+        size_t len;
+        char* buf = fakeSlotsReply(node_counts[i],RANGES_PER_NODE,&len);
+        redisReply* reply = __parse_reply(buf,len);
+
+        long long start = us_time();
+        for(j=0;j<iterations;j++){
+            clusterTopology* topology = topology_from_slots_reply(reply,"127.0.0.1");
+            if(topology == NULL || topology->len != node_counts[i]) {
+                printf("wrong topology for %d nodes\n",node_counts[i]);
+                return 1;
+            }
+            topology_release(topology);
+        }
+        long long end = us_time();
+
+        double per_load = (double)(end-start)/iterations;
+        printf("%8d %8d %14.2f %14.3f\n",node_counts[i],node_counts[i]*RANGES_PER_NODE,per_load,per_load/node_counts[i]);
+        freeReplyObject(reply);
+        free(buf);
+    }
+    return 0;
+}
@@ -0,0 +1,51 @@
+#ifndef ASYNC_ADAPTERS_H
+#define ASYNC_ADAPTERS_H
+
+/*
+*asyncAttachFn wrappers of the hiredis adapters, for async_connect with another event loop than
+*asyncEventLoop. Include this after the adapter of the loop, only the wrappers of the adapters
+*already included are defined:
+*
+*    #include <hiredis/adapters/libevent.h>
+*    #include "async_adapters.h"
+*    asyncCluster* cluster = async_connect(ip,port,async_libevent_attach,base);
+*
+*The adapters don't share one signature, libev and ae take the loop first, so they must not be
+*called through a cast function pointer.
+*/
+#include "async_connect.h"
+
+#ifdef __HIREDIS_LIBEVENT_H__
+//loop is a struct event_base*
+static int async_libevent_attach(redisAsyncContext* ac,void* loop){
+    return redisLibeventAttach(ac,(struct event_base*)loop);
+}
+#endif
+
+#ifdef __HIREDIS_LIBEV_H__
+//loop is a struct ev_loop*, ignored when libev is built without EV_MULTIPLICITY
+static int async_libev_attach(redisAsyncContext* ac,void* loop){
+#if EV_MULTIPLICITY
+    return redisLibevAttach((struct ev_loop*)loop,ac);
+#else
+    (void)loop;
+    return redisLibevAttach(ac);
+#endif
+}
+#endif
+
+#ifdef __HIREDIS_AE_H__
+//loop is an aeEventLoop*
+static int async_ae_attach(redisAsyncContext* ac,void* loop){
+    return redisAeAttach((aeEventLoop*)loop,ac);
+}
+#endif
+
+#ifdef __HIREDIS_LIBUV_H__
+//loop is a uv_loop_t*
+static int async_libuv_attach(redisAsyncContext* ac,void* loop){
+    return redisLibuvAttach(ac,(uv_loop_t*)loop);
+}
+#endif
+
+#endif
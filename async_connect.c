@@ -0,0 +1,647 @@
+#include "async_connect.h"
+#include "connect.h"
+#include "crc16.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <hiredis/hiredis.h>
+#include <hiredis/async.h>
+
+/*
+*one fd of the epoll loop, it is the ev.data of its redisAsyncContext.
+*/
+typedef struct asyncLoopEvent{
+    asyncEventLoop* loop;
+    //NULL once hiredis has cleaned the context up
+    redisAsyncContext* context;
+    int fd;
+    //EPOLLIN and EPOLLOUT as registered with epoll
+    int mask;
+    struct asyncLoopEvent* next;
+}asyncLoopEvent;
+
+/*
+*a command in flight. The formatted command is kept so that it can be sent again after a redirect.
+*Once answered the request goes back to the pool of its cluster, buffer included, so a cluster that
+*keeps the same number of commands in flight stops allocating requests.
+*/
+typedef struct asyncRequest{
+    asyncCluster* cluster;
+    asyncClusterCallback fn;
+    void* privdata;
+    int redirects;
+    char* cmd;
+    size_t len;
+    size_t capacity;
+    //next request of the pool
+    struct asyncRequest* next;
+}asyncRequest;
+
+//the following are a list of internal function that are not intended to be used outsize this file.
+static void __loop_update(asyncLoopEvent* e,int mask);
+static void __loop_add_read(void* data);
+static void __loop_del_read(void* data);
+static void __loop_add_write(void* data);
+static void __loop_del_write(void* data);
+static void __loop_cleanup(void* data);
+static void __loop_free_dead(asyncEventLoop* loop);
+static asyncNode* __new_async_node(asyncCluster* cluster,topologyNode* node);
+static void __free_async_node(asyncNode* node);
+static void __release_async_node(asyncNode* node);
+static redisAsyncContext* __async_node_context(asyncCluster* cluster,asyncNode* node);
+static void __async_connected(const redisAsyncContext* ac,int status);
+static void __async_disconnected(const redisAsyncContext* ac,int status);
+static void __async_closed(asyncCluster* cluster,asyncNode* node,int status);
+static void __async_sync_topology(asyncCluster* cluster);
+static void __async_refresh_topology(asyncCluster* cluster);
+static void __async_follow_moved(asyncCluster* cluster,int slot,const char* ip,int port);
+static asyncNode* __async_find_node(asyncCluster* cluster,const char* ip,int port);
+static asyncRequest* __async_take_request(asyncCluster* cluster,int argc,const char** argv,const size_t* argvlen);
+static void __async_put_request(asyncCluster* cluster,asyncRequest* req);
+static int __async_send(asyncCluster* cluster,asyncRequest* req,asyncNode* node,int asking);
+static int __async_submit(asyncCluster* cluster,asyncClusterCallback fn,void* privdata,int slot,
+                          int argc,const char** argv,const size_t* argvlen);
+static void __async_reply(redisAsyncContext* ac,void* r,void* privdata);
+static void __async_maybe_free(asyncCluster* cluster);
+
+
+//the built-in epoll loop starts from here
+
+asyncEventLoop* async_loop_create(){
+    asyncEventLoop* loop = (asyncEventLoop*)malloc(sizeof(asyncEventLoop));
+    if(loop == NULL){
+        printf("unable to allocate asyncEventLoop\n");
+        return NULL;
+    }
+    loop->epfd = epoll_create(1024);
+    if(loop->epfd < 0){
+        printf("epoll_create failed %s %d\n",__FILE__,__LINE__);
+        free(loop);
+        return NULL;
+    }
+    loop->stop = 0;
+    loop->dead = NULL;
+    return loop;
+}
+
+int async_loop_attach(redisAsyncContext* ac,void* loop){
+    if(ac == NULL || loop == NULL || ac->ev.data != NULL)
+        return REDIS_ERR;
+    asyncLoopEvent* e = (asyncLoopEvent*)malloc(sizeof(asyncLoopEvent));
+    if(e == NULL)
+        return REDIS_ERR;
+    e->loop = (asyncEventLoop*)loop;
+    e->context = ac;
+    e->fd = ac->c.fd;
+    e->mask = 0;
+    e->next = NULL;
+
+    ac->ev.data = e;
+    ac->ev.addRead = __loop_add_read;
+    ac->ev.delRead = __loop_del_read;
+    ac->ev.addWrite = __loop_add_write;
+    ac->ev.delWrite = __loop_del_write;
+    ac->ev.cleanup = __loop_cleanup;
+    return REDIS_OK;
+}
+
+/*
+*register the events the context waits for, epoll only hears about changes.
+*/
+static void __loop_update(asyncLoopEvent* e,int mask){
+    if(mask == e->mask)
+        return;
+    struct epoll_event ev;
+    ev.events = mask;
+    ev.data.ptr = e;
+    int op = e->mask == 0 ? EPOLL_CTL_ADD : (mask == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD);
+    if(epoll_ctl(e->loop->epfd,op,e->fd,&ev) != 0)
+        printf("epoll_ctl failed for fd %d, errno %d\n",e->fd,errno);
+    e->mask = mask;
+}
+
+static void __loop_add_read(void* data){
+    asyncLoopEvent* e = (asyncLoopEvent*)data;
+    __loop_update(e,e->mask | EPOLLIN);
+}
+
+static void __loop_del_read(void* data){
+    asyncLoopEvent* e = (asyncLoopEvent*)data;
+    __loop_update(e,e->mask & ~EPOLLIN);
+}
+
+static void __loop_add_write(void* data){
+    asyncLoopEvent* e = (asyncLoopEvent*)data;
+    __loop_update(e,e->mask | EPOLLOUT);
+}
+
+static void __loop_del_write(void* data){
+    asyncLoopEvent* e = (asyncLoopEvent*)data;
+    __loop_update(e,e->mask & ~EPOLLOUT);
+}
+
+/*
+*the context is being freed. Events of the current round may still point at e, so it is only
+*unregistered here and freed after the round.
+*/
+static void __loop_cleanup(void* data){
+    asyncLoopEvent* e = (asyncLoopEvent*)data;
+    __loop_update(e,0);
+    e->context = NULL;
+    e->next = e->loop->dead;
+    e->loop->dead = e;
+}
+
+static void __loop_free_dead(asyncEventLoop* loop){
+    while(loop->dead != NULL){
+        asyncLoopEvent* e = loop->dead;
+        loop->dead = e->next;
+        free(e);
+    }
+}
+
+int async_loop_run_once(asyncEventLoop* loop,int timeout_ms){
+    struct epoll_event events[ASYNC_LOOP_EVENTS];
+    int n = epoll_wait(loop->epfd,events,ASYNC_LOOP_EVENTS,timeout_ms);
+    if(n < 0){
+        if(errno == EINTR)
+            return 0;
+        printf("epoll_wait failed, errno %d\n",errno);
+        return -1;
+    }
+    int i;
+    for(i=0;i<n;i++){
+        asyncLoopEvent* e = (asyncLoopEvent*)events[i].data.ptr;
+        //errors are reported by the read, hiredis closes the context there
+        if(e->context != NULL && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+            redisAsyncHandleRead(e->context);
+        if(e->context != NULL && (events[i].events & EPOLLOUT))
+            redisAsyncHandleWrite(e->context);
+    }
+    __loop_free_dead(loop);
+    return n;
+}
+
+void async_loop_run(asyncEventLoop* loop){
+    loop->stop = 0;
+    while(!loop->stop){
+        if(async_loop_run_once(loop,-1) < 0)
+            break;
+    }
+}
+
+void async_loop_stop(asyncEventLoop* loop){
+    loop->stop = 1;
+}
+
+void async_loop_release(asyncEventLoop* loop){
+    if(loop == NULL)
+        return;
+    __loop_free_dead(loop);
+    close(loop->epfd);
+    free(loop);
+}
+
+
+//the asynchronous cluster client starts from here
+
+asyncCluster* async_connect(const char* ip,int port,asyncAttachFn attach,void* loop){
+    if(ip == NULL || loop == NULL){
+        printf("NULL pointer %s %d\n",__FILE__,__LINE__);
+        return NULL;
+    }
+    topologyEntry* entry = topology_lookup(ip,port);
+    if(entry == NULL)
+        return NULL;
+    clusterTopology* topology = topology_attach(entry);
+    if(topology == NULL){
+        printf("return error in async_connect\n");
+        return NULL;
+    }
+
+    asyncCluster* cluster = (asyncCluster*)malloc(sizeof(asyncCluster));
+    asyncNode** nodes = (asyncNode**)malloc(sizeof(asyncNode*)*(topology->len > 0 ? topology->len : 1));
+    if(cluster == NULL || nodes == NULL){
+        printf("panic! %s %d\n",__FILE__,__LINE__);
+        free(cluster);
+        free(nodes);
+        topology_release(topology);
+        topology_detach(entry);
+        return NULL;
+    }
+    cluster->entry = entry;
+    cluster->topology = topology;
+    cluster->len = topology->len;
+    cluster->nodes = nodes;
+    cluster->attach = attach != NULL ? attach : async_loop_attach;
+    cluster->loop = loop;
+    cluster->pending = 0;
+    cluster->connections = 0;
+    cluster->disconnecting = 0;
+    cluster->free_requests = NULL;
+
+    int i;
+    for(i=0;i<topology->len;i++)
+        nodes[i] = __new_async_node(cluster,topology->nodes[i]);
+    return cluster;
+}
+
+static asyncNode* __new_async_node(asyncCluster* cluster,topologyNode* node){
+    asyncNode* n = (asyncNode*)malloc(sizeof(asyncNode));
+    n->ip = (char*)malloc(strlen(node->ip)+1);
+    strcpy(n->ip,node->ip);
+    n->port = node->port;
+    n->context = NULL;
+    n->cluster = cluster;
+    n->orphan = 0;
+    return n;
+}
+
+static void __free_async_node(asyncNode* node){
+    free(node->ip);
+    free(node);
+}
+
+/*
+*the node has left the layout. Its connection is closed once the commands in flight on it are
+*answered, the node goes with it.
+*/
+static void __release_async_node(asyncNode* node){
+    if(node->context == NULL){
+        __free_async_node(node);
+        return;
+    }
+    node->orphan = 1;
+    //may close the connection, and free the node, right away
+    redisAsyncDisconnect(node->context);
+}
+
+/*
+*the connection to a node, started now if there is none. The connect completes in the loop, commands
+*queued before are sent then. returns NULL if the connection can't even be started.
+*/
+static redisAsyncContext* __async_node_context(asyncCluster* cluster,asyncNode* node){
+    if(node->context != NULL)
+        return node->context;
+    redisAsyncContext* ac = redisAsyncConnect(node->ip,node->port);
+    if(ac == NULL || ac->err){
+        printf("connection refused ip=%s, port=%d\n",node->ip,node->port);
+        if(ac != NULL)
+            redisAsyncFree(ac);
+        return NULL;
+    }
+    if(cluster->attach(ac,cluster->loop) != REDIS_OK){
+        printf("unable to attach the connection to ip=%s, port=%d to the loop\n",node->ip,node->port);
+        redisAsyncFree(ac);
+        return NULL;
+    }
+    ac->data = node;
+    redisAsyncSetConnectCallback(ac,__async_connected);
+    redisAsyncSetDisconnectCallback(ac,__async_disconnected);
+    node->context = ac;
+    cluster->connections++;
+    return ac;
+}
+
+/*
+*a failed connect doesn't get to __async_disconnected, hiredis frees the context right after.
+*/
+static void __async_connected(const redisAsyncContext* ac,int status){
+    if(status == REDIS_OK)
+        return;
+    asyncNode* node = (asyncNode*)ac->data;
+    printf("connection refused ip=%s, port=%d\n",node->ip,node->port);
+    __async_closed(node->cluster,node,status);
+}
+
+static void __async_disconnected(const redisAsyncContext* ac,int status){
+    asyncNode* node = (asyncNode*)ac->data;
+    if(status != REDIS_OK)
+        printf("connection to ip=%s, port=%d lost\n",node->ip,node->port);
+    __async_closed(node->cluster,node,status);
+}
+
+/*
+*the connection of the node is gone, the callbacks of its commands have run. The node stays for the
+*next command routed to it, unless it has left the layout.
+*/
+static void __async_closed(asyncCluster* cluster,asyncNode* node,int status){
+    node->context = NULL;
+    cluster->connections--;
+    if(node->orphan)
+        __free_async_node(node);
+    else if(status != REDIS_OK && !cluster->disconnecting && topology_note_error(cluster->entry))
+        //which is what a failover looks like from here
+        __async_refresh_topology(cluster);
+    __async_maybe_free(cluster);
+}
+
+/*
+*move to the newest shared layout. Nodes still in the layout keep their connections, commands in
+*flight on the others are answered before those connections close.
+*/
+static void __async_sync_topology(asyncCluster* cluster){
+    if(topology_version(cluster->entry) == cluster->topology->version)
+        return;
+    clusterTopology* topology = topology_acquire(cluster->entry);
+    if(topology == NULL)
+        return;
+    asyncNode** nodes = (asyncNode**)malloc(sizeof(asyncNode*)*(topology->len > 0 ? topology->len : 1));
+    if(nodes == NULL){
+        printf("panic! %s %d\n",__FILE__,__LINE__);
+        topology_release(topology);
+        return;
+    }
+
+    asyncNode** old = cluster->nodes;
+    int len = cluster->len;
+    int i,j;
+    for(i=0;i<topology->len;i++){
+        topologyNode* node = topology->nodes[i];
+        nodes[i] = NULL;
+        for(j=0;j<len;j++){
+            if(old[j] != NULL && old[j]->port == node->port && strcmp(old[j]->ip,node->ip) == 0){
+                nodes[i] = old[j];
+                old[j] = NULL;
+                break;
+            }
+        }
+        if(nodes[i] == NULL)
+            nodes[i] = __new_async_node(cluster,node);
+    }
+
+    cluster->nodes = nodes;
+    cluster->len = topology->len;
+    topology_release(cluster->topology);
+    cluster->topology = topology;
+
+    //released last, closing a connection may run callbacks which route new commands
+    for(j=0;j<len;j++){
+        if(old[j] != NULL)
+            __release_async_node(old[j]);
+    }
+    free(old);
+}
+
+/*
+*fetch the whole layout again, with a blocking connection. A running refresher is woken instead
+*by topology_note_redirect and topology_note_error, so this is only reached without one.
+*/
+static void __async_refresh_topology(asyncCluster* cluster){
+    int i;
+    for(i=0;i<cluster->len;i++){
+        if(topology_reload(cluster->entry,cluster->nodes[i]->ip,cluster->nodes[i]->port) == 0){
+            __async_sync_topology(cluster);
+            return;
+        }
+    }
+    if(topology_reload(cluster->entry,cluster->entry->ip,cluster->entry->port) == 0){
+        __async_sync_topology(cluster);
+        return;
+    }
+    printf("unable to refresh the cluster layout\n");
+}
+
+/*
+*a MOVED reply, patch the slot in the shared layout as clusterInfo does.
+*/
+static void __async_follow_moved(asyncCluster* cluster,int slot,const char* ip,int port){
+    if(topology_note_redirect(cluster->entry)){
+        __async_refresh_topology(cluster);
+        return;
+    }
+    if(topology_patch_slot(cluster->entry,cluster->topology,slot,ip,port) == 1)
+        __async_sync_topology(cluster);
+}
+
+static asyncNode* __async_find_node(asyncCluster* cluster,const char* ip,int port){
+    topologyNode* node = topology_find_node(cluster->topology,ip,port);
+    if(node == NULL)
+        return NULL;
+    return cluster->nodes[node->index];
+}
+
+/*
+*a request from the pool of the cluster, or a new one, with the command formatted into its buffer.
+*returns NULL if errors occur.
+*/
+static asyncRequest* __async_take_request(asyncCluster* cluster,int argc,const char** argv,const size_t* argvlen){
+    asyncRequest* req = cluster->free_requests;
+    if(req != NULL){
+        cluster->free_requests = req->next;
+    }else{
+        req = (asyncRequest*)malloc(sizeof(asyncRequest));
+        if(req == NULL){
+            printf("unable to allocate asyncRequest\n");
+            return NULL;
+        }
+        req->cmd = NULL;
+        req->capacity = 0;
+    }
+    //a length takes at most 20 digits
+    size_t total = 1 + 20 + 2;
+    int i;
+    for(i=0;i<argc;i++)
+        total += 1 + 20 + 2 + argvlen[i] + 2;
+    if(total > req->capacity){
+        char* cmd = (char*)realloc(req->cmd,total);
+        if(cmd == NULL){
+            printf("unable to format the command %s %d\n",__FILE__,__LINE__);
+            __async_put_request(cluster,req);
+            return NULL;
+        }
+        req->cmd = cmd;
+        req->capacity = total;
+    }
+    char* p = req->cmd;
+    p += sprintf(p,"*%d\r\n",argc);
+    for(i=0;i<argc;i++){
+        p += sprintf(p,"$%zu\r\n",argvlen[i]);
+        memcpy(p,argv[i],argvlen[i]);
+        p += argvlen[i];
+        *p++ = '\r';
+        *p++ = '\n';
+    }
+    req->len = p - req->cmd;
+    req->cluster = cluster;
+    req->redirects = 0;
+    return req;
+}
+
+/*
+*give the request back to the pool of the cluster.
+*/
+static void __async_put_request(asyncCluster* cluster,asyncRequest* req){
+    if(req->capacity > ASYNC_POOLED_COMMAND_MAX){
+        free(req->cmd);
+        req->cmd = NULL;
+        req->capacity = 0;
+    }
+    req->next = cluster->free_requests;
+    cluster->free_requests = req;
+}
+
+/*
+*queue the request on the node, behind ASKING for an ASK redirect. returns 0 once it is queued.
+*/
+static int __async_send(asyncCluster* cluster,asyncRequest* req,asyncNode* node,int asking){
+    redisAsyncContext* ac = __async_node_context(cluster,node);
+    if(ac == NULL)
+        return -1;
+    if(asking && redisAsyncCommand(ac,NULL,NULL,"ASKING") != REDIS_OK)
+        return -1;
+    if(redisAsyncFormattedCommand(ac,__async_reply,req,req->cmd,req->len) != REDIS_OK)
+        return -1;
+    return 0;
+}
+
+static int __async_submit(asyncCluster* cluster,asyncClusterCallback fn,void* privdata,int slot,
+                          int argc,const char** argv,const size_t* argvlen){
+    if(cluster->disconnecting){
+        printf("the cluster is disconnecting, command rejected\n");
+        return -1;
+    }
+    __async_sync_topology(cluster);
+    uint16_t index = __atomic_load_n(&cluster->topology->slot_to_node[slot],__ATOMIC_RELAXED);
+    if(index == SLOT_UNASSIGNED){
+        printf("can't find the host for slot %d\n",slot);
+        return -1;
+    }
+
+    asyncRequest* req = __async_take_request(cluster,argc,argv,argvlen);
+    if(req == NULL)
+        return -1;
+    req->fn = fn;
+    req->privdata = privdata;
+
+    asyncNode* node = cluster->nodes[index];
+    if(__async_send(cluster,req,node,0) != 0){
+        printf("unable to send the command to ip=%s, port=%d\n",node->ip,node->port);
+        __async_put_request(cluster,req);
+        return -1;
+    }
+    cluster->pending++;
+    return 0;
+}
+
+/*
+*the reply of a request. Redirects are followed here, anything else goes to the callback.
+*/
+static void __async_reply(redisAsyncContext* ac,void* r,void* privdata){
+    (void)ac;
+    asyncRequest* req = (asyncRequest*)privdata;
+    asyncCluster* cluster = req->cluster;
+    redisReply* reply = (redisReply*)r;
+
+    if(reply != NULL && reply->type == REDIS_REPLY_ERROR && req->redirects < ASYNC_MAX_REDIRECTS
+       && !cluster->disconnecting){
+        int moved = !strncmp(reply->str,"MOVED ",6);
+        char ip[64];
+        int port,slot;
+        if((moved || !strncmp(reply->str,"ASK ",4))
+           && topology_parse_redirect(reply->str,&slot,ip,sizeof(ip),&port) == 0){
+            req->redirects++;
+            if(moved)
+                __async_follow_moved(cluster,slot,ip,port);
+            //a node outside the layout can only come from ASK, its reply goes to the callback
+            asyncNode* node = __async_find_node(cluster,ip,port);
+            if(node != NULL && __async_send(cluster,req,node,!moved) == 0)
+                return;
+        }
+    }
+
+    cluster->pending--;
+    //back in the pool before the callback, which may send the next command or free the cluster
+    asyncClusterCallback fn = req->fn;
+    void* data = req->privdata;
+    __async_put_request(cluster,req);
+    if(fn != NULL)
+        fn(cluster,reply,data);
+    __async_maybe_free(cluster);
+}
+
+int async_setn(asyncCluster* cluster,asyncClusterCallback fn,void* privdata,const char* key,size_t keylen,
+               const char* value,size_t valuelen){
+    if(cluster == NULL || key == NULL || value == NULL){
+        printf("NULL pointer %s %d\n",__FILE__,__LINE__);
+        return -1;
+    }
+    const char* argv[3] = {"set",key,value};
+    size_t argvlen[3] = {3,keylen,valuelen};
+    return __async_submit(cluster,fn,privdata,keyHashSlot(key,keylen),3,argv,argvlen);
+}
+
+int async_getn(asyncCluster* cluster,asyncClusterCallback fn,void* privdata,const char* key,size_t keylen){
+    if(cluster == NULL || key == NULL){
+        printf("NULL pointer %s %d\n",__FILE__,__LINE__);
+        return -1;
+    }
+    const char* argv[2] = {"get",key};
+    size_t argvlen[2] = {3,keylen};
+    return __async_submit(cluster,fn,privdata,keyHashSlot(key,keylen),2,argv,argvlen);
+}
+
+int async_command_argv(asyncCluster* cluster,asyncClusterCallback fn,void* privdata,int argc,const char** argv,
+                       const size_t* argvlen,int dbnum){
+    if(cluster == NULL || argv == NULL || argc <= 0){
+        printf("invalid arguments %s %d\n",__FILE__,__LINE__);
+        return -1;
+    }
+    routedCommand routed;
+    if(cluster_route_argv(argc,argv,argvlen,dbnum,&routed) < 0)
+        return -1;
+    //the command is formatted into its own buffer before this returns
+    int re = __async_submit(cluster,fn,privdata,routed.slot,routed.argc,routed.argv,routed.argvlen);
+    cluster_route_release(&routed);
+    return re;
+}
+
+long long async_pending(asyncCluster* cluster){
+    return cluster == NULL ? 0 : cluster->pending;
+}
+
+int start_async_topology_refresher(asyncCluster* cluster,int interval_ms){
+    if(cluster == NULL){
+        printf("NULL pointer %s %d\n",__FILE__,__LINE__);
+        return -1;
+    }
+    return topology_start_refresher(cluster->entry,interval_ms);
+}
+
+void async_disconnect(asyncCluster* cluster){
+    if(cluster == NULL || cluster->disconnecting)
+        return;
+    cluster->disconnecting = 1;
+    //held while the loop below runs, connections without commands in flight close right away
+    cluster->connections++;
+    int i;
+    for(i=0;i<cluster->len;i++){
+        if(cluster->nodes[i]->context != NULL)
+            redisAsyncDisconnect(cluster->nodes[i]->context);
+    }
+    cluster->connections--;
+    __async_maybe_free(cluster);
+}
+
+/*
+*free the cluster once it is disconnecting and nothing refers to it any more.
+*/
+static void __async_maybe_free(asyncCluster* cluster){
+    if(!cluster->disconnecting || cluster->pending != 0 || cluster->connections != 0)
+        return;
+    int i;
+    for(i=0;i<cluster->len;i++)
+        __free_async_node(cluster->nodes[i]);
+    free(cluster->nodes);
+    while(cluster->free_requests != NULL){
+        asyncRequest* req = cluster->free_requests;
+        cluster->free_requests = req->next;
+        free(req->cmd);
+        free(req);
+    }
+    topology_release(cluster->topology);
+    topology_detach(cluster->entry);
+    free(cluster);
+}
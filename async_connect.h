@@ -0,0 +1,132 @@
+#ifndef ASYNC_CONNECT_H
+#define ASYNC_CONNECT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <hiredis/hiredis.h>
+#include <hiredis/async.h>
+#include "topology.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+*an event loop on epoll for the redisAsyncContext of an asyncCluster. Any other loop can drive the
+*cluster instead through its hiredis adapter, see async_connect.
+*/
+//events handled by one call of async_loop_run_once at most
+#define ASYNC_LOOP_EVENTS 256
+
+struct asyncLoopEvent;
+typedef struct asyncEventLoop{
+    int epfd;
+    //set by async_loop_stop, async_loop_run returns once it sees it
+    int stop;
+    //events whose context has been freed, they are freed after the round that may still see them
+    struct asyncLoopEvent* dead;
+}asyncEventLoop;
+
+//a new loop, NULL on error
+asyncEventLoop* async_loop_create();
+//the hiredis adapter of the loop, loop is an asyncEventLoop*. returns REDIS_OK or REDIS_ERR
+int async_loop_attach(redisAsyncContext* ac,void* loop);
+//wait up to timeout_ms, -1 for ever, and handle what is ready. returns the number of events, -1 on error
+int async_loop_run_once(asyncEventLoop* loop,int timeout_ms);
+//handle events until async_loop_stop is called, usually from a callback
+void async_loop_run(asyncEventLoop* loop);
+void async_loop_stop(asyncEventLoop* loop);
+//the contexts attached to the loop have to be gone before it is released
+void async_loop_release(asyncEventLoop* loop);
+
+/*
+*attaches a new redisAsyncContext to an event loop. async_loop_attach is one, async_adapters.h wraps
+*the hiredis adapters of libevent, libev, ae and libuv. Another adapter needs a wrapper of the same
+*shape, it must not be cast to asyncAttachFn.
+*/
+typedef int (*asyncAttachFn)(redisAsyncContext* ac,void* loop);
+
+struct asyncCluster;
+/*
+*called once for every command with its reply, or with NULL if the command could not be delivered.
+*the reply belongs to hiredis and is freed when the callback returns.
+*/
+typedef void (*asyncClusterCallback)(struct asyncCluster* cluster,redisReply* reply,void* privdata);
+
+/*
+*asyncNode is the connection of an asyncCluster to one instance, the counterpart of parseArgv.
+*/
+typedef struct asyncNode{
+    char* ip;
+    int port;
+    //NULL until a command is routed to the instance, and again once the connection is closed
+    redisAsyncContext* context;
+    struct asyncCluster* cluster;
+    //1 once the instance has left the layout, the node is freed when its connection closes
+    int orphan;
+}asyncNode;
+
+/*
+*an asynchronous client of a redis cluster. It routes with the same shared clusterTopology as
+*clusterInfo, so both kinds of clients of one seed see the same layout, but every command is only
+*queued and its callback runs from the event loop once the reply is in. One thread can keep any
+*number of commands in flight on every node. Commands go to the masters, MOVED and ASK replies are
+*followed up to ASYNC_MAX_REDIRECTS times before the reply is handed to the callback.
+*A full reload of the layout, after REDIRECT_REFRESH_THRESHOLD redirects or errors, blocks the loop
+*for a round trip, unless start_async_topology_refresher has started a refresher thread.
+*An asyncCluster belongs to the thread running its loop.
+*/
+#define ASYNC_MAX_REDIRECTS 5
+//command buffers up to this size are kept in the pool of requests, larger ones are freed after use
+#define ASYNC_POOLED_COMMAND_MAX 65536
+
+typedef struct asyncCluster{
+    //size of the cluster
+    int len;
+    //nodes[i] holds the connection to topology->nodes[i], len entries
+    asyncNode** nodes;
+    //the shared snapshot this client is currently routing with
+    clusterTopology* topology;
+    //where new snapshots are published
+    topologyEntry* entry;
+    asyncAttachFn attach;
+    void* loop;
+    //commands sent whose callback hasn't run yet
+    long long pending;
+    //connections not closed yet, the nodes that left the layout included
+    int connections;
+    //1 after async_disconnect, the cluster is freed once pending and connections reach 0
+    int disconnecting;
+    //answered requests kept with their command buffer for the next commands
+    struct asyncRequest* free_requests;
+}asyncCluster;
+
+/*
+*connect to the cluster behind ip:port. The layout is fetched now, with a blocking connection,
+*the nodes are connected by the first command routed to them. attach NULL means async_loop_attach
+*and an asyncEventLoop* as loop. returns NULL if errors occur.
+*/
+asyncCluster* async_connect(const char* ip,int port,asyncAttachFn attach,void* loop);
+//the counterparts of cluster_pipeline_setn/getn, 0 once the command is queued, -1 if it can't be sent
+int async_setn(asyncCluster* cluster,asyncClusterCallback fn,void* privdata,const char* key,size_t keylen,
+               const char* value,size_t valuelen);
+int async_getn(asyncCluster* cluster,asyncClusterCallback fn,void* privdata,const char* key,size_t keylen);
+//any command of the key table, routed and prefixed with dbnum like cluster_command_argv
+int async_command_argv(asyncCluster* cluster,asyncClusterCallback fn,void* privdata,int argc,const char** argv,
+                       const size_t* argvlen,int dbnum);
+//commands whose callback hasn't run yet
+long long async_pending(asyncCluster* cluster);
+//start the refresher thread of the shared layout, see start_topology_refresher
+int start_async_topology_refresher(asyncCluster* cluster,int interval_ms);
+/*
+*stop taking commands and close every connection once the commands in flight are answered. The
+*cluster is freed from the loop after the last callback, it must not be used after this call.
+*/
+void async_disconnect(asyncCluster* cluster);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
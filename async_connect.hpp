@@ -0,0 +1,284 @@
+#ifndef ASYNC_CONNECT_HPP
+#define ASYNC_CONNECT_HPP
+
+/*
+*C++20 coroutines over asyncCluster. A Request is an awaitable command, the coroutine is suspended
+*when the command is sent and resumed from the event loop by its reply:
+*
+*    chiredis::Task run(chiredis::Cluster& cluster) {
+*        chiredis::Reply r = co_await cluster.get("key");
+*        if(r && !r.is_nil()) use(r.str());
+*    }
+*
+*The Request lives in the coroutine frame and the reply is read where hiredis parsed it, so nothing is
+*allocated on the C++ side of an await. Below it, asyncCluster reuses its requests and their command
+*buffers, what is left per command is the callback entry and the reply object of hiredis.
+*The arguments of a Request are read when it is sent, they have to live until then.
+*/
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "async_connect.h"
+
+namespace chiredis {
+
+/*
+*the reply a co_await resumes with, a view of hiredis' redisReply. It is freed when the coroutine
+*suspends again, copy what has to be kept. A Reply that tests false means the command was not sent
+*or its connection was lost.
+*/
+class Reply {
+public:
+    explicit Reply(const redisReply* reply) noexcept : reply_(reply) {}
+    explicit operator bool() const noexcept { return reply_ != nullptr; }
+    int type() const noexcept { return reply_ != nullptr ? reply_->type : 0; }
+    bool is_nil() const noexcept { return type() == REDIS_REPLY_NIL; }
+    bool is_error() const noexcept { return type() == REDIS_REPLY_ERROR; }
+    //string, status and error replies
+    std::string_view str() const noexcept {
+        return reply_ != nullptr && reply_->str != nullptr ? std::string_view(reply_->str,reply_->len) : std::string_view();
+    }
+    long long integer() const noexcept { return reply_ != nullptr ? reply_->integer : 0; }
+    const redisReply* get() const noexcept { return reply_; }
+private:
+    const redisReply* reply_;
+};
+
+/*
+*a copy of a reply, what when_all leaves in every Request. str keeps its storage from one assign to
+*the next, so a Request reused for the same keys stops allocating once its values have been seen.
+*/
+struct Value {
+    //REDIS_REPLY_* of the reply, 0 if there was none
+    int type = 0;
+    //integer replies, and the number of elements of an array
+    long long integer = 0;
+    //string, status and error replies
+    std::string str;
+
+    void assign(const redisReply* reply) {
+        if(reply == nullptr){
+            type = 0;
+            integer = 0;
+            str.clear();
+            return;
+        }
+        type = reply->type;
+        integer = reply->type == REDIS_REPLY_ARRAY ? (long long)reply->elements : reply->integer;
+        if(reply->type == REDIS_REPLY_STRING || reply->type == REDIS_REPLY_STATUS || reply->type == REDIS_REPLY_ERROR)
+            str.assign(reply->str,reply->len);
+        else
+            str.clear();
+    }
+    explicit operator bool() const noexcept { return type != 0; }
+    bool is_nil() const noexcept { return type == REDIS_REPLY_NIL; }
+};
+
+class WhenAll;
+
+/*
+*one command of a Cluster. It is sent by co_await, or by when_all together with others, and must not
+*move from then until its reply is in.
+*/
+class Request {
+public:
+    //commands of up to this many arguments are sent from the stack, longer ones from arrays made by the constructor
+    static constexpr int inline_args = 16;
+
+    //a get of the key
+    Request(asyncCluster* cluster,std::string_view key) noexcept
+        : cluster_(cluster), kind_(kind_get), key_(key), value_arg_(), args_(), dbnum_(-1) {}
+    //a set of the key
+    Request(asyncCluster* cluster,std::string_view key,std::string_view value) noexcept
+        : cluster_(cluster), kind_(kind_set), key_(key), value_arg_(value), args_(), dbnum_(-1) {}
+    //any command of the key table, throws std::bad_alloc if the arrays of a long command can't be made
+    Request(asyncCluster* cluster,std::span<const std::string_view> args,int dbnum)
+        : cluster_(cluster), kind_(kind_argv), key_(), value_arg_(), args_(args), dbnum_(dbnum) {
+        if(args.size() > (size_t)inline_args){
+            long_argv_.resize(args.size());
+            long_argvlen_.resize(args.size());
+        }
+    }
+
+    Request(Request&&) = default;
+    Request& operator=(Request&&) = default;
+    Request(const Request&) = delete;
+    Request& operator=(const Request&) = delete;
+
+    bool await_ready() const noexcept { return false; }
+    //a command that can't be sent doesn't suspend, the coroutine goes on with an empty Reply
+    bool await_suspend(std::coroutine_handle<> handle) noexcept {
+        handle_ = handle;
+        group_ = nullptr;
+        reply_ = nullptr;
+        return send();
+    }
+    Reply await_resume() const noexcept { return Reply(reply_); }
+
+    //the reply copied by when_all
+    const Value& value() const noexcept { return value_; }
+
+private:
+    friend class WhenAll;
+
+    enum { kind_get, kind_set, kind_argv };
+
+    bool send() noexcept {
+        if(kind_ == kind_get)
+            return async_getn(cluster_,on_reply,this,key_.data(),key_.size()) == 0;
+        if(kind_ == kind_set)
+            return async_setn(cluster_,on_reply,this,key_.data(),key_.size(),value_arg_.data(),value_arg_.size()) == 0;
+        if(args_.size() <= (size_t)inline_args){
+            const char* argv[inline_args];
+            size_t argvlen[inline_args];
+            return send_argv(argv,argvlen);
+        }
+        return send_argv(long_argv_.data(),long_argvlen_.data());
+    }
+
+    bool send_argv(const char** argv,size_t* argvlen) noexcept {
+        for(size_t i=0;i<args_.size();i++){
+            argv[i] = args_[i].data();
+            argvlen[i] = args_[i].size();
+        }
+        return async_command_argv(cluster_,on_reply,this,(int)args_.size(),argv,argvlen,dbnum_) == 0;
+    }
+
+    static void on_reply(asyncCluster*,redisReply* reply,void* privdata);
+
+    asyncCluster* cluster_;
+    int kind_;
+    std::string_view key_;
+    std::string_view value_arg_;
+    std::span<const std::string_view> args_;
+    int dbnum_;
+    std::coroutine_handle<> handle_;
+    //only valid while the coroutine runs on from the callback
+    const redisReply* reply_ = nullptr;
+    WhenAll* group_ = nullptr;
+    Value value_;
+    //the arguments of a command longer than inline_args, sized when the Request is made
+    std::vector<const char*> long_argv_;
+    std::vector<size_t> long_argvlen_;
+};
+
+/*
+*co_await when_all(requests) sends every request before waiting for any, the coroutine is resumed
+*with the number of requests that got no reply once the last one is in. Each reply is copied to
+*the value() of its Request.
+*/
+class WhenAll {
+public:
+    explicit WhenAll(std::span<Request> requests) noexcept : requests_(requests) {}
+
+    bool await_ready() const noexcept { return requests_.empty(); }
+    bool await_suspend(std::coroutine_handle<> handle) noexcept {
+        handle_ = handle;
+        //one more than the requests until all are sent, so that a batch that can't be sent at all doesn't suspend
+        remaining_ = requests_.size() + 1;
+        for(Request& request : requests_){
+            request.group_ = this;
+            if(!request.send()){
+                request.value_.assign(nullptr);
+                remaining_--;
+            }
+        }
+        return --remaining_ != 0;
+    }
+    size_t await_resume() const noexcept {
+        size_t failed = 0;
+        for(const Request& request : requests_){
+            if(!request.value_)
+                failed++;
+        }
+        return failed;
+    }
+
+private:
+    friend class Request;
+
+    void done() noexcept {
+        if(--remaining_ == 0)
+            handle_.resume();
+    }
+
+    std::span<Request> requests_;
+    size_t remaining_ = 0;
+    std::coroutine_handle<> handle_;
+};
+
+inline WhenAll when_all(std::span<Request> requests) noexcept {
+    return WhenAll(requests);
+}
+
+inline void Request::on_reply(asyncCluster*,redisReply* reply,void* privdata) {
+    Request* request = static_cast<Request*>(privdata);
+    if(request->group_ != nullptr){
+        request->value_.assign(reply);
+        request->group_->done();
+        return;
+    }
+    request->reply_ = reply;
+    //the coroutine may end and free the request before this returns
+    request->handle_.resume();
+}
+
+/*
+*a coroutine that starts right away and frees itself when it returns. Its frame is allocated once
+*per coroutine, not per await.
+*/
+struct Task {
+    struct promise_type {
+        Task get_return_object() noexcept { return Task(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+/*
+*an asyncCluster owned by C++. The loop has to keep running after the Cluster is destroyed until the
+*commands in flight are answered, async_disconnect frees the client from there.
+*/
+class Cluster {
+public:
+    Cluster(const char* ip,int port,asyncEventLoop* loop) noexcept
+        : cluster_(async_connect(ip,port,nullptr,loop)) {}
+    Cluster(const char* ip,int port,asyncAttachFn attach,void* loop) noexcept
+        : cluster_(async_connect(ip,port,attach,loop)) {}
+    ~Cluster() {
+        if(cluster_ != nullptr)
+            async_disconnect(cluster_);
+    }
+    Cluster(const Cluster&) = delete;
+    Cluster& operator=(const Cluster&) = delete;
+
+    //false if the layout couldn't be fetched, every request then fails
+    explicit operator bool() const noexcept { return cluster_ != nullptr; }
+    asyncCluster* handle() const noexcept { return cluster_; }
+    long long pending() const noexcept { return async_pending(cluster_); }
+
+    Request get(std::string_view key) noexcept { return Request(cluster_,key); }
+    Request set(std::string_view key,std::string_view value) noexcept { return Request(cluster_,key,value); }
+    /*
+    *any command of the key table, see async_command_argv:
+    *    std::string_view args[] = {"incrby","counter","1"};
+    *    chiredis::Reply r = co_await cluster.command(args);
+    *a command of more than Request::inline_args arguments allocates here, and may throw std::bad_alloc.
+    */
+    Request command(std::span<const std::string_view> args,int dbnum = -1) {
+        return Request(cluster_,args,dbnum);
+    }
+
+private:
+    asyncCluster* cluster_;
+};
+
+}
+
+#endif
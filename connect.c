@@ -4,33 +4,220 @@
 #include <errno.h>
 #include "crc16.h"
 #include <string.h>
+#include <strings.h>
 #include <assert.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <fcntl.h>
 
 #define CHECK_REPLY
+//weight of a new sample in parseArgv->latency_us
+#define LATENCY_EWMA_WEIGHT 0.125
+//READ_LOWEST_LATENCY sends one read in READ_PROBE_INTERVAL to the worse candidate, so it can recover
+#define READ_PROBE_INTERVAL 64
+
+/*
+*a command as an argv array. It is only read, so the request can be sent again after a redirect.
+*/
+typedef struct clusterRequest{
+    int argc;
+    const char** argv;
+    const size_t* argvlen;
+    //or a RESP frame encoded by the caller, sent as it is
+    const char* frame;
+    size_t frame_len;
+}clusterRequest;
+
+/*
+*the keys of a cluster_mget or cluster_mset which share a slot, they go out as one command.
+*the keys are order[start] to order[start+count-1] of the input.
+*/
+typedef struct slotBatch{
+    int slot;
+    int start;
+    int count;
+    parseArgv* node;
+    redisReply* reply;
+}slotBatch;
+
+/*
+*where the keys of a command are, as redis describes them in COMMAND: argv[first] to argv[last]
+*every step arguments, a negative last counts from the end. read commands may go to a replica.
+*/
+typedef struct commandKeys{
+    const char* name;
+    int first;
+    int last;
+    int step;
+    int read;
+}commandKeys;
+
+//sorted by name for bsearch
+static const commandKeys command_keys[] = {
+    {"append",1,1,1,0},
+    {"decr",1,1,1,0},
+    {"decrby",1,1,1,0},
+    {"del",1,-1,1,0},
+    {"exists",1,-1,1,1},
+    {"expire",1,1,1,0},
+    {"expireat",1,1,1,0},
+    {"get",1,1,1,1},
+    {"getrange",1,1,1,1},
+    {"getset",1,1,1,0},
+    {"hdel",1,1,1,0},
+    {"hexists",1,1,1,1},
+    {"hget",1,1,1,1},
+    {"hgetall",1,1,1,1},
+    {"hincrby",1,1,1,0},
+    {"hincrbyfloat",1,1,1,0},
+    {"hkeys",1,1,1,1},
+    {"hlen",1,1,1,1},
+    {"hmget",1,1,1,1},
+    {"hmset",1,1,1,0},
+    {"hset",1,1,1,0},
+    {"hsetnx",1,1,1,0},
+    {"hvals",1,1,1,1},
+    {"incr",1,1,1,0},
+    {"incrby",1,1,1,0},
+    {"incrbyfloat",1,1,1,0},
+    {"lindex",1,1,1,1},
+    {"linsert",1,1,1,0},
+    {"llen",1,1,1,1},
+    {"lpop",1,1,1,0},
+    {"lpush",1,1,1,0},
+    {"lrange",1,1,1,1},
+    {"lrem",1,1,1,0},
+    {"lset",1,1,1,0},
+    {"ltrim",1,1,1,0},
+    {"mget",1,-1,1,1},
+    {"mset",1,-1,2,0},
+    {"persist",1,1,1,0},
+    {"pexpire",1,1,1,0},
+    {"pexpireat",1,1,1,0},
+    {"psetex",1,1,1,0},
+    {"pttl",1,1,1,1},
+    {"rename",1,2,1,0},
+    {"rpop",1,1,1,0},
+    {"rpoplpush",1,2,1,0},
+    {"rpush",1,1,1,0},
+    {"sadd",1,1,1,0},
+    {"scard",1,1,1,1},
+    {"sdiff",1,-1,1,1},
+    {"sdiffstore",1,-1,1,0},
+    {"set",1,1,1,0},
+    {"setex",1,1,1,0},
+    {"setnx",1,1,1,0},
+    {"setrange",1,1,1,0},
+    {"sinter",1,-1,1,1},
+    {"sinterstore",1,-1,1,0},
+    {"sismember",1,1,1,1},
+    {"smembers",1,1,1,1},
+    {"smove",1,2,1,0},
+    {"spop",1,1,1,0},
+    {"srandmember",1,1,1,1},
+    {"srem",1,1,1,0},
+    {"strlen",1,1,1,1},
+    {"sunion",1,-1,1,1},
+    {"sunionstore",1,-1,1,0},
+    {"ttl",1,1,1,1},
+    {"type",1,1,1,1},
+    {"unlink",1,-1,1,0},
+    {"zadd",1,1,1,0},
+    {"zcard",1,1,1,1},
+    {"zcount",1,1,1,1},
+    {"zincrby",1,1,1,0},
+    {"zrange",1,1,1,1},
+    {"zrangebyscore",1,1,1,1},
+    {"zrank",1,1,1,1},
+    {"zrem",1,1,1,0},
+    {"zremrangebyrank",1,1,1,0},
+    {"zremrangebyscore",1,1,1,0},
+    {"zrevrange",1,1,1,1},
+    {"zrevrangebyscore",1,1,1,1},
+    {"zrevrank",1,1,1,1},
+    {"zscore",1,1,1,1},
+};
+
+typedef struct commandName{
+    const char* name;
+    size_t len;
+}commandName;
 static char* CHIREDIS_VERSION = "1.0.4";
 //the following are a list of internal function that are not intended to be used outsize this file.
-static void __global_disconnect(clusterInfo* cluster);
-static clusterInfo* __connect_cluster(char* ip, int port);
-static clusterInfo* __clusterInfo(redisContext* localContext);
+static clusterInfo* __connect_cluster(char* ip, int port, int lazy, int timeout_ms);
+static clusterInfo* __clusterInfo(topologyEntry* entry, clusterTopology* topology, int lazy, int timeout_ms);
+static parseArgv* __new_parseArgv(topologyNode* node);
 static void __test_slot(clusterInfo* mycluster);
-static void __from_str_to_parseArgv(char * temp, clusterInfo* mycluster);
-static void __process_clusterInfo(clusterInfo* mycluster);
-static void __assign_slots(clusterInfo* mycluster);
 static void __add_context_to_cluster(clusterInfo* mycluster);
+static void __connect_replica(clusterInfo* cluster,parseArgv* replica);
+static int __check_readonly(parseArgv* replica,redisReply* r);
+static void __connect_parallel(clusterInfo* cluster,parseArgv** nodes,int count);
+static struct timeval __ms_to_timeval(int ms);
+static redisContext* __node_context(clusterInfo* cluster,parseArgv* node);
+static int __replica_usable(parseArgv* replica);
 static void __print_clusterInfo_parsed(clusterInfo* mycluster);
+static void __sync_topology(clusterInfo* mycluster);
+static parseArgv* __slot_to_parse(clusterInfo* cluster,int slot);
+static parseArgv* __read_parse(clusterInfo* cluster,int slot);
+static redisReply* __cluster_read_command_argv(clusterInfo* cluster,int slot,int argc,const char** argv,const size_t* argvlen);
+static redisReply* __cluster_read_request(clusterInfo* cluster,int slot,clusterRequest* req);
+static redisReply* __timed_request(parseArgv* node,clusterRequest* req);
+static redisReply* __send_request(redisContext* c,clusterRequest* req);
+static redisReply* __ask_request(clusterInfo* cluster,const char* ip,int port,clusterRequest* req);
+static redisReply* __cluster_request(clusterInfo* cluster,int slot,clusterRequest* req);
+static parseArgv* __lowest_latency(clusterInfo* cluster,parseArgv** replicas,int count);
+static long long __us_now();
+static void __note_latency(parseArgv* node,long long us);
 static void __remove_context_from_cluster(clusterInfo* mycluster);
 
 
 
-static int __set_nodb(clusterInfo* cluster,const char* key,char* set_in_value);
-static int __set_withdb(clusterInfo* cluster,const char* key, char* set_in_value, int dbnum,int tid);
-
-static int __get_withdb(clusterInfo*cluster, const char* key,char*get_in_value,int dbnum,int tid);
-static int __get_nodb(clusterInfo*cluster, const char* key,char* get_in_value);
-
-static void __set_redirect(char* str);
+static int __set_nodb(clusterInfo* cluster,const char* key,size_t keylen,char* set_in_value);
+static int __set_withdb(clusterInfo* cluster,const char* key, char* set_in_value, int dbnum);
+
+static int __get_withdb(clusterInfo*cluster, const char* key,char*get_in_value,int dbnum);
+static int __get_nodb(clusterInfo*cluster, const char* key,size_t keylen,char* get_in_value);
+static redisReply* __set_argv(clusterInfo* cluster,const char* key,size_t keylen,const char* value,size_t valuelen);
+static redisReply* __get_argv(clusterInfo* cluster,const char* key,size_t keylen);
+static char* __db_key(int dbnum,const char* key,size_t keylen,char* buf,size_t cap,size_t* len);
+static redisReply* __get_withdb_argv(clusterInfo* cluster,const char* key,size_t keylen,int dbnum);
+static int __set_status(redisReply* r);
+static int __copy_value(redisReply* r,char* value,size_t capacity,size_t* valuelen);
+static int __copy_element(redisReply* r,char* value,size_t capacity,size_t* valuelen);
+static int __view_value(redisReply* r,replyView* view);
+static char* __bulk_header(char* p,size_t n);
+static char* __namespace_frame(const clusterNamespace* ns,const char* head,size_t headlen,const char* key,size_t keylen,
+                               const char* value,size_t valuelen,char* buf,size_t cap,size_t* len);
+static redisReply* __namespace_request(clusterInfo* cluster,const clusterNamespace* ns,const char* key,size_t keylen,
+                                       const char* value,size_t valuelen);
+
+static parseArgv* __find_parse(clusterInfo* cluster,const char* ip,int port);
+static void __follow_moved(clusterInfo* cluster,int slot,const char* ip,int port);
+static void __note_node_error(clusterInfo* cluster);
+static int __slot_argv(const char* cmd,const char** keys,const char** values,int count,int dbnum,const char** argv,char** prefixed);
+static void __free_prefixed(char** prefixed,int count);
+static int __compare_slot_key(const void* a,const void* b);
+static int __compare_command(const void* key,const void* entry);
+static const commandKeys* __command_keys(const char* name,size_t len);
+static int __route_command(int argc,const char** argv,const size_t* argvlen,int dbnum,
+                           const char** out,size_t* outlen,char** arena,int* read);
+static int __scatter(clusterInfo* cluster,const char* cmd,const char** keys,const char** values,int count,
+                     int dbnum,int* order,slotBatch* batches);
+static redisReply* __cluster_command_argv(clusterInfo* cluster,int slot,int argc,const char** argv,const size_t* argvlen);
 
 static redisReply* __cluster_pipeline_getReply(clusterInfo *cluster,clusterPipe *mypipe);
+static int __grow_pipeline(clusterPipe* mypipe,int n);
+static int __pipeline_take_reply(clusterPipe *mypipe,parseArgv* node);
+static void __pipeline_node_failed(parseArgv* node);
+static int __grow_stream(clusterStream* stream);
+static int __stream_submit(clusterStream* stream,int slot,int read,int argc,const char** argv,const size_t* argvlen);
+static int __stream_flush_node(clusterStream* stream,parseArgv* node);
+static int __stream_read(clusterStream* stream,parseArgv* node,int wait);
+static void __stream_fail(clusterStream* stream,parseArgv* node);
+static void __stream_poll(clusterStream* stream);
+static void __stream_flush_idle(clusterStream* stream);
+static void __stream_follow_moved(clusterStream* stream);
 
 void get_chiredis_version() {
     printf("Chiredis version = %s\n",CHIREDIS_VERSION);
@@ -67,322 +254,801 @@ int check_reply(redisReply* reply) {
 
 
 clusterInfo* connectRedis(char* ip, int port){
-     __connect_cluster(ip,port);
+     return __connect_cluster(ip,port,0,CONNECT_TIMEOUT_MS);
+}
+
+clusterInfo* connectRedisLazy(char* ip, int port){
+     return __connect_cluster(ip,port,1,CONNECT_TIMEOUT_MS);
+}
+
+clusterInfo* connectRedisWithTimeout(char* ip, int port, int timeout_ms){
+     return __connect_cluster(ip,port,0,timeout_ms);
 }
 
 /*
-*use the globalContext to connect to the host specified by the user,
-*send "cluster nodes" command through this context,
-*receive the infomation and create clusterInfo struct,
-*which keeps connections to all nodes in the cluster.
+*find the shared layout of the cluster behind the host specified by the user. The layout is
+*fetched with "cluster slots" only if no other clusterInfo in the process is connected through
+*the same host, then create clusterInfo struct, which keeps connections to all nodes in the cluster.
 *
 *returns NULL if errors occur
 */
-static clusterInfo* __connect_cluster(char* ip, int port){
+static clusterInfo* __connect_cluster(char* ip, int port, int lazy, int timeout_ms){
 
-     redisContext* localContext = redisConnect(ip,port);
-	 if(localContext==NULL || localContext->err){
-	     if(localContext!=NULL){
-                  printf("global connection error %s %d %s\n",\
-		                localContext->errstr,__LINE__,__FILE__);
-	          redisFree(localContext);
-		  return NULL;
-	       }else{
-	          printf("can not allocate global context %d %s",\
-		                                  __LINE__,__FILE__);
-		  return NULL;
-	       }
-	 }else{
+	topologyEntry* entry = topology_lookup(ip,port);
+	if(entry == NULL)
+	   return NULL;
 
-	 }
-	 
-	clusterInfo* cluster = __clusterInfo(localContext);
+	clusterTopology* topology = topology_attach(entry);
+	if(topology == NULL){
+	   printf("return error in redisConnect\n");
+	   return NULL;
+	}
+
+	clusterInfo* cluster = __clusterInfo(entry,topology,lazy,timeout_ms);
 
 	if(cluster!=NULL)
 	   return cluster;
 	else{
 	   printf("return error in redisConnect\n");
+	   topology_release(topology);
+	   topology_detach(entry);
 	   return NULL;
 	}
 }
 
 /*
-If we want 
+If we want
 */
 static clusterInfo* __mallocClusterInfo() {
     clusterInfo* mycluster = (clusterInfo*)malloc(sizeof(clusterInfo));
     return mycluster;
 }
 /*
-*This function uses the globle context to send cluster nodes command, and build a clusterInfo
-*based on the string returned. It does this by calling functions from_str_to_cluster,
-*process_clusterInfo,and addign_slot;
+*This function builds a clusterInfo on top of a shared layout, one parseArgv for each node of
+*the layout, and then connects to every node.
 */
-static clusterInfo* __clusterInfo(redisContext* localContext) {
-    redisContext *c = localContext;
-    redisReply* r = (redisReply*)redisCommand(c,"cluster nodes");
-    if(r == NULL) {
+static clusterInfo* __clusterInfo(topologyEntry* entry, clusterTopology* topology, int lazy, int timeout_ms) {
+    clusterInfo* mycluster = __mallocClusterInfo();
+    if(mycluster == NULL) {
         printf("panic! %s %d\n",__FILE__,__LINE__);
         return NULL;
     }
-    clusterInfo* mycluster = __mallocClusterInfo();
 
-    mycluster->globalContext = localContext;
-
-    __from_str_to_parseArgv(r->str,mycluster);
-    freeReplyObject(r);
-    
-    __process_clusterInfo(mycluster);
+    mycluster->entry = entry;
+    mycluster->topology = topology;
+    mycluster->len = topology->len;
+    mycluster->read_policy = READ_MASTER_ONLY;
+    mycluster->read_counter = 0;
+    mycluster->read_callback = NULL;
+    mycluster->read_privdata = NULL;
+    mycluster->lazy = lazy;
+    mycluster->connect_timeout_ms = timeout_ms;
+    //sized to the real cluster, __sync_topology resizes it when the layout changes
+    mycluster->parse = (parseArgv**)malloc(sizeof(parseArgv*)*(topology->len > 0 ? topology->len : 1));
+    if(mycluster->parse == NULL) {
+        printf("panic! %s %d\n",__FILE__,__LINE__);
+        free(mycluster);
+        return NULL;
+    }
 
-    __assign_slots(mycluster);
+    int i;
+    for(i=0;i<topology->len;i++){
+        mycluster->parse[i] = __new_parseArgv(topology->nodes[i]);
+    }
 
     __add_context_to_cluster(mycluster);
     return mycluster;
 }
 
 /*
-*command cluster nodes will return a str, which fall into n parts, one for each node in the 
-*cluster. This function converts the strs to argv in struct clusterInfo, and set mycluster->len, which
-*is the number of nodes in the cluster.
-*Current version only support at most 500 masters in a cluster and it just ignores slaves.
+*the per-client part of a node, the connection is made later by __add_context_to_cluster
 */
-static void __from_str_to_parseArgv(char * temp, clusterInfo* mycluster) {
-
-    char * argv[500];
-    int count = 0;
-    char* point;
-    int copy_len = 0;
-
-    while((point=strchr(temp,'\n'))!=NULL){
-        copy_len = point-temp+1;
-        argv[count] = (char*)malloc(copy_len);
-        strncpy(argv[count],temp,copy_len - 1);
+static parseArgv* __new_parseArgv(topologyNode* node) {
+    parseArgv* argv = (parseArgv*)malloc(sizeof(parseArgv));//do not forget
+    argv->ip = (char*)malloc(strlen(node->ip)+1);
+    strcpy(argv->ip,node->ip);
+    argv->port = node->port;
+    argv->context = NULL;
+    //on default, the pipe mode doesn't open
+    argv->pipe_mode = PIPE_CLOSE;
+    argv->pipe_pending = 0;
+    argv->pipe_next = -1;
+    argv->readonly = node->master >= 0 ? 1 : 0;
+    argv->latency_us = 0;
+    argv->outstanding = 0;
+    argv->unreachable = 0;
+    argv->stream_first = -1;
+    argv->stream_last = -1;
+    argv->stream_sent = -1;
+    return argv;
+}
 
-	if(strstr(argv[count],"slave")!=NULL){
-	     free(argv[count]);
-	     temp = point+1;
-	     continue;
-	}
-        argv[count][copy_len-1] = '\0';
-        count++;
-        temp = point+1;
+/*
+*print all the information about the cluster fro debuging.
+*/
+static void __print_clusterInfo_parsed(clusterInfo* mycluster){
+    int len = mycluster->len;
+    int i;
+    for(i=0;i<len;i++){
+        printf("node %d info\n",i);
+        printf("ip: %s, port: %d\n",mycluster->parse[i]->ip,mycluster->parse[i]->port);
+        printf("slot_count= %d\n",mycluster->topology->nodes[i]->slot_count);
     }
+}
 
-    argv[count] = temp;
 
-    int i;
-    for(i = 0;i<count;i++){
-        mycluster->argv[i] = argv[i];
+//only for testing purposes
+static void __test_slot(clusterInfo* mycluster){
+    int slot[] = {0,5460,5461,10922,10923,16383};
+    int len = sizeof(slot) / sizeof(int);
+    int i=0;
+    for(i=0;i<len;i++){
+        topologyNode* node = topology_slot_owner(mycluster->topology,slot[i]);
+        printf("slot = %d info: ip = %s, port = %d.\n",slot[i],node->ip,node->port);
     }
+}
 
-    mycluster->len = count;
+/*
+*connect to a replica and switch the connection to READONLY, so it serves reads of the slots of
+*its master instead of redirecting them. A replica which can't be used is left without context.
+*/
+static void __connect_replica(clusterInfo* cluster,parseArgv* replica){
+   redisContext* c = redisConnectWithTimeout(replica->ip,replica->port,__ms_to_timeval(cluster->connect_timeout_ms));
+   if(c == NULL || c->err){
+      printf("replica refused ip=%s, port=%d\n",replica->ip,replica->port);
+      if(c != NULL)
+         redisFree(c);
+      replica->unreachable = 1;
+      return;
+   }
+   if(__check_readonly(replica,(redisReply*)redisCommand(c,"readonly")) != 0){
+      redisFree(c);
+      return;
+   }
+   replica->context = c;
 }
 
 /*
-*This function should be called after from_str_to_cluster.It parses the string for each node,and 
-*store the information in mycluster->parse[i]. the parse fild are pointers to  parseArgv struct,each
-*node in the cluster has exactly one such struct, which contains infomation such as ip,port,slot,context..
+*frees the reply to READONLY, marks the replica unreachable if it was refused. returns 0 on success.
 */
-static void __process_clusterInfo(clusterInfo* mycluster){
-    //determine the time of iteration
-    int len = mycluster->len;
-    int len_ip=0;
-    int len_port=0;
-    char* temp;
-    char* ip_start, *port_start, *port_end,*connect_start,*slot_start,*slot_end;
+static int __check_readonly(parseArgv* replica,redisReply* r){
+   int ok = r != NULL && r->type == REDIS_REPLY_STATUS;
+   if(!ok){
+      printf("readonly refused ip=%s, port=%d\n",replica->ip,replica->port);
+      replica->unreachable = 1;
+   }
+   if(r != NULL)
+      freeReplyObject(r);
+   return ok ? 0 : -1;
+}
 
-    char* temp_slot_start;
-    char* temp_port;
+static struct timeval __ms_to_timeval(int ms){
+   struct timeval tv;
+   tv.tv_sec = ms/1000;
+   tv.tv_usec = (ms%1000)*1000;
+   return tv;
+}
 
-    int i=0;
-    for(;i<len;i++){
-        temp = ip_start = port_start = port_end = connect_start = slot_start = slot_end = temp_slot_start = temp_port = NULL;
-
-        temp = mycluster->argv[i];
-
-        //parse ip
-        ip_start = strchr(temp,' ');
-        temp = ip_start+1;
-        port_start = strchr(temp,':');
-        temp = port_start+1;
-        port_end = strchr(temp,' ');
-        ip_start++;
-        len_ip = port_start - ip_start;
-        mycluster->parse[i] = (parseArgv*)malloc(sizeof(parseArgv));//do not forget
-        mycluster->parse[i]->ip = (char*)malloc(len_ip + 1);
-        
+/*
+*start a non-blocking connect to every node at once and wait for all of them with poll, so the
+*setup takes about one round trip instead of one per node. Connected contexts are switched back
+*to blocking mode and replicas get READONLY, again all sent before any reply is read. A node that
+*fails or doesn't answer within cluster->connect_timeout_ms is reported and left without context.
+*/
+static void __connect_parallel(clusterInfo* cluster,parseArgv** nodes,int count){
+   struct pollfd fds[count];
+   redisContext* pending[count];
+   int i,waiting = 0;
+
+   for(i=0;i<count;i++){
+      pending[i] = redisConnectNonBlock(nodes[i]->ip,nodes[i]->port);
+      fds[i].fd = -1;
+      fds[i].events = POLLOUT;
+      fds[i].revents = 0;
+      if(pending[i] == NULL || pending[i]->err){
+         printf("connection refused ip=%s, port=%d: %s\n",nodes[i]->ip,nodes[i]->port,
+                pending[i] != NULL ? pending[i]->errstr : "out of memory");
+         if(pending[i] != NULL)
+            redisFree(pending[i]);
+         pending[i] = NULL;
+         continue;
+      }
+      fds[i].fd = pending[i]->fd;
+      waiting++;
+   }
 
-        strncpy(mycluster->parse[i]->ip,ip_start,len_ip);
-        mycluster->parse[i]->ip[len_ip]='\0';
+   long long deadline = __us_now() + (long long)cluster->connect_timeout_ms*1000;
+   while(waiting > 0){
+      long long left = deadline - __us_now();
+      if(left <= 0)
+         break;
+      int ready = poll(fds,count,(int)((left+999)/1000));
+      if(ready < 0 && errno != EINTR)
+         break;
+      for(i=0;i<count && ready > 0;i++){
+         if(fds[i].fd < 0 || fds[i].revents == 0)
+            continue;
+         int err = 0;
+         socklen_t len = sizeof(err);
+         if(getsockopt(fds[i].fd,SOL_SOCKET,SO_ERROR,&err,&len) != 0)
+            err = errno;
+         if(err != 0){
+            printf("connection refused ip=%s, port=%d: %s\n",nodes[i]->ip,nodes[i]->port,strerror(err));
+            redisFree(pending[i]);
+            pending[i] = NULL;
+         }else{
+            //the rest of the library expects blocking contexts
+            fcntl(fds[i].fd,F_SETFL,fcntl(fds[i].fd,F_GETFL) & ~O_NONBLOCK);
+            pending[i]->flags |= REDIS_BLOCK;
+         }
+         fds[i].fd = -1;
+         waiting--;
+      }
+   }
 
-        //parsePort
-        port_start++;
-        len_port = port_end - port_start;
-        temp_port = (char*)malloc(len_port+1);
-        strncpy(temp_port,port_start,len_port);
-        temp_port[len_port]='\0';
-        mycluster->parse[i]->port = atoi(temp_port);
-        free(temp_port);
+   for(i=0;i<count;i++){
+      if(fds[i].fd >= 0){
+         printf("connection timed out ip=%s, port=%d\n",nodes[i]->ip,nodes[i]->port);
+         redisFree(pending[i]);
+         pending[i] = NULL;
+      }
+      if(pending[i] == NULL && nodes[i]->readonly)
+         nodes[i]->unreachable = 1;
+   }
 
-        connect_start = strstr(port_end,"connected");
-        connect_start = strchr(connect_start,' ');
+   int done;
+   for(i=0;i<count;i++){
+      if(pending[i] == NULL || !nodes[i]->readonly)
+         continue;
+      redisAppendCommand(pending[i],"readonly");
+      do{
+         if(redisBufferWrite(pending[i],&done) != REDIS_OK)
+            break;
+      }while(!done);
+   }
+   for(i=0;i<count;i++){
+      if(pending[i] == NULL)
+         continue;
+      if(nodes[i]->readonly){
+         redisReply* r = NULL;
+         if(redisGetReply(pending[i],(void**)&r) != REDIS_OK)
+            r = NULL;
+         if(__check_readonly(nodes[i],r) != 0){
+            redisFree(pending[i]);
+            continue;
+         }
+      }
+      nodes[i]->context = pending[i];
+   }
+}
 
-        slot_start = connect_start+1;
-        slot_end = strchr(slot_start,'-');
-        slot_end++;
+/*
+*the connection to a node, made now if there is none yet. A master is retried on every call,
+*a replica marked unreachable is not. returns NULL if the node can't be reached.
+*/
+static redisContext* __node_context(clusterInfo* cluster,parseArgv* node){
+   //a broken connection is made again, unless pipelined replies are still expected on it
+   if(node->context != NULL && node->context->err && node->pipe_pending == 0){
+      redisFree(node->context);
+      node->context = NULL;
+   }
+   if(node->context != NULL)
+      return node->context;
+   if(node->readonly){
+      if(!node->unreachable)
+         __connect_replica(cluster,node);
+      return node->context;
+   }
+   redisContext* tempContext = redisConnectWithTimeout(node->ip,node->port,__ms_to_timeval(cluster->connect_timeout_ms));
+   if(tempContext == NULL || tempContext->err){
+      printf("connection refused ip=%s, port=%d\n",node->ip,node->port);
+      if(tempContext != NULL)
+         redisFree(tempContext);
+      return NULL;
+   }
+   node->context = tempContext;
+   return tempContext;
+}
 
-        temp_slot_start = (char*)malloc(slot_end-slot_start);
-        strncpy(temp_slot_start,slot_start,slot_end-slot_start-1);
-        temp_slot_start[slot_end-slot_start-1]='\0';
+/*
+*a replica can take a read if it is connected, or if it may still be connected
+*/
+static int __replica_usable(parseArgv* replica){
+   return replica->context != NULL || !replica->unreachable;
+}
 
-        mycluster->parse[i]->start_slot = atoi(temp_slot_start);
-        mycluster->parse[i]->end_slot = atoi(slot_end);
+/*
+*This function give each node in the cluster a context connection, all nodes are connected in
+*parallel. A node that refuses is left without one, __node_context tries it again when a command
+*is routed to it. Lazy clients connect nothing here.
+*/
+static void __add_context_to_cluster(clusterInfo* mycluster){
+   int len = mycluster-> len;
+   int i = 0;
+   int count = 0;
 
-        free(temp_slot_start);
+   if(mycluster->lazy || len == 0)
+      return;
+   parseArgv* nodes[len];
+   for(i=0;i<len;i++){
+       parseArgv* node = mycluster->parse[i];
+       if(node->context != NULL)
+          continue;
+       //replicas are only needed to serve reads
+       if(node->readonly && (mycluster->read_policy == READ_MASTER_ONLY || node->unreachable))
+          continue;
+       nodes[count++] = node;
+   }
+   if(count > 0)
+       __connect_parallel(mycluster,nodes,count);
 
-        //on default, the pipe mode doesn't open        
-        mycluster->parse[i]->pipe_mode = PIPE_CLOSE;
-        mycluster->parse[i]->pipe_pending = 0;
-    }
 }
 
 /*
-*print all the information about the cluster fro debuging.
+*move the client to the newest shared layout if one has been published since the last command.
+*parseArgv of nodes that are still in the layout are kept together with their connections, the
+*others are closed. Nothing happens while pipelined replies are pending, the pipeline holds
+*pointers to the current parseArgv.
 */
-static void __print_clusterInfo_parsed(clusterInfo* mycluster){
+static void __sync_topology(clusterInfo* mycluster){
+    if(topology_version(mycluster->entry) == mycluster->topology->version)
+        return;
+
+    int i,j;
     int len = mycluster->len;
-    int i;
     for(i=0;i<len;i++){
-        printf("node %d info\n",i);
-        printf("original command: %s\n",mycluster->argv[i]);
-        printf("ip: %s, port: %d\n",mycluster->parse[i]->ip,mycluster->parse[i]->port);
-        printf("slot_start= %d, slot_end = %d\n",mycluster->parse[i]->start_slot,\
-	             mycluster->parse[i]->end_slot);
+        if(mycluster->parse[i]->pipe_pending != 0)
+            return;
     }
+
+    clusterTopology* topology = topology_acquire(mycluster->entry);
+    if(topology == NULL)
+        return;
+
+    parseArgv** parse = (parseArgv**)malloc(sizeof(parseArgv*)*(topology->len > 0 ? topology->len : 1));
+    if(parse == NULL){
+        printf("panic! %s %d\n",__FILE__,__LINE__);
+        topology_release(topology);
+        return;
+    }
+    parseArgv** old = mycluster->parse;
+
+    int pipe_mode = len > 0 ? old[0]->pipe_mode : PIPE_CLOSE;
+    for(i=0;i<topology->len;i++){
+        topologyNode* node = topology->nodes[i];
+        parse[i] = NULL;
+        for(j=0;j<len;j++){
+            if(old[j] != NULL && old[j]->port == node->port && strcmp(old[j]->ip,node->ip) == 0){
+                parse[i] = old[j];
+                old[j] = NULL;
+                break;
+            }
+        }
+        if(parse[i] != NULL && parse[i]->readonly != (node->master >= 0 ? 1 : 0)){
+            //failover, the connection has to be made again in the new role
+            if(parse[i]->context != NULL)
+                redisFree(parse[i]->context);
+            parse[i]->context = NULL;
+            parse[i]->readonly = node->master >= 0 ? 1 : 0;
+        }
+        if(parse[i] == NULL){
+            parse[i] = __new_parseArgv(node);
+            parse[i]->pipe_mode = pipe_mode;
+        }
+    }
+
+    //close the nodes which have left the cluster
+    for(j=0;j<len;j++){
+        if(old[j] != NULL){
+            if(old[j]->context != NULL)
+                redisFree(old[j]->context);
+            free(old[j]->ip);
+            free(old[j]);
+        }
+    }
+    free(old);
+    mycluster->parse = parse;
+
+    mycluster->len = topology->len;
+    topology_release(mycluster->topology);
+    mycluster->topology = topology;
+    //nodes new to this client are connected by the first command routed to them
 }
 
+int set_read_policy(clusterInfo* cluster,int policy){
+    if(cluster == NULL){
+        printf("NULL pointer %s %d\n",__FILE__,__LINE__);
+        return -1;
+    }
+    if(policy != READ_MASTER_ONLY && policy != READ_PREFER_REPLICA && policy != READ_ROUND_ROBIN &&
+       policy != READ_LOWEST_LATENCY){
+        printf("unsupported read policy %d\n",policy);
+        return -1;
+    }
+    cluster->read_policy = policy;
+    __add_context_to_cluster(cluster);
+    return 0;
+}
 
-//only for testing purposes
-static void __test_slot(clusterInfo* mycluster){
-    int slot[] = {0,5460,5461,10922,10923,16383};
-    int len = sizeof(slot) / sizeof(int);
-    int i=0;
-    for(i=0;i<len;i++){
-        printf("slot = %d info: ip = %s, port = %d.\n",slot[i],((parseArgv*)mycluster->slot_to_host[slot[i]])->ip, ((parseArgv*)mycluster->slot_to_host[slot[i]])->port);
+int set_read_callback(clusterInfo* cluster,readPolicyCallback callback,void* privdata){
+    if(cluster == NULL || callback == NULL){
+        printf("NULL pointer %s %d\n",__FILE__,__LINE__);
+        return -1;
     }
+    cluster->read_callback = callback;
+    cluster->read_privdata = privdata;
+    cluster->read_policy = READ_CUSTOM;
+    __add_context_to_cluster(cluster);
+    return 0;
 }
 
-/*
-Assign slots to each node in the cluster. 
-*/
-static void __assign_slots(clusterInfo* mycluster){
-    int len = mycluster->len;
+int start_topology_refresher(clusterInfo* cluster,int interval_ms){
+    if(cluster == NULL){
+        printf("NULL pointer %s %d\n",__FILE__,__LINE__);
+        return -1;
+    }
+    return topology_start_refresher(cluster->entry,interval_ms);
+}
+
+void stop_topology_refresher(clusterInfo* cluster){
+    if(cluster == NULL){
+        printf("NULL pointer %s %d\n",__FILE__,__LINE__);
+        return;
+    }
+    topology_stop_refresher(cluster->entry);
+}
+
+int cluster_refresh_topology(clusterInfo* cluster){
+    if(cluster == NULL){
+        printf("NULL pointer %s %d\n",__FILE__,__LINE__);
+        return -1;
+    }
+    //any node of the current layout can answer, start from the first one that is reachable, the seed last
     int i;
-    int count = 0;
-    for(i=0;i<len;i++){
-        int start = mycluster->parse[i]->start_slot;
-        int end = mycluster->parse[i]->end_slot;
-        int j=0;
-	if(sizeof(mycluster->parse[i]->slots)!=16384){
-	     printf("slot != 16384 in __assign_slots\n");
-	     return;
-	} 
-	memset(mycluster->parse[i]->slots,0,16384);
-        for(j=start;j<=end;j++){
-            mycluster->slot_to_host[j] = (void*)(mycluster->parse[i]);
-            count++;
-	    mycluster->parse[i]->slots[i]=1;
-        }
+    int loaded = 0;
+    for(i=0;i<cluster->len && !loaded;i++)
+        loaded = topology_reload(cluster->entry,cluster->parse[i]->ip,cluster->parse[i]->port) == 0;
+    if(!loaded)
+        loaded = topology_reload(cluster->entry,cluster->entry->ip,cluster->entry->port) == 0;
+    if(!loaded){
+        printf("unable to refresh the cluster layout\n");
+        return -1;
     }
+    __sync_topology(cluster);
+    //give the replicas which were down another chance
+    for(i=0;i<cluster->len;i++)
+        cluster->parse[i]->unreachable = 0;
+    __add_context_to_cluster(cluster);
+    return 0;
+}
+//****we have finished constructing a cluster structure here*****
+
+static long long __us_now(){
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	return ((long long)tv.tv_sec)*1000000 + tv.tv_usec;
+}
+
+static void __note_latency(parseArgv* node,long long us){
+	if(node->latency_us == 0)
+	    node->latency_us = us;
+	else
+	    node->latency_us += LATENCY_EWMA_WEIGHT * (us - node->latency_us);
 }
 
 /*
-*This function give each node in the cluster a context connection
+*find the connection serving a slot, NULL if no node owns the slot
 */
-static void __add_context_to_cluster(clusterInfo* mycluster){
-   int len = mycluster-> len;
-   int i = 0;
-   redisContext * tempContext;
-   
-   for(i=0;i<len;i++){
-       tempContext = redisConnect((mycluster->parse[i])->ip,(mycluster->parse[i])->port);
-       if(tempContext->err){
-          printf("connection refused in __add_contect_to_cluster\n");
-	  printf("refuse ip=%s, port=%d",(mycluster->parse[i])->ip,(mycluster->parse[i])->port);
-	  redisFree(tempContext);
-	  return;
-       }else{
-          (mycluster->parse[i])->context = tempContext;
-       }
-   }
+static parseArgv* __slot_to_parse(clusterInfo* cluster,int slot){
+	uint16_t index = __atomic_load_n(&cluster->topology->slot_to_node[slot],__ATOMIC_RELAXED);
+	if(index == SLOT_UNASSIGNED)
+	    return NULL;
+	return cluster->parse[index];
+}
 
+/*
+*find the connection to a node by its address, NULL if the node is not in the current layout
+*/
+static parseArgv* __find_parse(clusterInfo* cluster,const char* ip,int port){
+	topologyNode* node = topology_find_node(cluster->topology,ip,port);
+	if(node == NULL)
+	    return NULL;
+	return cluster->parse[node->index];
 }
-//****we have finished constructing a cluster structure here*****
 
 
 /*
-*once we meet indirection, this function help parse the information returned
+*a MOVED reply told us that the slot now lives on ip:port. Only this slot is patched in the shared
+*layout, the whole layout is fetched again once REDIRECT_REFRESH_THRESHOLD redirects have been seen.
 */
-static void __set_redirect(char* str){
-	char *slot,*ip,*port;
-	slot = strchr(str,' ');
-	slot++;
-	ip = strchr(slot,' ');
-	ip++;
-	port = strchr(ip,':');
-	port++;
-	//s means store
-	char* s_slot, *s_ip, *s_port;
-        s_slot = (char*)malloc(ip-slot);
-	strncpy(s_slot,slot,ip-slot-1);
-	s_slot[ip-slot-1]='\0';
+static void __follow_moved(clusterInfo* cluster,int slot,const char* ip,int port){
+	if(topology_note_redirect(cluster->entry)){
+	    cluster_refresh_topology(cluster);
+	    return;
+	}
+	if(topology_patch_slot(cluster->entry,cluster->topology,slot,ip,port) == 1){
+	    //the node is new to us, the patched copy has been published
+	    __sync_topology(cluster);
+	}
+}
 
-	s_ip = (char*)malloc(port-ip);
-	strncpy(s_ip,ip,port-ip-1);
-	s_ip[port-ip-1]='\0';
+/*
+*a node could not be reached, which is what a failover looks like from here
+*/
+static void __note_node_error(clusterInfo* cluster){
+	if(topology_note_error(cluster->entry))
+	    cluster_refresh_topology(cluster);
+}
+
+/*
+*send ASKING and then the command to the node named in an ASK reply. The slot is only being
+*migrated, so the layout is left as it is. A node outside the layout gets a short-lived connection.
+*/
+static redisReply* __ask_request(clusterInfo* cluster,const char* ip,int port,clusterRequest* req){
+	redisContext* c = NULL;
+	redisContext* temp = NULL;
+	parseArgv* target = __find_parse(cluster,ip,port);
+	if(target != NULL && __node_context(cluster,target) != NULL){
+	    c = target->context;
+	}else{
+	    temp = redisConnect(ip,port);
+	    if(temp == NULL || temp->err){
+	        printf("unable to follow ASK to %s:%d\n",ip,port);
+	        if(temp != NULL)
+	            redisFree(temp);
+	        return NULL;
+	    }
+	    c = temp;
+	}
 
-	s_port = (char*)malloc(sizeof(port)+1);
-	strcpy(s_port,port);
+	redisReply* r = (redisReply*)redisCommand(c,"asking");
+	if(r != NULL){
+	    freeReplyObject(r);
+	    r = __send_request(c,req);
+	}
+	if(temp != NULL)
+	    redisFree(temp);
+	return r;
+}
 
-	free(s_ip);
-	free(s_slot);
-	free(s_port);
+static int __is_redirect(redisReply* r){
+	return r->type == REDIS_REPLY_ERROR && (!strncmp(r->str,"MOVED ",6) || !strncmp(r->str,"ASK ",4));
 }
 
 /*
-*calculate the slot, find the context, and then send command
+*send one command to the node serving the slot. MOVED and ASK replies are followed once, so a
+*resharding is invisible to the caller. returns the reply, NULL if the command could not be sent.
 */
-static int __set_nodb(clusterInfo* cluster,const char* key,char* set_in_value){
+static redisReply* __cluster_request(clusterInfo* cluster,int slot,clusterRequest* req){
+	__sync_topology(cluster);
+	parseArgv* tempArgv = __slot_to_parse(cluster,slot);
+
+	if(tempArgv == NULL || __node_context(cluster,tempArgv) == NULL){
+	    printf("context = NULL for slot %d\n",slot);
+	    __note_node_error(cluster);
+	    return NULL;
+	}
 
-	redisContext *c = NULL;
-	int myslot;
-	myslot = crc16(key,strlen(key)) & 16383;
+	redisReply *r = __timed_request(tempArgv,req);
+	if(r == NULL)
+	    __note_node_error(cluster);
+	if(r == NULL || !__is_redirect(r))
+	    return r;
+
+	char ip[64];
+	int port,redirect_slot;
+	if(topology_parse_redirect(r->str,&redirect_slot,ip,sizeof(ip),&port) != 0){
+	    printf("malformed redirect %s\n",r->str);
+	    return r;
+	}
 
-        parseArgv* tempArgv = ((parseArgv*)(cluster->slot_to_host[myslot]));
+	if(r->str[0] == 'A'){
+	    freeReplyObject(r);
+	    return __ask_request(cluster,ip,port,req);
+	}
 
-	if(tempArgv->slots[myslot]!=1){
-            //ignore the error here
+	freeReplyObject(r);
+	__follow_moved(cluster,redirect_slot,ip,port);
+	tempArgv = __slot_to_parse(cluster,slot);
+	if(tempArgv == NULL || __node_context(cluster,tempArgv) == NULL){
+	    printf("context = NULL for slot %d after redirect\n",slot);
+	    return NULL;
 	}
-	if(tempArgv->context == NULL){
-	    printf("context = NULL in function set\n");
-	    return -1;
+	return __timed_request(tempArgv,req);
+}
+
+/*
+*send a command given as an argv array to the master of the slot, argvlen may be NULL
+*/
+static redisReply* __cluster_command_argv(clusterInfo* cluster,int slot,int argc,const char** argv,const size_t* argvlen){
+	clusterRequest req = {.argc = argc,.argv = argv,.argvlen = argvlen};
+	return __cluster_request(cluster,slot,&req);
+}
+
+/*
+*hand the request to hiredis on the given connection, in whichever form it was built
+*/
+static redisReply* __send_request(redisContext* c,clusterRequest* req){
+	if(req->frame != NULL){
+	    void* reply = NULL;
+	    if(redisAppendFormattedCommand(c,req->frame,req->frame_len) != REDIS_OK ||
+	       redisGetReply(c,&reply) != REDIS_OK)
+	        return NULL;
+	    return (redisReply *)reply;
+	}
+	return (redisReply *)redisCommandArgv(c,req->argc,req->argv,req->argvlen);
+}
+
+/*
+*send a command and fold its round trip into the moving average of the instance.
+*/
+static redisReply* __timed_request(parseArgv* node,clusterRequest* req){
+	long long start = __us_now();
+	node->outstanding++;
+	redisReply* r = __send_request(node->context,req);
+	node->outstanding--;
+	if(r != NULL)
+	    __note_latency(node,__us_now()-start);
+	return r;
+}
+
+/*
+*power of two choices: draw two of the replicas and keep the one expected to answer first.
+*the estimate of an instance only changes when it serves reads, so every READ_PROBE_INTERVAL
+*reads the other one is taken.
+*/
+static parseArgv* __lowest_latency(clusterInfo* cluster,parseArgv** replicas,int count){
+	if(count == 1)
+	    return replicas[0];
+	cluster->read_counter = cluster->read_counter*1103515245 + 12345;
+	unsigned int draw = cluster->read_counter >> 8;
+	int a = draw % count;
+	int b = (a + 1 + (draw/count) % (count-1)) % count;
+	double cost_a = replicas[a]->latency_us * (replicas[a]->outstanding + replicas[a]->pipe_pending + 1);
+	double cost_b = replicas[b]->latency_us * (replicas[b]->outstanding + replicas[b]->pipe_pending + 1);
+	int better = cost_a <= cost_b ? a : b;
+	if(cluster->read_counter % READ_PROBE_INTERVAL == 0)
+	    better = better == a ? b : a;
+	return replicas[better];
+}
+
+/*
+*pick the instance a read of the slot goes to according to cluster->read_policy. Replicas
+*without a connection are skipped, the master is used when none of them is left.
+*/
+static parseArgv* __read_parse(clusterInfo* cluster,int slot){
+	//loaded once, a slot patched meanwhile must not give the master of one node and the replicas of another
+	uint16_t index = __atomic_load_n(&cluster->topology->slot_to_node[slot],__ATOMIC_RELAXED);
+	if(index == SLOT_UNASSIGNED)
+	    return NULL;
+	parseArgv* master = cluster->parse[index];
+	if(cluster->read_policy == READ_MASTER_ONLY)
+	    return master;
+
+	topologyNode* node = cluster->topology->nodes[index];
+	int count = node->replica_count;
+	if(count == 0 && cluster->read_policy != READ_CUSTOM)
+	    return master;
+
+	if(cluster->read_policy == READ_LOWEST_LATENCY || cluster->read_policy == READ_CUSTOM){
+	    parseArgv* candidates[count+1];
+	    int i,n = 1;
+	    candidates[0] = master;
+	    for(i=0;i<count;i++){
+	        if(__replica_usable(cluster->parse[node->replicas[i]]))
+	            candidates[n++] = cluster->parse[node->replicas[i]];
+	    }
+	    if(cluster->read_policy == READ_CUSTOM){
+	        parseArgv* pick = cluster->read_callback(cluster,slot,candidates,n,cluster->read_privdata);
+	        return pick != NULL && __replica_usable(pick) ? pick : master;
+	    }
+	    if(n == 1)
+	        return master;
+	    return __lowest_latency(cluster,candidates+1,n-1);
 	}
-	c = tempArgv->context;
 
-	redisReply *r = (redisReply *)redisCommand(c, "set %s %s", key, set_in_value);
+	//READ_ROUND_ROBIN counts the master as one more candidate
+	int candidates = cluster->read_policy == READ_ROUND_ROBIN ? count+1 : count;
+	unsigned int start = cluster->read_counter++;
+	int i;
+	for(i=0;i<candidates;i++){
+	    int pick = (start+i) % candidates;
+	    if(pick == count)
+	        return master;
+	    parseArgv* replica = cluster->parse[node->replicas[pick]];
+	    if(__replica_usable(replica))
+	        return replica;
+	}
+	return master;
+}
+
+/*
+*like __cluster_request, but the command may be served by a replica. A replica that fails or
+*redirects the command (it has just been promoted or demoted) is dropped, the command is then
+*sent to the master of the slot.
+*/
+static redisReply* __cluster_read_request(clusterInfo* cluster,int slot,clusterRequest* req){
+	redisReply* r;
+	__sync_topology(cluster);
+	parseArgv* tempArgv = __read_parse(cluster,slot);
+
+	if(tempArgv != NULL && tempArgv->readonly && __node_context(cluster,tempArgv) != NULL){
+	    r = __timed_request(tempArgv,req);
+	    if(r != NULL && !__is_redirect(r))
+	        return r;
+	    if(r != NULL)
+	        freeReplyObject(r);
+	    if(r == NULL || tempArgv->context->err){
+	        printf("replica ip=%s, port=%d dropped\n",tempArgv->ip,tempArgv->port);
+	        redisFree(tempArgv->context);
+	        tempArgv->context = NULL;
+	    }
+	}
+	return __cluster_request(cluster,slot,req);
+}
+
+static redisReply* __cluster_read_command_argv(clusterInfo* cluster,int slot,int argc,const char** argv,const size_t* argvlen){
+	clusterRequest req = {.argc = argc,.argv = argv,.argvlen = argvlen};
+	return __cluster_read_request(cluster,slot,&req);
+}
+
+/*
+*SET and GET are sent as argv with explicit lengths: hiredis writes the RESP frame straight from
+*them instead of parsing a format string, and keys and values may hold any byte, spaces and
+*'\0' included.
+*/
+static redisReply* __set_argv(clusterInfo* cluster,const char* key,size_t keylen,const char* value,size_t valuelen){
+	const char* argv[3] = {"set",key,value};
+	size_t argvlen[3] = {3,keylen,valuelen};
+	return __cluster_command_argv(cluster,keyHashSlot(key,keylen),3,argv,argvlen);
+}
+
+static redisReply* __get_argv(clusterInfo* cluster,const char* key,size_t keylen){
+	const char* argv[2] = {"get",key};
+	size_t argvlen[2] = {3,keylen};
+	return __cluster_read_command_argv(cluster,keyHashSlot(key,keylen),2,argv,argvlen);
+}
+
+/*
+*prefix a key of keylen bytes with the db number the way set and get do it. buf is used when the
+*result fits in cap bytes, otherwise the key is malloced and has to be freed by the caller.
+*/
+static char* __db_key(int dbnum,const char* key,size_t keylen,char* buf,size_t cap,size_t* len){
+	char prefix[16];
+	int n = snprintf(prefix,sizeof(prefix),"%d\b",dbnum);
+	char* out = (size_t)n + keylen <= cap ? buf : (char*)malloc(n + keylen);
+	if(out == NULL){
+	    printf("panic! %s %d\n",__FILE__,__LINE__);
+	    return NULL;
+	}
+	memcpy(out,prefix,n);
+	memcpy(out+n,key,keylen);
+	*len = n + keylen;
+	return out;
+}
+
+/*
+*calculate the slot, find the context, and then send command
+*/
+static int __set_nodb(clusterInfo* cluster,const char* key,size_t keylen,char* set_in_value){
+
+	redisReply *r = __set_argv(cluster,key,keylen,set_in_value,strlen(set_in_value));
+	if(r == NULL){
+	    printf("set failed in function set\n");
+	    return -1;
+	}
 
 	if (r->type == REDIS_REPLY_STRING){
 		printf("set should not return str ?value = %s\n", r->str);
                 freeReplyObject(r);
 		return -1;
-	}else if(r->type == REDIS_REPLY_ERROR && !strncmp(r->str,"MOVED",5)){
+	}else if(r->type == REDIS_REPLY_ERROR && __is_redirect(r)){
 		printf("set still need redirection ? %s\n", r->str);
-		__set_redirect(r->str);
                 freeReplyObject(r);
 		return -1;
 	}else if(r->type == REDIS_REPLY_STATUS){
-                freeReplyObject(r);
                 sprintf(set_in_value,"%s",r->str);
+                freeReplyObject(r);
 		return 0;
 	}else{
 	   printf("set error %s %d \n",__FILE__,__LINE__);
@@ -392,158 +1058,824 @@ static int __set_nodb(clusterInfo* cluster,const char* key,char* set_in_value){
 }
 
 /*
-*set method with the db option
+*set method with the db option. The prefixed key is built on the stack of the calling thread,
+*or on the heap when it is too long, so concurrent callers share nothing.
+*/
+static int __set_withdb(clusterInfo* cluster,const char* key, char* set_in_value, int dbnum) {
+	if(key == NULL || set_in_value == NULL){
+	   printf("invalid arguments %s %d\n",__FILE__,__LINE__);
+	   return -1;
+	}
+	char local[256];
+	size_t len;
+	char* dbkey = __db_key(dbnum,key,strlen(key),local,sizeof(local),&len);
+	if(dbkey == NULL)
+	   return -1;
+
+	int re = __set_nodb(cluster,dbkey,len,set_in_value);
+
+	if(dbkey != local)
+	   free(dbkey);
+	return re;
+}
+
+int set(clusterInfo* cluster, const char *key,char *set_in_value,int dbnum) {
+	return __set_withdb(cluster,key,set_in_value,dbnum);
+}
+
+
+/*
+*get method without use db option. here const char* is not compitable with char*
 */
-static int __set_withdb(clusterInfo* cluster,const char* key, char* set_in_value, int dbnum,int tid) {
-        int localTid = tid%99;
-	if(localTid < 0){
-	   printf("local tid error in set\n");
+static int __get_nodb(clusterInfo*cluster ,const char* key,size_t keylen,char* get_in_value){
+
+	redisReply *r = __get_argv(cluster,key,keylen);
+	if(r == NULL){
+	    //this error can not be ignored
+	    printf("context = NULL in function get\n");
+	    strcpy(get_in_value,"conext ==NULL");
+	    return -1;
+	}
+
+	if (r->type == REDIS_REPLY_STRING) {
+		memcpy(get_in_value,r->str,r->len);
+		get_in_value[r->len] = '\0';
+		freeReplyObject(r);
+		return 0;
+	}else if (r->type == REDIS_REPLY_NIL) {
+		strcpy(get_in_value,"nil");
+		freeReplyObject(r);
+		return 0;
+	} else if(r->type == REDIS_REPLY_ERROR && __is_redirect(r)){
+		freeReplyObject(r);
+		strcpy(get_in_value,"redirection");
+		return -1;
+	} else {
+		printf("get return type=%d,str=%s,%d %s",r->type,\
+		       r->str,__LINE__,__FILE__);
+                if(r->type == REDIS_REPLY_ARRAY){
+		   strcpy(get_in_value,"return bulk");  
+		}else if(r->type == REDIS_REPLY_STATUS){
+		   strcpy(get_in_value,"return status");
+		}else if(r->type == REDIS_REPLY_INTEGER){
+		      sprintf(get_in_value,"%lld",r->integer);
+		}else{
+		   strcpy(get_in_value,"unknown type");
+		}
+		freeReplyObject(r);
+		return 0;
+	}
+}
+/*
+*get method with the db option, the prefixed key is built the same way as in __set_withdb
+*/
+static int __get_withdb(clusterInfo* cluster, const char* key,\
+                            char* get_in_value,int dbnum){
+	if(key==NULL){
+	   strcpy(get_in_value,"key is NULL");
 	   return -1;
 	}
-	if(global_setspace[localTid].used != 0 ){
-	   printf("global set space already in use\n");
+	char local[256];
+	size_t len;
+	char* dbkey = __db_key(dbnum,key,strlen(key),local,sizeof(local),&len);
+	if(dbkey == NULL)
 	   return -1;
+
+	int re = __get_nodb(cluster,dbkey,len,get_in_value);
+
+	if(dbkey != local)
+	   free(dbkey);
+	return re;
+}
+
+
+int get(clusterInfo* cluster, const char *key, char *get_in_value,int dbnum){
+      return  __get_withdb(cluster,key,get_in_value,dbnum);
+}
+
+int setn(clusterInfo* cluster,const char* key,size_t keylen,const char* value,size_t valuelen,int dbnum){
+	if(cluster == NULL || key == NULL || value == NULL){
+	    printf("invalid arguments %s %d\n",__FILE__,__LINE__);
+	    return -1;
+	}
+	char local[256];
+	size_t len;
+	char* dbkey = __db_key(dbnum,key,keylen,local,sizeof(local),&len);
+	if(dbkey == NULL)
+	    return -1;
+	redisReply* r = __set_argv(cluster,dbkey,len,value,valuelen);
+	if(dbkey != local)
+	    free(dbkey);
+	return __set_status(r);
+}
+
+/*
+*the result of a SET reply, which is freed. returns 0 on success.
+*/
+static int __set_status(redisReply* r){
+	if(r == NULL)
+	    return -1;
+	int re = r->type == REDIS_REPLY_STATUS ? 0 : -1;
+	if(re != 0)
+	    printf("set return type=%d %s %d\n",r->type,__FILE__,__LINE__);
+	freeReplyObject(r);
+	return re;
+}
+
+/*
+*GET of a key given with its length, prefixed with the db number. returns the reply, NULL on errors.
+*/
+static redisReply* __get_withdb_argv(clusterInfo* cluster,const char* key,size_t keylen,int dbnum){
+	char local[256];
+	size_t len;
+	char* dbkey = __db_key(dbnum,key,keylen,local,sizeof(local),&len);
+	if(dbkey == NULL)
+	    return NULL;
+	redisReply* r = __get_argv(cluster,dbkey,len);
+	if(dbkey != local)
+	    free(dbkey);
+	return r;
+}
+
+int getn(clusterInfo* cluster,const char* key,size_t keylen,char* value,size_t capacity,size_t* valuelen,int dbnum){
+	if(cluster == NULL || key == NULL || (value == NULL && capacity != 0) || valuelen == NULL){
+	    printf("invalid arguments %s %d\n",__FILE__,__LINE__);
+	    return -1;
+	}
+	return __copy_value(__get_withdb_argv(cluster,key,keylen,dbnum),value,capacity,valuelen);
+}
+
+/*
+*copy the value of a GET reply the way getn returns it, the reply is freed
+*/
+static int __copy_value(redisReply* r,char* value,size_t capacity,size_t* valuelen){
+	*valuelen = 0;
+	if(r == NULL)
+	    return -1;
+	int re = __copy_element(r,value,capacity,valuelen);
+	freeReplyObject(r);
+	return re;
+}
+
+/*
+*the same for a reply that stays with its caller, such as one element of an MGET reply
+*/
+static int __copy_element(redisReply* r,char* value,size_t capacity,size_t* valuelen){
+	int re;
+	*valuelen = 0;
+	if(r->type == REDIS_REPLY_STRING){
+	    *valuelen = r->len;
+	    if(r->len > capacity){
+	        re = -1;
+	    }else{
+	        memcpy(value,r->str,r->len);
+	        //a terminator is added when there is room, for callers storing text
+	        if(r->len < capacity)
+	            value[r->len] = '\0';
+	        re = 0;
+	    }
+	}else if(r->type == REDIS_REPLY_NIL){
+	    re = 1;
+	}else{
+	    printf("get return type=%d %s %d\n",r->type,__FILE__,__LINE__);
+	    re = -1;
+	}
+	return re;
+}
+
+int get_view(clusterInfo* cluster,const char* key,size_t keylen,replyView* view,int dbnum){
+	if(cluster == NULL || key == NULL || view == NULL){
+	    printf("invalid arguments %s %d\n",__FILE__,__LINE__);
+	    return -1;
+	}
+	return __view_value(__get_withdb_argv(cluster,key,keylen,dbnum),view);
+}
+
+/*
+*hand the value of a GET reply to view the way get_view returns it
+*/
+static int __view_value(redisReply* r,replyView* view){
+	view->str = NULL;
+	view->len = 0;
+	view->reply = NULL;
+	if(r == NULL)
+	    return -1;
+
+	if(r->type == REDIS_REPLY_STRING){
+	    //the value stays where hiredis parsed it, the reply is freed by release_view
+	    view->str = r->str;
+	    view->len = r->len;
+	    view->reply = r;
+	    return 0;
+	}
+	int re = r->type == REDIS_REPLY_NIL ? 1 : -1;
+	if(re != 1)
+	    printf("get return type=%d %s %d\n",r->type,__FILE__,__LINE__);
+	freeReplyObject(r);
+	return re;
+}
+
+void release_view(replyView* view){
+	if(view == NULL || view->reply == NULL)
+	    return;
+	freeReplyObject(view->reply);
+	view->str = NULL;
+	view->len = 0;
+	view->reply = NULL;
+}
+
+clusterNamespace* get_namespace(int dbnum){
+	clusterNamespace* ns = (clusterNamespace*)malloc(sizeof(clusterNamespace));
+	if(ns == NULL){
+	    printf("unable to allocate clusterNamespace\n");
+	    return NULL;
+	}
+	ns->dbnum = dbnum;
+	//the same "<db>\b" prefix set and get put in front of a key
+	ns->prefix_len = snprintf(ns->prefix,sizeof(ns->prefix),"%d\b",dbnum);
+	ns->prefix_crc = crc16(ns->prefix,ns->prefix_len);
+	return ns;
+}
+
+void release_namespace(clusterNamespace* ns){
+	free(ns);
+}
+
+//"$<n>\r\n", the header of a bulk string
+static char* __bulk_header(char* p,size_t n){
+	char digits[20];
+	int i = 0;
+	do{
+	    digits[i++] = '0' + n%10;
+	    n /= 10;
+	}while(n != 0);
+	*p++ = '$';
+	while(i > 0)
+	    *p++ = digits[--i];
+	*p++ = '\r';
+	*p++ = '\n';
+	return p;
+}
+
+/*
+*encode head, the prefixed key and, if value is not NULL, the value as one RESP frame. The
+*prefix is copied from the handle right in front of the key, nothing is formatted or parsed.
+*buf is used when the frame fits in cap bytes, otherwise it is malloced.
+*/
+static char* __namespace_frame(const clusterNamespace* ns,const char* head,size_t headlen,const char* key,size_t keylen,
+                               const char* value,size_t valuelen,char* buf,size_t cap,size_t* len){
+	//two bulk headers of at most 23 bytes and two CRLF
+	size_t total = headlen + 2*23 + 4 + ns->prefix_len + keylen + (value != NULL ? valuelen : 0);
+	char* out = total <= cap ? buf : (char*)malloc(total);
+	if(out == NULL){
+	    printf("panic! %s %d\n",__FILE__,__LINE__);
+	    return NULL;
+	}
+	char* p = out;
+	memcpy(p,head,headlen);
+	p = __bulk_header(p+headlen,ns->prefix_len+keylen);
+	memcpy(p,ns->prefix,ns->prefix_len);
+	memcpy(p+ns->prefix_len,key,keylen);
+	p += ns->prefix_len + keylen;
+	*p++ = '\r';
+	*p++ = '\n';
+	if(value != NULL){
+	    p = __bulk_header(p,valuelen);
+	    memcpy(p,value,valuelen);
+	    p += valuelen;
+	    *p++ = '\r';
+	    *p++ = '\n';
 	}
+	*len = p - out;
+	return out;
+}
 
-        char* localSetKey = global_setspace[localTid].setKey;
-	global_setspace[localTid].used=1;
+/*
+*SET when value is not NULL, GET otherwise, of a key in the namespace. The slot is hashed on
+*from the CRC of the prefix, only the bytes of the key are read.
+*/
+static redisReply* __namespace_request(clusterInfo* cluster,const clusterNamespace* ns,const char* key,size_t keylen,
+                                       const char* value,size_t valuelen){
+	static const char set_head[] = "*3\r\n$3\r\nset\r\n";
+	static const char get_head[] = "*2\r\n$3\r\nget\r\n";
+	char local[512];
+	size_t len;
+	char* frame = value != NULL ?
+	    __namespace_frame(ns,set_head,sizeof(set_head)-1,key,keylen,value,valuelen,local,sizeof(local),&len) :
+	    __namespace_frame(ns,get_head,sizeof(get_head)-1,key,keylen,NULL,0,local,sizeof(local),&len);
+	if(frame == NULL)
+	    return NULL;
+
+	clusterRequest req = {.frame = frame,.frame_len = len};
+	int slot = keyHashSlotPrefixed(ns->prefix_crc,key,keylen);
+	redisReply* r = value != NULL ? __cluster_request(cluster,slot,&req) : __cluster_read_request(cluster,slot,&req);
+	if(frame != local)
+	    free(frame);
+	return r;
+}
 
-	sprintf(localSetKey,"%d\b%s",dbnum,key);
+int namespace_set(clusterInfo* cluster,const clusterNamespace* ns,const char* key,size_t keylen,const char* value,size_t valuelen){
+	if(cluster == NULL || ns == NULL || key == NULL || value == NULL){
+	    printf("invalid arguments %s %d\n",__FILE__,__LINE__);
+	    return -1;
+	}
+	return __set_status(__namespace_request(cluster,ns,key,keylen,value,valuelen));
+}
+
+int namespace_get(clusterInfo* cluster,const clusterNamespace* ns,const char* key,size_t keylen,
+                  char* value,size_t capacity,size_t* valuelen){
+	if(cluster == NULL || ns == NULL || key == NULL || (value == NULL && capacity != 0) || valuelen == NULL){
+	    printf("invalid arguments %s %d\n",__FILE__,__LINE__);
+	    return -1;
+	}
+	return __copy_value(__namespace_request(cluster,ns,key,keylen,NULL,0),value,capacity,valuelen);
+}
 
-	int re = __set_nodb(cluster,localSetKey,set_in_value);
+int namespace_get_view(clusterInfo* cluster,const clusterNamespace* ns,const char* key,size_t keylen,replyView* view){
+	if(cluster == NULL || ns == NULL || key == NULL || view == NULL){
+	    printf("invalid arguments %s %d\n",__FILE__,__LINE__);
+	    return -1;
+	}
+	return __view_value(__namespace_request(cluster,ns,key,keylen,NULL,0),view);
+}
 
-	global_setspace[localTid].used = 0;
+/*
+*build the argv of a multi-key command, keys prefixed with the db number the way set and get do it.
+*every stride-th argument starting at 1 is a key, the others are taken from values.
+*returns the slot shared by the keys, -1 if they are in different slots.
+*/
+static int __slot_argv(const char* cmd,const char** keys,const char** values,int count,int dbnum,
+                       const char** argv,char** prefixed){
+	int i,slot = -1;
+	int stride = values == NULL ? 1 : 2;
+	argv[0] = cmd;
+	for(i=0;i<count;i++){
+	    prefixed[i] = (char*)malloc(strlen(keys[i])+16);
+	    sprintf(prefixed[i],"%d\b%s",dbnum,keys[i]);
+	    int key_slot = keyHashSlot(prefixed[i],strlen(prefixed[i]));
+	    if(slot == -1)
+	        slot = key_slot;
+	    else if(slot != key_slot)
+	        slot = -2;
+	    argv[1+i*stride] = prefixed[i];
+	    if(values != NULL)
+	        argv[2+i*stride] = values[i];
+	}
+	if(slot == -2){
+	    printf("keys are in different slots, use a common {hash tag}\n");
+	    return -1;
+	}
+	return slot;
+}
+
+static void __free_prefixed(char** prefixed,int count){
+	int i;
+	for(i=0;i<count;i++)
+	    free(prefixed[i]);
+	free(prefixed);
+}
+
+int cluster_keys_to_slots(clusterInfo* cluster,const char** keys,const int* lens,int count,
+                          uint16_t* slots,int* nodes,int* order,int* node_start){
+	if(cluster == NULL || keys == NULL || slots == NULL || count < 0 ||
+	   (order != NULL && (nodes == NULL || node_start == NULL))){
+	    printf("invalid arguments %s %d\n",__FILE__,__LINE__);
+	    return -1;
+	}
+	keyHashSlots(keys,lens,count,slots);
+	if(nodes == NULL)
+	    return 0;
+
+	int i;
+	int len = cluster->len;
+	for(i=0;i<count;i++){
+	    uint16_t index = __atomic_load_n(&cluster->topology->slot_to_node[slots[i]],__ATOMIC_RELAXED);
+	    nodes[i] = index == SLOT_UNASSIGNED ? -1 : index;
+	}
+	if(order == NULL)
+	    return 0;
+
+	//counting sort, the keys of no node form the last group
+	for(i=0;i<len+2;i++)
+	    node_start[i] = 0;
+	for(i=0;i<count;i++)
+	    node_start[(nodes[i] < 0 ? len : nodes[i])+1]++;
+	for(i=1;i<len+2;i++)
+	    node_start[i] += node_start[i-1];
+	for(i=0;i<count;i++)
+	    order[node_start[nodes[i] < 0 ? len : nodes[i]]++] = i;
+	for(i=len+1;i>0;i--)
+	    node_start[i] = node_start[i-1];
+	node_start[0] = 0;
+	return 0;
+}
+
+int cluster_slot_mget(clusterInfo* cluster,const char** keys,int count,char** values,size_t capacity,
+                      size_t* valuelens,int* status,int dbnum){
+	if(cluster == NULL || keys == NULL || values == NULL || valuelens == NULL || status == NULL || count <= 0){
+	    printf("invalid arguments %s %d\n",__FILE__,__LINE__);
+	    return -1;
+	}
+	int i;
+	for(i=0;i<count;i++){
+	    status[i] = -1;
+	    valuelens[i] = 0;
+	}
+	const char** argv = (const char**)malloc(sizeof(char*)*(count+1));
+	char** prefixed = (char**)malloc(sizeof(char*)*count);
+	int slot = __slot_argv("mget",keys,NULL,count,dbnum,argv,prefixed);
+	redisReply* r = NULL;
+	if(slot >= 0)
+	    r = __cluster_read_command_argv(cluster,slot,count+1,argv,NULL);
+	free(argv);
+	__free_prefixed(prefixed,count);
+	if(r == NULL)
+	    return -1;
+
+	int re = 0;
+	if(r->type == REDIS_REPLY_ARRAY && r->elements == (size_t)count){
+	    for(i=0;i<count;i++){
+	        status[i] = __copy_element(r->element[i],values[i],capacity,&valuelens[i]);
+	        if(status[i] < 0)
+	            re = -1;
+	    }
+	}else{
+	    printf("mget return type=%d %s %d\n",r->type,__FILE__,__LINE__);
+	    re = -1;
+	}
+	freeReplyObject(r);
+	return re;
+}
+
+int cluster_slot_mset(clusterInfo* cluster,const char** keys,const char** values,int count,int dbnum){
+	if(cluster == NULL || keys == NULL || values == NULL || count <= 0){
+	    printf("invalid arguments %s %d\n",__FILE__,__LINE__);
+	    return -1;
+	}
+	const char** argv = (const char**)malloc(sizeof(char*)*(count*2+1));
+	char** prefixed = (char**)malloc(sizeof(char*)*count);
+	int slot = __slot_argv("mset",keys,values,count,dbnum,argv,prefixed);
+	redisReply* r = NULL;
+	if(slot >= 0)
+	    r = __cluster_command_argv(cluster,slot,count*2+1,argv,NULL);
+	free(argv);
+	__free_prefixed(prefixed,count);
+	if(r == NULL)
+	    return -1;
 
+	int re = r->type == REDIS_REPLY_STATUS ? 0 : -1;
+	if(re != 0)
+	    printf("mset return type=%d %s %d\n",r->type,__FILE__,__LINE__);
+	freeReplyObject(r);
 	return re;
 }
 
-int set(clusterInfo* cluster, const char *key,char *set_in_value,int dbnum,int tid) {
-	return __set_withdb(cluster,key,set_in_value,dbnum,tid);
+static int __compare_slot_key(const void* a,const void* b){
+	unsigned long long x = *(const unsigned long long*)a;
+	unsigned long long y = *(const unsigned long long*)b;
+	return x < y ? -1 : x > y;
 }
 
-
 /*
-*get method without use db option. here const char* is not compitable with char*
+*split the keys by slot and send one MGET (values == NULL) or MSET per slot to the node serving it.
+*the commands for every node are written before any reply is read, so the call waits about one
+*round trip of the slowest node instead of one per key. A batch whose node can't be reached or
+*redirects it is sent again on its own with __cluster_request, which follows MOVED and ASK.
+*batches needs count entries and order count keys, batches[b].reply is the reply of a batch, NULL
+*if it failed. returns the number of batches, -1 on errors.
 */
-static int __get_nodb(clusterInfo*cluster ,const char* key,char* get_in_value){
-	if(key==NULL){
-	   strcpy(get_in_value,"key is NULL");
-	   return -1;
+static int __scatter(clusterInfo* cluster,const char* cmd,const char** keys,const char** values,int count,
+                     int dbnum,int* order,slotBatch* batches){
+	int i,b;
+	int read = values == NULL;
+	int stride = read ? 1 : 2;
+
+	__sync_topology(cluster);
+	for(i=0;i<cluster->len;i++){
+	    if(cluster->parse[i]->pipe_pending != 0){
+	        printf("pipelined replies pending, %s refused\n",cmd);
+	        return -1;
+	    }
 	}
 
-	redisContext * c = NULL;
-	int myslot;
-	myslot = crc16(key,strlen(key)) & 16383;
+	//every key with the db prefix, one allocation for all of them
+	char prefix[16];
+	int prefix_len = snprintf(prefix,sizeof(prefix),"%d\b",dbnum);
+	size_t total = 0;
+	int* lens = (int*)malloc(sizeof(int)*count);
+	for(i=0;i<count;i++){
+	    lens[i] = prefix_len + strlen(keys[i]);
+	    total += lens[i];
+	}
+	char* arena = (char*)malloc(total > 0 ? total : 1);
+	const char** prefixed = (const char**)malloc(sizeof(char*)*count);
+	uint16_t* slots = (uint16_t*)malloc(sizeof(uint16_t)*count);
+	unsigned long long* sorted = (unsigned long long*)malloc(sizeof(unsigned long long)*count);
+	const char** argv = (const char**)malloc(sizeof(char*)*(count*(stride+1)));
+	size_t* argvlen = (size_t*)malloc(sizeof(size_t)*(count*(stride+1)));
+	//where the argv of each batch starts, there are at most count batches
+	int* first = (int*)malloc(sizeof(int)*count);
+	if(lens == NULL || arena == NULL || prefixed == NULL || slots == NULL || sorted == NULL ||
+	   argv == NULL || argvlen == NULL || first == NULL){
+	    printf("panic! %s %d\n",__FILE__,__LINE__);
+	    free(lens); free(arena); free(prefixed); free(slots); free(sorted); free(argv); free(argvlen); free(first);
+	    return -1;
+	}
+	char* p = arena;
+	for(i=0;i<count;i++){
+	    memcpy(p,prefix,prefix_len);
+	    memcpy(p+prefix_len,keys[i],lens[i]-prefix_len);
+	    prefixed[i] = p;
+	    p += lens[i];
+	}
+	keyHashSlots(prefixed,lens,count,slots);
+
+	//group by slot, keys of a slot keep their input order
+	for(i=0;i<count;i++)
+	    sorted[i] = ((unsigned long long)slots[i] << 32) | (unsigned int)i;
+	qsort(sorted,count,sizeof(unsigned long long),__compare_slot_key);
+	int nbatch = 0;
+	for(i=0;i<count;i++){
+	    order[i] = (int)(sorted[i] & 0xffffffff);
+	    int slot = (int)(sorted[i] >> 32);
+	    if(nbatch == 0 || batches[nbatch-1].slot != slot){
+	        batches[nbatch].slot = slot;
+	        batches[nbatch].start = i;
+	        batches[nbatch].count = 0;
+	        batches[nbatch].node = NULL;
+	        batches[nbatch].reply = NULL;
+	        nbatch++;
+	    }
+	    batches[nbatch-1].count++;
+	}
 
-	parseArgv* tempArgv = ((parseArgv*)(cluster->slot_to_host[myslot]));
+	//the argv of every batch, one after the other
+	int arg = 0;
+	for(b=0;b<nbatch;b++){
+	    first[b] = arg;
+	    argv[arg] = cmd;
+	    argvlen[arg++] = strlen(cmd);
+	    for(i=batches[b].start;i<batches[b].start+batches[b].count;i++){
+	        argv[arg] = prefixed[order[i]];
+	        argvlen[arg++] = lens[order[i]];
+	        if(!read){
+	            argv[arg] = values[order[i]];
+	            argvlen[arg++] = strlen(values[order[i]]);
+	        }
+	    }
+	}
 
-	if(tempArgv->slots[myslot]!=1){
-            //ignore this error currently
+	for(b=0;b<nbatch;b++){
+	    parseArgv* node = read ? __read_parse(cluster,batches[b].slot) : __slot_to_parse(cluster,batches[b].slot);
+	    if(node == NULL || __node_context(cluster,node) == NULL)
+	        continue;
+	    if(redisAppendCommandArgv(node->context,1+batches[b].count*stride,argv+first[b],argvlen+first[b]) == REDIS_OK)
+	        batches[b].node = node;
+	}
+	int done;
+	for(b=0;b<nbatch;b++){
+	    //a node already flushed for an earlier batch has nothing left to write
+	    if(batches[b].node == NULL)
+	        continue;
+	    do{
+	        if(redisBufferWrite(batches[b].node->context,&done) != REDIS_OK)
+	            break;
+	    }while(!done);
+	}
+	for(b=0;b<nbatch;b++){
+	    void* reply = NULL;
+	    if(batches[b].node != NULL && redisGetReply(batches[b].node->context,&reply) != REDIS_OK)
+	        reply = NULL;
+	    batches[b].reply = (redisReply*)reply;
 	}
 
-	if(tempArgv->context == NULL){
-	    //this error can not be ignored
-	    printf("context = NULL in function set\n");
-	    strcpy(get_in_value,"conext ==NULL");
-	    return -1;
+	for(b=0;b<nbatch;b++){
+	    redisReply* r = batches[b].reply;
+	    if(r != NULL && !__is_redirect(r))
+	        continue;
+	    if(r != NULL)
+	        freeReplyObject(r);
+	    int argc = 1+batches[b].count*stride;
+	    batches[b].reply = read ? __cluster_read_command_argv(cluster,batches[b].slot,argc,argv+first[b],argvlen+first[b]) :
+	                              __cluster_command_argv(cluster,batches[b].slot,argc,argv+first[b],argvlen+first[b]);
 	}
 
-	c = tempArgv->context;
+	free(first);
+	free(lens); free(arena); free(prefixed); free(slots); free(sorted); free(argv); free(argvlen);
+	return nbatch;
+}
 
-	redisReply *r = (redisReply *)redisCommand(c, "get %s", key);
+int cluster_mget(clusterInfo* cluster,const char** keys,int count,char** values,size_t capacity,
+                 size_t* valuelens,int* status,int dbnum){
+	if(cluster == NULL || keys == NULL || values == NULL || valuelens == NULL || status == NULL || count <= 0){
+	    printf("invalid arguments %s %d\n",__FILE__,__LINE__);
+	    return -1;
+	}
+	int* order = (int*)malloc(sizeof(int)*count);
+	slotBatch* batches = (slotBatch*)malloc(sizeof(slotBatch)*count);
+	int nbatch = order != NULL && batches != NULL ? __scatter(cluster,"mget",keys,NULL,count,dbnum,order,batches) : -1;
+
+	int re = nbatch < 0 ? -1 : 0;
+	int b,j;
+	for(b=0;b<nbatch;b++){
+	    redisReply* r = batches[b].reply;
+	    int ok = r != NULL && r->type == REDIS_REPLY_ARRAY && r->elements == (size_t)batches[b].count;
+	    if(!ok)
+	        printf("mget of slot %d failed %s %d\n",batches[b].slot,__FILE__,__LINE__);
+	    for(j=0;j<batches[b].count;j++){
+	        int k = order[batches[b].start+j];
+	        valuelens[k] = 0;
+	        status[k] = ok ? __copy_element(r->element[j],values[k],capacity,&valuelens[k]) : -1;
+	        if(status[k] < 0)
+	            re = -1;
+	    }
+	    if(r != NULL)
+	        freeReplyObject(r);
+	}
+	free(order);
+	free(batches);
+	return re;
+}
 
-	if (r->type == REDIS_REPLY_STRING) {
-		int len = strlen(r->str);
-		strcpy(get_in_value, r->str);
-		freeReplyObject(r);
-		return 0;
-	}else if (r->type == REDIS_REPLY_NIL) {
-		strcpy(get_in_value,"nil");
-		freeReplyObject(r);
-		return 0;
-	} else if(r->type == REDIS_REPLY_ERROR && !strncmp(r->str,"MOVED",5)){
-		freeReplyObject(r);
-		strcpy(get_in_value,"redirection");
-		return -1;
-	} else {
-		printf("get return type=%d,str=%s,%d %s",r->type,\
-		       r->str,__LINE__,__FILE__);
-                if(r->type == REDIS_REPLY_ARRAY){
-		   strcpy(get_in_value,"return bulk");  
-		}else if(r->type == REDIS_REPLY_STATUS){
-		   strcpy(get_in_value,"return status");
-		}else if(r->type == REDIS_REPLY_INTEGER){
-		      sprintf(get_in_value,"%lld",r->integer);
-		}else{
-		   strcpy(get_in_value,"unknown type");
-		}
-		freeReplyObject(r);
-		return 0;
+int cluster_mset(clusterInfo* cluster,const char** keys,const char** values,int count,int dbnum){
+	if(cluster == NULL || keys == NULL || values == NULL || count <= 0){
+	    printf("invalid arguments %s %d\n",__FILE__,__LINE__);
+	    return -1;
 	}
+	int* order = (int*)malloc(sizeof(int)*count);
+	slotBatch* batches = (slotBatch*)malloc(sizeof(slotBatch)*count);
+	int nbatch = order != NULL && batches != NULL ? __scatter(cluster,"mset",keys,values,count,dbnum,order,batches) : -1;
+
+	int re = nbatch < 0 ? -1 : 0;
+	int b;
+	for(b=0;b<nbatch;b++){
+	    redisReply* r = batches[b].reply;
+	    if(r == NULL || r->type != REDIS_REPLY_STATUS){
+	        printf("mset of slot %d failed %s %d\n",batches[b].slot,__FILE__,__LINE__);
+	        re = -1;
+	    }
+	    if(r != NULL)
+	        freeReplyObject(r);
+	}
+	free(order);
+	free(batches);
+	return re;
+}
+
+static int __compare_command(const void* key,const void* entry){
+	const commandName* k = (const commandName*)key;
+	const char* name = ((const commandKeys*)entry)->name;
+	size_t n = strlen(name);
+	int c = strncasecmp(k->name,name,k->len < n ? k->len : n);
+	if(c != 0)
+	    return c;
+	return k->len < n ? -1 : k->len > n;
 }
+
+static const commandKeys* __command_keys(const char* name,size_t len){
+	commandName key = {name,len};
+	return (const commandKeys*)bsearch(&key,command_keys,sizeof(command_keys)/sizeof(commandKeys),
+	                                   sizeof(commandKeys),__compare_command);
+}
+
 /*
-*tid can be used to  allocate global get/put space for a specific thread
-*each thread only need one tid and one space
+*find the keys of a command in the table, copy argv to out with the keys prefixed with the db
+*number when dbnum >= 0, and work out the slot they share. the prefixed keys live in *arena, to be
+*freed by the caller, read tells if a replica may serve the command.
+*returns the slot, -1 for unknown commands, wrong arity or keys in different slots.
 */
-static int __get_withdb(clusterInfo* cluster, const char* key,\
-                            char* get_in_value,int dbnum,int tid){
-        int localTid = tid%99;
-	if (localTid <0) {
-	    printf("local tid error\n");
+static int __route_command(int argc,const char** argv,const size_t* argvlen,int dbnum,
+                           const char** out,size_t* outlen,char** arena,int* read){
+	int i;
+	*arena = NULL;
+	for(i=0;i<argc;i++){
+	    out[i] = argv[i];
+	    outlen[i] = argvlen != NULL ? argvlen[i] : strlen(argv[i]);
+	}
+	const commandKeys* info = argc > 0 ? __command_keys(argv[0],outlen[0]) : NULL;
+	if(info == NULL){
+	    printf("no key positions known for %.*s\n",argc > 0 ? (int)outlen[0] : 0,argc > 0 ? argv[0] : "");
+	    return -1;
+	}
+	int last = info->last < 0 ? argc + info->last : info->last;
+	if(argc <= info->first || last >= argc){
+	    printf("wrong number of arguments for %s\n",info->name);
 	    return -1;
 	}
+	*read = info->read;
+
+	if(dbnum >= 0){
+	    char prefix[16];
+	    int prefix_len = snprintf(prefix,sizeof(prefix),"%d\b",dbnum);
+	    size_t total = 0;
+	    for(i=info->first;i<=last;i+=info->step)
+	        total += prefix_len + outlen[i];
+	    char* p = *arena = (char*)malloc(total);
+	    if(p == NULL){
+	        printf("panic! %s %d\n",__FILE__,__LINE__);
+	        return -1;
+	    }
+	    for(i=info->first;i<=last;i+=info->step){
+	        memcpy(p,prefix,prefix_len);
+	        memcpy(p+prefix_len,out[i],outlen[i]);
+	        out[i] = p;
+	        outlen[i] += prefix_len;
+	        p += outlen[i];
+	    }
+	}
 
-	if(global_getspace[localTid].used == 1){
-	     printf("global get space used error\n");
-	     return -1;
+	int slot = keyHashSlot(out[info->first],outlen[info->first]);
+	for(i=info->first+info->step;i<=last;i+=info->step){
+	    if(keyHashSlot(out[i],outlen[i]) != slot){
+	        printf("keys of %s are in different slots, use a common {hash tag}\n",info->name);
+	        free(*arena);
+	        *arena = NULL;
+	        return -1;
+	    }
 	}
-	char *localGetKey = global_getspace[localTid].getKey;
-	global_getspace[localTid].used = 1;
+	return slot;
+}
 
-	sprintf(localGetKey,"%d\b%s",dbnum,key);
-	int re = __get_nodb(cluster,localGetKey,get_in_value);
-	global_getspace[localTid].used = 0;
-	return re;
+redisReply* cluster_command_argv(clusterInfo* cluster,int argc,const char** argv,const size_t* argvlen,int dbnum){
+	if(cluster == NULL || argv == NULL || argc <= 0){
+	    printf("invalid arguments %s %d\n",__FILE__,__LINE__);
+	    return NULL;
+	}
+	routedCommand routed;
+	if(cluster_route_argv(argc,argv,argvlen,dbnum,&routed) < 0)
+	    return NULL;
+	redisReply* r = routed.read ? __cluster_read_command_argv(cluster,routed.slot,routed.argc,routed.argv,routed.argvlen) :
+	                              __cluster_command_argv(cluster,routed.slot,routed.argc,routed.argv,routed.argvlen);
+	cluster_route_release(&routed);
+	return r;
 }
 
+int cluster_route_argv(int argc,const char** argv,const size_t* argvlen,int dbnum,routedCommand* routed){
+	if(argv == NULL || argc <= 0 || routed == NULL){
+	    printf("invalid arguments %s %d\n",__FILE__,__LINE__);
+	    return -1;
+	}
+	routed->argc = argc;
+	routed->argv = routed->inline_argv;
+	routed->argvlen = routed->inline_argvlen;
+	if(argc > ROUTE_INLINE_ARGS){
+	    routed->argv = (const char**)malloc(sizeof(const char*)*argc);
+	    routed->argvlen = (size_t*)malloc(sizeof(size_t)*argc);
+	    if(routed->argv == NULL || routed->argvlen == NULL){
+	        printf("panic! %s %d\n",__FILE__,__LINE__);
+	        free(routed->argv);
+	        free(routed->argvlen);
+	        return -1;
+	    }
+	}
+	routed->slot = __route_command(argc,argv,argvlen,dbnum,routed->argv,routed->argvlen,&routed->arena,&routed->read);
+	if(routed->slot < 0){
+	    routed->arena = NULL;
+	    cluster_route_release(routed);
+	    return -1;
+	}
+	return routed->slot;
+}
 
-int get(clusterInfo* cluster, const char *key, char *get_in_value,int dbnum,int tid){
-      return  __get_withdb(cluster,key,get_in_value,dbnum,tid);
+void cluster_route_release(routedCommand* routed){
+	free(routed->arena);
+	if(routed->argv != routed->inline_argv){
+	    free(routed->argv);
+	    free(routed->argvlen);
+	}
+	routed->arena = NULL;
+	routed->argv = routed->inline_argv;
+	routed->argvlen = routed->inline_argvlen;
 }
 
 static void __remove_context_from_cluster(clusterInfo* mycluster){
    int len = mycluster-> len;
    int i = 0;
    for(i=0;i<len;i++){
+      //nodes which were never used have no connection
       if(mycluster->parse[i]->context != NULL)      
            redisFree(mycluster->parse[i]->context);
-      else printf("context == NULL in remove_context_from_cluster\n");
    }
 }
 
-static void __global_disconnect(clusterInfo *cluster){
-    if(cluster->globalContext !=NULL)
-        redisFree(cluster->globalContext);
-}
-
 static void __free_clusterNodes_info(clusterInfo *cluster) {
     int len = cluster->len;
     int i;
     for(i=0;i<len;i++){
-       if(cluster->argv[i] != NULL)
-           free(cluster->argv[i]);
        if(cluster->parse[i] != NULL) {
            if(cluster->parse[i]->ip != NULL)
                free(cluster->parse[i]->ip);
            free(cluster->parse[i]);
        }
     }
+    free(cluster->parse);
 }
 
 void disconnectDatabase(clusterInfo* cluster){
-    __global_disconnect(cluster);
     __remove_context_from_cluster(cluster);
     __free_clusterNodes_info(cluster);
+    topology_release(cluster->topology);
+    topology_detach(cluster->entry);
     free(cluster);
 }
 
@@ -558,12 +1890,20 @@ int flushDb(clusterInfo* cluster){
     	printf("error flushdb cluster == NULL\n");
     }
 
+    __sync_topology(cluster);
     int len = cluster->len;
     int i;
 
     for(i=0;i<len;i++){
-       c = cluster->parse[i]->context;
+       //replicas get the flush from their master
+       if(cluster->parse[i]->readonly)
+          continue;
+       c = __node_context(cluster,cluster->parse[i]);
+       if(c == NULL)
+          break;
        redisReply *r = (redisReply *)redisCommand(c, "flushdb");
+       if(r == NULL)
+          break;
        if(r->type == REDIS_REPLY_STATUS){
 
            printf("flushdb status = %s\n",r->str);
@@ -580,30 +1920,6 @@ int flushDb(clusterInfo* cluster){
 
 
 
-/*
-*init global space for getKey and set key, this function must be called only once before
-*any operations on the redis cluster.
-*/
-void init_global(){
-     int i;
-     for(i=0;i<99;i++){
-        global_getspace[i].getKey = (char*)malloc(1024);
-        global_setspace[i].setKey = (char*)malloc(1024);
-	global_getspace[i].used = 0;
-	global_setspace[i].used = 0;
-     }
-}
-
-int release_global() {
-     int i;
-     for(i=0;i<99;i++){
-        if(global_getspace[i].getKey != NULL)
-            free(global_getspace[i].getKey);
-        if(global_setspace[i].setKey != NULL)
-            free(global_setspace[i].setKey);
-     }
-}
-
 singleClient* single_connect(int port,const char* ip){
       singleClient* sc = (singleClient*)malloc(sizeof(singleClient));
       sc->port=port;
@@ -633,13 +1949,25 @@ singleClient* single_connect(int port,const char* ip){
 
 //pipeline get command
 void pipe_set(singleClient*sc, char*key, char*value){
-    redisAppendCommand(sc->singleContext,"SET %s %s",key,value);
-    sc->pipe_count+=1;
+    pipe_setn(sc,key,strlen(key),value,strlen(value));
 }
 
 //pipeline set command
 void pipe_get(singleClient*sc,char*key){
-   redisAppendCommand(sc->singleContext,"GET %s ",key);
+   pipe_getn(sc,key,strlen(key));
+}
+
+void pipe_setn(singleClient*sc,const char*key,size_t keylen,const char*value,size_t valuelen){
+    const char* argv[3] = {"SET",key,value};
+    size_t argvlen[3] = {3,keylen,valuelen};
+    redisAppendCommandArgv(sc->singleContext,3,argv,argvlen);
+    sc->pipe_count+=1;
+}
+
+void pipe_getn(singleClient*sc,const char*key,size_t keylen){
+   const char* argv[2] = {"GET",key};
+   size_t argvlen[2] = {3,keylen};
+   redisAppendCommandArgv(sc->singleContext,2,argv,argvlen);
    sc->pipe_count+=1;
 }
 
@@ -740,8 +2068,17 @@ clusterPipe* get_pipeline(){
         localPipe->cur_index = 0;
         localPipe->reply_index_front = 0;
         localPipe->reply_index_end = 0;
+        localPipe->capacity = 0;
+        localPipe->send_slot = NULL;
+        localPipe->sending_queue = NULL;
+        localPipe->pipe_reply_buffer = NULL;
+        localPipe->next_same = NULL;
+        if(__grow_pipeline(localPipe,PIPE_INITIAL_CAPACITY) != 0){
+            release_pipeline(localPipe);
+            return NULL;
+        }
         int i;
-        for(i=0;i<MAX_PIPE_COUNT;i++){
+        for(i=0;i<localPipe->capacity;i++){
             localPipe->send_slot[i]=-1;
             localPipe->sending_queue[i]=NULL;
             localPipe->pipe_reply_buffer[i]=NULL;
@@ -750,12 +2087,41 @@ clusterPipe* get_pipeline(){
     return localPipe;
 }
 
+/*
+*make room for n commands, the pipeline at least doubles so that raising the count step by step
+*doesn't copy the arrays every time. returns 0 on success.
+*/
+static int __grow_pipeline(clusterPipe* mypipe,int n){
+    if(n <= mypipe->capacity)
+        return 0;
+    if(n < mypipe->capacity*2)
+        n = mypipe->capacity*2;
+    int* send_slot = (int*)realloc(mypipe->send_slot,sizeof(int)*n);
+    if(send_slot != NULL)
+        mypipe->send_slot = send_slot;
+    parseArgv** sending_queue = (parseArgv**)realloc(mypipe->sending_queue,sizeof(parseArgv*)*n);
+    if(sending_queue != NULL)
+        mypipe->sending_queue = sending_queue;
+    redisReply** pipe_reply_buffer = (redisReply**)realloc(mypipe->pipe_reply_buffer,sizeof(redisReply*)*n);
+    if(pipe_reply_buffer != NULL)
+        mypipe->pipe_reply_buffer = pipe_reply_buffer;
+    int* next_same = (int*)realloc(mypipe->next_same,sizeof(int)*n);
+    if(next_same != NULL)
+        mypipe->next_same = next_same;
+    if(send_slot == NULL || sending_queue == NULL || pipe_reply_buffer == NULL || next_same == NULL){
+        printf("unable to grow the pipeline to %d\n",n);
+        return -1;
+    }
+    mypipe->capacity = n;
+    return 0;
+}
+
 /*
 *set the pipeline count
 */
 int set_pipeline_count(clusterPipe* mypipe,int n) {
 
-    if(n<0 || n>100) {
+    if(n<0 || __grow_pipeline(mypipe,n) != 0) {
         printf("unsupported pipeline count\n");
         return -1;
     }else {
@@ -767,8 +2133,9 @@ int set_pipeline_count(clusterPipe* mypipe,int n) {
         mypipe->reply_index_front = 0;
         mypipe->reply_index_end = 0;
 
+        //only the first n entries are used by the next transaction
         int i;
-        for(i=0;i<MAX_PIPE_COUNT;i++){
+        for(i=0;i<n;i++){
             mypipe->send_slot[i]=-1;
             mypipe->sending_queue[i]=NULL;
             mypipe->pipe_reply_buffer[i]=NULL;
@@ -782,7 +2149,7 @@ int set_pipeline_count(clusterPipe* mypipe,int n) {
 *just to make it feel more natural to use this kind of interface.
 */
 int reset_pipeline_count(clusterPipe* mypipe, int n) {
-    set_pipeline_count(mypipe,n);
+    return set_pipeline_count(mypipe,n);
 }
 
 
@@ -794,6 +2161,7 @@ int bind_pipeline_to_cluster(clusterInfo* cluster, clusterPipe* mypipe) {
         return -1;
     }
     
+    __sync_topology(cluster);
     int len = cluster->len;
     for(int i=0;i<len;i++) {
         if(cluster->parse[i] == NULL){
@@ -805,12 +2173,14 @@ int bind_pipeline_to_cluster(clusterInfo* cluster, clusterPipe* mypipe) {
         }
     }
     mypipe->cluster = cluster;
+    return 0;
 }
 
 /*
-*base function for cluster_pipeline set and get.
+*base function for cluster_pipeline set, get and commands, all sent to the node serving myslot,
+*reads may go to a replica.
 */
-static int __cluster_pipeline_basecommand(clusterInfo *cluster,clusterPipe *mypipe,char *cmd,char *key,char *value){
+static int __cluster_pipeline_basecommand(clusterInfo *cluster,clusterPipe *mypipe,int myslot,int read,int argc,const char** argv,const size_t* argvlen){
 
     if(mypipe->cluster != cluster) {
         printf("haven't bind yet\n");
@@ -822,14 +2192,15 @@ static int __cluster_pipeline_basecommand(clusterInfo *cluster,clusterPipe *mypi
         printf("pipecount full, command rejected, please call getReply\n");
         return -1;
     }
-    //Calculate the slot
     redisContext *c = NULL;
-    int myslot;
-    myslot = crc16(key,strlen(key)) & 16383;
-
-    parseArgv* tempArgv = ((parseArgv*)(cluster->slot_to_host[myslot]));
+    __sync_topology(cluster);
+    parseArgv* tempArgv = read ? __read_parse(cluster,myslot) : __slot_to_parse(cluster,myslot);
+    //a replica that can't be connected is marked unreachable, the master serves the read as __cluster_read_request does
+    if(tempArgv != NULL && tempArgv->readonly && __node_context(cluster,tempArgv) == NULL)
+        tempArgv = __slot_to_parse(cluster,myslot);
     if(tempArgv == NULL) {
         printf("can't find the host for slot %d\n",myslot);
+        return -1;
     }
 
     if(tempArgv->pipe_mode == PIPE_CLOSE) {
@@ -837,21 +2208,21 @@ static int __cluster_pipeline_basecommand(clusterInfo *cluster,clusterPipe *mypi
         return -1;
     }
 
-    if(tempArgv->pipe_pending>100 || tempArgv->pipe_pending <0) {
+    if(tempArgv->pipe_pending <0) {
         printf("invalid pending reply\n");
         return -1;
     }
 
-    if(tempArgv->context == NULL){
+    if(__node_context(cluster,tempArgv) == NULL){
         printf("context = NULL in function set\n");
         return -1;
     }
     
     c = tempArgv->context;
-    if(strcmp(cmd,"set")==0)
-        redisAppendCommand(c,"set %s %s",key,value);
-    else if(strcmp(cmd,"get")==0)
-        redisAppendCommand(c,"get %s",key);
+    if(redisAppendCommandArgv(c,argc,argv,argvlen) != REDIS_OK) {
+        printf("unable to append the command %s %d\n",__FILE__,__LINE__);
+        return -1;
+    }
     int current_index = mypipe->cur_index;
 
     mypipe->send_slot[current_index] = myslot;
@@ -864,38 +2235,154 @@ static int __cluster_pipeline_basecommand(clusterInfo *cluster,clusterPipe *mypi
 
 
 int cluster_pipeline_set(clusterInfo *cluster,clusterPipe *mypipe,char *key,char *value ) {
-    return __cluster_pipeline_basecommand(cluster,mypipe,"set",key,value);
+    return cluster_pipeline_setn(cluster,mypipe,key,strlen(key),value,strlen(value));
 }
 
 int cluster_pipeline_get(clusterInfo *cluster,clusterPipe *mypipe,char *key){
-    return __cluster_pipeline_basecommand(cluster,mypipe,"get",key,NULL);
+    return cluster_pipeline_getn(cluster,mypipe,key,strlen(key));
+}
+
+int cluster_pipeline_setn(clusterInfo *cluster,clusterPipe *mypipe,const char *key,size_t keylen,const char *value,size_t valuelen){
+    const char* argv[3] = {"set",key,value};
+    size_t argvlen[3] = {3,keylen,valuelen};
+    return __cluster_pipeline_basecommand(cluster,mypipe,keyHashSlot(key,keylen),0,3,argv,argvlen);
+}
+
+int cluster_pipeline_getn(clusterInfo *cluster,clusterPipe *mypipe,const char *key,size_t keylen){
+    const char* argv[2] = {"get",key};
+    size_t argvlen[2] = {3,keylen};
+    return __cluster_pipeline_basecommand(cluster,mypipe,keyHashSlot(key,keylen),1,2,argv,argvlen);
+}
+
+int cluster_pipeline_command_argv(clusterInfo *cluster,clusterPipe *mypipe,int argc,const char** argv,const size_t* argvlen,int dbnum){
+    if(cluster == NULL || mypipe == NULL || argv == NULL || argc <= 0){
+        printf("invalid arguments %s %d\n",__FILE__,__LINE__);
+        return -1;
+    }
+    routedCommand routed;
+    if(cluster_route_argv(argc,argv,argvlen,dbnum,&routed) < 0)
+        return -1;
+    //hiredis has copied the arguments into its buffer once the command is appended
+    int re = __cluster_pipeline_basecommand(cluster,mypipe,routed.slot,routed.read,routed.argc,routed.argv,routed.argvlen);
+    cluster_route_release(&routed);
+    return re;
 }
 
 /*
-*get all the replies, used internally
+*get all the replies, used internally. The output buffers of all nodes are written first, then their
+*sockets are polled together and the replies of whichever node is ready are parsed, so a batch takes
+*as long as its slowest node rather than the sum of all of them. Replies still land in submission order.
 */
 static redisReply* __cluster_pipeline_getReply(clusterInfo *cluster,clusterPipe *mypipe){
    if(mypipe->pipe_count != mypipe->current_count){
        printf("not the right time to get all the replies\n");
        return NULL;
    }
-   //TODO:
     int pipe_count = mypipe->pipe_count;
-    int i=0;
-    redisContext* localcontext;
-    for(;i<pipe_count;i++){
-        localcontext = mypipe->sending_queue[i]->context;
-        redisGetReply(localcontext,(void **)&(mypipe->pipe_reply_buffer[i]));
-        mypipe->sending_queue[i]->pipe_pending--;
-        if(mypipe->sending_queue[i]->pipe_pending < 0) {
-            printf("error %s %d\n",__FILE__,__LINE__);
-            return NULL;
+    int len = cluster->len;
+    int i;
+
+    //chain the commands of each node. MOVED replies are only followed once all of them are in, so
+    //neither cluster->len nor the nodes change before the loop below is over
+    for(i=0;i<len;i++)
+        cluster->parse[i]->pipe_next = -1;
+    for(i=pipe_count-1;i>=0;i--){
+        parseArgv* node = mypipe->sending_queue[i];
+        mypipe->next_same[i] = node->pipe_next;
+        node->pipe_next = i;
+        mypipe->pipe_reply_buffer[i] = NULL;
+    }
+
+    for(i=0;i<len;i++){
+        parseArgv* node = cluster->parse[i];
+        int done = 0;
+        while(node->pipe_next >= 0 && !done){
+            if(redisBufferWrite(node->context,&done) != REDIS_OK)
+                __pipeline_node_failed(node);
         }
     }
-    mypipe->reply_index_end = i-1;
+
+    struct pollfd fds[len > 0 ? len : 1];
+    parseArgv* nodes[len > 0 ? len : 1];
+    for(;;){
+        int count = 0;
+        for(i=0;i<len;i++){
+            parseArgv* node = cluster->parse[i];
+            //replies already parsed by an earlier read are taken before waiting on the socket
+            while(node->pipe_next >= 0 && __pipeline_take_reply(mypipe,node) == 1)
+                ;
+            if(node->pipe_next >= 0){
+                fds[count].fd = node->context->fd;
+                fds[count].events = POLLIN;
+                fds[count].revents = 0;
+                nodes[count++] = node;
+            }
+        }
+        if(count == 0)
+            break;
+        //with a single node left there is nothing to wait on together, read it directly
+        if(count == 1){
+            if(redisBufferRead(nodes[0]->context) != REDIS_OK)
+                __pipeline_node_failed(nodes[0]);
+            continue;
+        }
+        if(poll(fds,count,-1) < 0){
+            if(errno == EINTR)
+                continue;
+            printf("poll failed %s %d\n",__FILE__,__LINE__);
+            for(i=0;i<count;i++)
+                __pipeline_node_failed(nodes[i]);
+            break;
+        }
+        for(i=0;i<count;i++){
+            if(fds[i].revents != 0 && redisBufferRead(nodes[i]->context) != REDIS_OK)
+                __pipeline_node_failed(nodes[i]);
+        }
+    }
+    //the replies are handed to the caller as they are, but the next batch goes to the right node
+    for(i=0;i<pipe_count;i++){
+        redisReply* r = mypipe->pipe_reply_buffer[i];
+        char ip[64];
+        int port,redirect_slot;
+        if(r != NULL && r->type == REDIS_REPLY_ERROR && !strncmp(r->str,"MOVED ",6)
+            && topology_parse_redirect(r->str,&redirect_slot,ip,sizeof(ip),&port) == 0)
+            __follow_moved(cluster,redirect_slot,ip,port);
+    }
+    mypipe->reply_index_end = pipe_count-1;
     return NULL;
 }
 
+/*
+*take one reply the reader of the node has already parsed. returns 1 if there was one, 0 if not
+*and -1 if the connection is unusable.
+*/
+static int __pipeline_take_reply(clusterPipe *mypipe,parseArgv* node){
+    void* reply = NULL;
+    if(redisReaderGetReply(node->context->reader,&reply) != REDIS_OK){
+        __pipeline_node_failed(node);
+        return -1;
+    }
+    if(reply == NULL)
+        return 0;
+    int index = node->pipe_next;
+    mypipe->pipe_reply_buffer[index] = (redisReply*)reply;
+    node->pipe_next = mypipe->next_same[index];
+    node->pipe_pending--;
+    return 1;
+}
+
+/*
+*the connection of the node broke, the replies still expected from it stay NULL.
+*/
+static void __pipeline_node_failed(parseArgv* node){
+    printf("connection to ip=%s, port=%d lost with pipelined replies pending\n",node->ip,node->port);
+    //a protocol error leaves the connection unusable as well, __node_context makes it again
+    if(!node->context->err)
+        node->context->err = REDIS_ERR_PROTOCOL;
+    node->pipe_next = -1;
+    node->pipe_pending = 0;
+}
+
 
 int cluster_pipeline_flushBuffer(clusterInfo *cluster, clusterPipe *mypipe) {
     __cluster_pipeline_getReply(cluster,mypipe);
@@ -948,7 +2435,356 @@ bool cluster_pipeline_complete(clusterInfo *cluster,clusterPipe *mypipe) {
 }
 
 int release_pipeline(clusterPipe* mypipe) {
-    if(mypipe != NULL)
+    if(mypipe != NULL){
+        free(mypipe->send_slot);
+        free(mypipe->sending_queue);
+        free(mypipe->pipe_reply_buffer);
+        free(mypipe->next_same);
         free(mypipe);
+    }
+    return 0;
+}
+
+//start to support the streaming pipeline from here
+
+clusterStream* cluster_stream_open(clusterInfo* cluster,int window){
+    if(cluster == NULL){
+        printf("NULL pointer %s %d\n",__FILE__,__LINE__);
+        return NULL;
+    }
+    clusterStream* stream = (clusterStream*)malloc(sizeof(clusterStream));
+    if(stream == NULL){
+        printf("unable to allocate clusterStream\n");
+        return NULL;
+    }
+    stream->entries = (streamEntry*)malloc(sizeof(streamEntry)*STREAM_INITIAL_CAPACITY);
+    if(stream->entries == NULL){
+        printf("unable to allocate clusterStream\n");
+        free(stream);
+        return NULL;
+    }
+    stream->cluster = cluster;
+    stream->window = window > 0 ? window : STREAM_DEFAULT_WINDOW;
+    stream->capacity = STREAM_INITIAL_CAPACITY;
+    stream->head = 0;
+    stream->tail = 0;
+    stream->moved_slot = -1;
+    return stream;
+}
+
+int set_stream_window(clusterStream* stream,int window){
+    if(stream == NULL || window <= 0){
+        printf("unsupported stream window\n");
+        return -1;
+    }
+    stream->window = window;
+    return 0;
+}
+
+/*
+*double the ring, the entries keep their sequence numbers so the per-node links stay valid.
+*/
+static int __grow_stream(clusterStream* stream){
+    long long capacity = stream->capacity*2;
+    streamEntry* entries = (streamEntry*)malloc(sizeof(streamEntry)*capacity);
+    if(entries == NULL){
+        printf("unable to grow the stream to %lld\n",capacity);
+        return -1;
+    }
+    long long seq;
+    for(seq=stream->head;seq<stream->tail;seq++)
+        entries[seq & (capacity-1)] = stream->entries[seq & (stream->capacity-1)];
+    free(stream->entries);
+    stream->entries = entries;
+    stream->capacity = capacity;
     return 0;
 }
+
+/*
+*queue one command on the node serving slot, reads may go to a replica. A node with a full window
+*gives back its oldest reply first.
+*/
+static int __stream_submit(clusterStream* stream,int slot,int read,int argc,const char** argv,const size_t* argvlen){
+    clusterInfo* cluster = stream->cluster;
+    if(stream->tail - stream->head == stream->capacity && __grow_stream(stream) != 0)
+        return -1;
+
+    __stream_follow_moved(stream);
+    __sync_topology(cluster);
+    parseArgv* node = read ? __read_parse(cluster,slot) : __slot_to_parse(cluster,slot);
+    if(node == NULL){
+        printf("can't find the host for slot %d\n",slot);
+        return -1;
+    }
+    while(node->pipe_pending >= stream->window){
+        if(__stream_flush_node(stream,node) != 0 || __stream_read(stream,node,1) < 0)
+            break;
+    }
+    //after a broken connection there is nothing pending on the node, so it is made again here
+    redisContext* c = __node_context(cluster,node);
+    if(c == NULL){
+        printf("context = NULL for slot %d\n",slot);
+        return -1;
+    }
+    if(redisAppendCommandArgv(c,argc,argv,argvlen) != REDIS_OK){
+        printf("unable to append the command %s %d\n",__FILE__,__LINE__);
+        return -1;
+    }
+
+    long long seq = stream->tail;
+    streamEntry* entry = &stream->entries[seq & (stream->capacity-1)];
+    entry->node = node;
+    entry->reply = NULL;
+    entry->done = 0;
+    entry->next = -1;
+    if(node->stream_last >= 0)
+        stream->entries[node->stream_last & (stream->capacity-1)].next = seq;
+    else
+        node->stream_first = seq;
+    node->stream_last = seq;
+    node->pipe_pending++;
+    stream->tail++;
+
+    if(sdslen(c->obuf) >= STREAM_FLUSH_BYTES)
+        __stream_flush_node(stream,node);
+    return 0;
+}
+
+/*
+*write what is buffered for the node. returns -1 if the connection broke, its commands are failed.
+*/
+static int __stream_flush_node(clusterStream* stream,parseArgv* node){
+    redisContext* c = node->context;
+    if(c == NULL || c->err){
+        __stream_fail(stream,node);
+        return -1;
+    }
+    int done = 0;
+    while(!done){
+        if(redisBufferWrite(c,&done) != REDIS_OK){
+            __stream_fail(stream,node);
+            return -1;
+        }
+    }
+    node->stream_sent = node->stream_last;
+    return 0;
+}
+
+/*
+*read one reply of the node into the oldest of its commands. wait=0 only takes a reply already in
+*the read buffer. returns 1 if a reply was read, 0 if there was none, -1 if the connection broke.
+*/
+static int __stream_read(clusterStream* stream,parseArgv* node,int wait){
+    if(node->stream_first < 0)
+        return 0;
+    redisContext* c = node->context;
+    void* reply = NULL;
+    int re;
+    if(wait){
+        re = redisGetReply(c,&reply);
+    }else{
+        re = redisReaderGetReply(c->reader,&reply);
+    }
+    if(re != REDIS_OK){
+        //a protocol error leaves the connection unusable as well
+        if(!c->err)
+            c->err = REDIS_ERR_PROTOCOL;
+        __stream_fail(stream,node);
+        return -1;
+    }
+    if(reply == NULL)
+        return 0;
+
+    streamEntry* entry = &stream->entries[node->stream_first & (stream->capacity-1)];
+    entry->reply = (redisReply*)reply;
+    entry->done = 1;
+    node->stream_first = entry->next;
+    if(node->stream_first < 0)
+        node->stream_last = -1;
+    node->pipe_pending--;
+
+    redisReply* r = (redisReply*)reply;
+    if(r->type == REDIS_REPLY_ERROR && !strncmp(r->str,"MOVED ",6)){
+        //handed to the caller as it is, the commands submitted from now on go to the right node
+        int slot,port;
+        if(topology_parse_redirect(r->str,&slot,stream->moved_ip,sizeof(stream->moved_ip),&port) == 0){
+            stream->moved_slot = slot;
+            stream->moved_port = port;
+        }
+    }
+    return 1;
+}
+
+/*
+*patch the layout with the MOVED reply kept by __stream_read. Only called where the stream holds no
+*parseArgv, it may replace cluster->parse once nothing is in flight.
+*/
+static void __stream_follow_moved(clusterStream* stream){
+    if(stream->moved_slot < 0)
+        return;
+    int slot = stream->moved_slot;
+    stream->moved_slot = -1;
+    __follow_moved(stream->cluster,slot,stream->moved_ip,stream->moved_port);
+}
+
+/*
+*write the commands buffered for nodes that have answered everything written to them so far. The
+*others get theirs once their replies are in, meanwhile more commands gather into one write.
+*/
+static void __stream_flush_idle(clusterStream* stream){
+    clusterInfo* cluster = stream->cluster;
+    int i;
+    for(i=0;i<cluster->len;i++){
+        parseArgv* node = cluster->parse[i];
+        if(node->stream_first >= 0 && node->stream_first > node->stream_sent)
+            __stream_flush_node(stream,node);
+    }
+}
+
+/*
+*one poll over every node with commands in flight, the readable ones are read without blocking.
+*/
+static void __stream_poll(clusterStream* stream){
+    clusterInfo* cluster = stream->cluster;
+    struct pollfd fds[cluster->len];
+    parseArgv* nodes[cluster->len];
+    int i,count = 0;
+    for(i=0;i<cluster->len;i++){
+        parseArgv* node = cluster->parse[i];
+        if(node->stream_first >= 0 && node->context != NULL){
+            fds[count].fd = node->context->fd;
+            fds[count].events = POLLIN;
+            fds[count].revents = 0;
+            nodes[count++] = node;
+        }
+    }
+    if(count == 0 || poll(fds,count,0) <= 0)
+        return;
+    for(i=0;i<count;i++){
+        if(fds[i].revents == 0)
+            continue;
+        if(redisBufferRead(nodes[i]->context) != REDIS_OK){
+            __stream_fail(stream,nodes[i]);
+            continue;
+        }
+        while(__stream_read(stream,nodes[i],0) == 1)
+            ;
+    }
+}
+
+/*
+*the connection of the node broke, every command in flight on it completes without a reply.
+*/
+static void __stream_fail(clusterStream* stream,parseArgv* node){
+    long long seq = node->stream_first;
+    while(seq >= 0){
+        streamEntry* entry = &stream->entries[seq & (stream->capacity-1)];
+        entry->done = 1;
+        seq = entry->next;
+    }
+    if(node->stream_first >= 0)
+        printf("connection to ip=%s, port=%d lost with commands in flight\n",node->ip,node->port);
+    node->stream_first = -1;
+    node->stream_last = -1;
+    node->pipe_pending = 0;
+}
+
+int cluster_stream_setn(clusterStream* stream,const char* key,size_t keylen,const char* value,size_t valuelen){
+    if(stream == NULL || key == NULL || value == NULL){
+        printf("NULL pointer %s %d\n",__FILE__,__LINE__);
+        return -1;
+    }
+    const char* argv[3] = {"set",key,value};
+    size_t argvlen[3] = {3,keylen,valuelen};
+    return __stream_submit(stream,keyHashSlot(key,keylen),0,3,argv,argvlen);
+}
+
+int cluster_stream_getn(clusterStream* stream,const char* key,size_t keylen){
+    if(stream == NULL || key == NULL){
+        printf("NULL pointer %s %d\n",__FILE__,__LINE__);
+        return -1;
+    }
+    const char* argv[2] = {"get",key};
+    size_t argvlen[2] = {3,keylen};
+    return __stream_submit(stream,keyHashSlot(key,keylen),1,2,argv,argvlen);
+}
+
+int cluster_stream_command_argv(clusterStream* stream,int argc,const char** argv,const size_t* argvlen,int dbnum){
+    if(stream == NULL || argv == NULL || argc <= 0){
+        printf("invalid arguments %s %d\n",__FILE__,__LINE__);
+        return -1;
+    }
+    routedCommand routed;
+    if(cluster_route_argv(argc,argv,argvlen,dbnum,&routed) < 0)
+        return -1;
+    int re = __stream_submit(stream,routed.slot,routed.read,routed.argc,routed.argv,routed.argvlen);
+    cluster_route_release(&routed);
+    return re;
+}
+
+int cluster_stream_flush(clusterStream* stream){
+    if(stream == NULL){
+        printf("NULL pointer %s %d\n",__FILE__,__LINE__);
+        return -1;
+    }
+    //the layout doesn't change while commands are in flight, so every node they went to is in parse
+    clusterInfo* cluster = stream->cluster;
+    int i;
+    int re = 0;
+    for(i=0;i<cluster->len;i++){
+        if(cluster->parse[i]->stream_first >= 0 && __stream_flush_node(stream,cluster->parse[i]) != 0)
+            re = -1;
+    }
+    return re;
+}
+
+int cluster_stream_next(clusterStream* stream,redisReply** reply,int wait){
+    if(stream == NULL || reply == NULL){
+        printf("NULL pointer %s %d\n",__FILE__,__LINE__);
+        return 0;
+    }
+    *reply = NULL;
+    __stream_follow_moved(stream);
+    if(stream->head == stream->tail)
+        return 0;
+
+    streamEntry* entry = &stream->entries[stream->head & (stream->capacity-1)];
+    if(!entry->done){
+        if(wait)
+            cluster_stream_flush(stream);
+        else
+            __stream_flush_idle(stream);
+        if(wait){
+            while(!entry->done)
+                __stream_read(stream,entry->node,1);
+        }else{
+            //take whatever the nodes have sent, replies behind the oldest one are kept for later
+            while(__stream_read(stream,entry->node,0) == 1 && !entry->done)
+                ;
+            if(!entry->done){
+                __stream_poll(stream);
+                if(!entry->done)
+                    return 0;
+            }
+        }
+    }
+    *reply = entry->reply;
+    stream->head++;
+    return 1;
+}
+
+long long cluster_stream_pending(clusterStream* stream){
+    return stream == NULL ? 0 : stream->tail - stream->head;
+}
+
+void cluster_stream_close(clusterStream* stream){
+    if(stream == NULL)
+        return;
+    redisReply* reply;
+    while(cluster_stream_next(stream,&reply,1) == 1){
+        if(reply != NULL)
+            freeReplyObject(reply);
+    }
+    free(stream->entries);
+    free(stream);
+}
@@ -7,9 +7,10 @@
 #include <assert.h>
 #include <hiredis/hiredis.h>
 #include <stdbool.h>
+#include "topology.h"
 /*
-*parseArgv represents one single redis instance in a redis cluster.It's simply a formatted version of one line of the response of cluster nodes
-*
+*parseArgv represents one single redis instance in a redis cluster as seen by one clusterInfo. The layout of the
+*instance is kept in the shared topologyNode, parseArgv only keeps the connection and the pipeline state.
 */
 #define PIPE_OPEN 1
 #define PIPE_CLOSE 0
@@ -23,67 +24,237 @@ typedef struct parseArgv{
     int port;
     //one connection per instance
     redisContext * context;
-    //the instance have an starting slot and an ending slot.
-    int start_slot;
-    int end_slot;
-    
-    //if slots[i] equals 1, it means this instance owns that slot,otherwise the instance doesn't own the slot.
-    char slots[16384];
     //either be PIPE_OPEN or PIPE_CLOSE 
     int pipe_mode;
     //how many replies to get
     int pipe_pending;
+    //index in the clusterPipe of the next reply expected from the instance, -1 if none
+    int pipe_next;
+    //1 if the instance is a replica, READONLY is sent as soon as it is connected
+    int readonly;
+    //moving average of the response time in microseconds, 0 until the first reply
+    double latency_us;
+    //commands sent to the instance whose reply has not been read yet
+    int outstanding;
+    //1 once a replica refused the connection or READONLY, it is skipped until the next refresh
+    int unreachable;
+    //oldest and newest command of the clusterStream still waiting for a reply from the instance, -1 if none
+    long long stream_first;
+    long long stream_last;
+    //newest command of the clusterStream written to the socket, -1 if none
+    long long stream_sent;
 
 }parseArgv;
 
+/*
+*where reads (get, cluster_pipeline_get) are sent, writes always go to the master.
+*READ_MASTER_ONLY: the master of the slot, replicas are not connected at all
+*READ_PREFER_REPLICA: one of the replicas of the slot, rotating among them, the master if none is reachable
+*READ_ROUND_ROBIN: the master and its replicas in turn
+*READ_LOWEST_LATENCY: the better of two random replicas, by latency_us*(outstanding+1)
+*READ_CUSTOM: whatever the readPolicyCallback given to set_read_callback returns
+*/
+#define READ_MASTER_ONLY 0
+#define READ_PREFER_REPLICA 1
+#define READ_ROUND_ROBIN 2
+#define READ_LOWEST_LATENCY 3
+#define READ_CUSTOM 4
+
+/*
+*chooses the instance serving a read of the slot. candidates[0] is the master, the connected
+*replicas follow, count >= 1. Returning NULL sends the read to the master.
+*/
+struct clusterInfo;
+typedef parseArgv* (*readPolicyCallback)(struct clusterInfo* cluster,int slot,parseArgv** candidates,int count,void* privdata);
+
 /*
 *this structure contains all the information needed to communicate with a redis cluster.
+*the slot map lives in a clusterTopology shared by every clusterInfo connected through the same seed,
+*a clusterInfo only keeps its own connections.
 *
 */
 typedef struct clusterInfo{
     //size of the cluster
     int len;
-    //one line of information from the response of cluster nodes
-    char * argv[500];
-    //formatted version of the above information
-    parseArgv* parse[500];
-    //each slot points to a redis instance, a redis instance is represented by a parseArgv structure.
-    void * slot_to_host[16384];
-    //globalContext is used to send 'cluster nodes' and receive the response
-    redisContext* globalContext;
+    //parse[i] holds the connection to topology->nodes[i], len entries
+    parseArgv** parse;
+    //the shared snapshot this client is currently routing with
+    clusterTopology* topology;
+    //where new snapshots are published
+    topologyEntry* entry;
+    //1 if nodes are connected on the first command routed to them, see connectRedisLazy
+    int lazy;
+    //how long connecting to the nodes may take, all of them together when they are connected at once
+    int connect_timeout_ms;
+    //one of the READ_ policies, READ_MASTER_ONLY by default
+    int read_policy;
+    //rotates reads among the replicas of a slot
+    unsigned int read_counter;
+    //used by READ_CUSTOM
+    readPolicyCallback read_callback;
+    void* read_privdata;
 }clusterInfo;
 
 /*
 *use a single ip and port to connect to a redis cluster.
 *this function use the single ip and port to connect to one redis instance in the redis cluster,
-*send the command 'cluster nodes',receive the response, construct clusterInfo, and the we are free to use set and get
+*send the command 'cluster slots',receive the response, construct clusterInfo, and the we are free to use set and get
+*the layout is fetched only by the first client of a seed address, the others share it.
 */
 clusterInfo* connectRedis(char*ip,int port);
-int set(clusterInfo* cluster,const char *key, char *set_in_value,int dunum,int tid);
-int get(clusterInfo*cluster, const char *key, char *get_in_value, int dbnum,int tid);
-void disconnectDatabase(clusterInfo* cluster);
-int flushDb(clusterInfo* cluster);
+/*
+*same as connectRedis, but only the seed is contacted here. Every other node is connected by the
+*first command routed to it, so a short-lived process pays for the nodes it actually uses.
+*/
+clusterInfo* connectRedisLazy(char*ip,int port);
+/*
+*same as connectRedis, the nodes are connected in parallel and the whole setup gives up after
+*timeout_ms. Nodes which could not be connected are reported one by one and retried on first use.
+*/
+clusterInfo* connectRedisWithTimeout(char*ip,int port,int timeout_ms);
+/*
+*fetch the cluster layout again and publish it to every clusterInfo connected through the same seed.
+*the other clients move to the new layout before their next command.
+*/
+int cluster_refresh_topology(clusterInfo* cluster);
+/*
+*poll the cluster layout from a background thread every interval_ms, and right away once redirects
+*or unreachable nodes pile up. A new layout is published only if it changed, clients move to it
+*before their next command without waiting for the refresh. The refresher is shared by every
+*clusterInfo connected through the same seed and stops with the last of them.
+*/
+int start_topology_refresher(clusterInfo* cluster,int interval_ms);
+void stop_topology_refresher(clusterInfo* cluster);
+/*
+*choose where reads go, see READ_MASTER_ONLY and friends. Replicas are connected, with READONLY,
+*when a policy other than READ_MASTER_ONLY is set. returns 0 on success.
+*/
+int set_read_policy(clusterInfo* cluster,int policy);
+/*
+*route reads through a callback of the user, the policy becomes READ_CUSTOM.
+*/
+int set_read_callback(clusterInfo* cluster,readPolicyCallback callback,void* privdata);
+/*
+*set and get keep no state between calls and can be used from any number of threads, each thread
+*with its own clusterInfo.
+*/
+int set(clusterInfo* cluster,const char *key, char *set_in_value,int dunum);
+int get(clusterInfo*cluster, const char *key, char *get_in_value, int dbnum);
+/*
+*binary-safe set and get, key and value are keylen and valuelen bytes and may contain '\0'.
+*getn copies the value into value, which holds capacity bytes, and stores its length in valuelen.
+*setn returns 0 on success. getn returns 0 if the key was found, 1 if it doesn't exist and -1 on
+*errors, or when the value is longer than capacity, valuelen then tells how much room it needs.
+*/
+int setn(clusterInfo* cluster,const char* key,size_t keylen,const char* value,size_t valuelen,int dbnum);
+int getn(clusterInfo* cluster,const char* key,size_t keylen,char* value,size_t capacity,size_t* valuelen,int dbnum);
+/*
+*a value read by get_view, str points len bytes into the reply hiredis parsed, nothing is copied.
+*str stays valid until release_view, which frees the reply.
+*/
+typedef struct replyView{
+    const char* str;
+    size_t len;
+    redisReply* reply;
+}replyView;
+/*
+*GET without copying the value. returns 0 if the key was found, view then has to be handed to
+*release_view, 1 if it doesn't exist and -1 on errors. In the last two cases nothing is held.
+*/
+int get_view(clusterInfo* cluster,const char* key,size_t keylen,replyView* view,int dbnum);
+void release_view(replyView* view);
+/*
+*a db number prepared once for many commands: the "<db>\b" prefix set and get put in front of
+*every key, and the crc16 of that prefix. The slot of a key is hashed on from prefix_crc and the
+*prefix is written straight into the command, so a command only touches the bytes of the key.
+*Keys stored through a namespace are the keys of set/get/setn/getn with the same dbnum.
+*/
+typedef struct clusterNamespace{
+    int dbnum;
+    char prefix[16];
+    int prefix_len;
+    uint16_t prefix_crc;
+}clusterNamespace;
 
+clusterNamespace* get_namespace(int dbnum);
+void release_namespace(clusterNamespace* ns);
+//setn, getn and get_view inside a namespace, they return the same values
+int namespace_set(clusterInfo* cluster,const clusterNamespace* ns,const char* key,size_t keylen,const char* value,size_t valuelen);
+int namespace_get(clusterInfo* cluster,const clusterNamespace* ns,const char* key,size_t keylen,
+                  char* value,size_t capacity,size_t* valuelen);
+int namespace_get_view(clusterInfo* cluster,const clusterNamespace* ns,const char* key,size_t keylen,replyView* view);
+/*
+*multi-key commands for keys which hash to one slot, normally because they share a {hash tag}
+*such as user:{42}:name and user:{42}:mail. The keys are sent with a single MGET or MSET to the
+*node serving the slot. values[i], valuelens[i] and status[i] of cluster_slot_mget are filled like
+*those of cluster_mget below. returns 0 on success, -1 on errors, if the keys are in different slots
+*or if a value didn't fit.
+*/
+int cluster_slot_mget(clusterInfo* cluster,const char** keys,int count,char** values,size_t capacity,
+                      size_t* valuelens,int* status,int dbnum);
+int cluster_slot_mset(clusterInfo* cluster,const char** keys,const char** values,int count,int dbnum);
+/*
+*the same for keys anywhere in the cluster. The keys are split by slot, every node gets one MGET or
+*MSET per slot it serves, and all nodes are sent their commands before any reply is read, so the
+*call takes about one round trip to the slowest node. cluster_mset is atomic per slot only.
+*cluster_mget fills values[i], valuelens[i] and status[i] for keys[i] the way getn fills value and
+*valuelen and returns: status[i] is 0 if the key was found, 1 if it doesn't exist and -1 if its slot
+*failed or the value is longer than capacity. Both return 0 on success, -1 if any slot failed or,
+*for cluster_mget, any value didn't fit.
+*/
+int cluster_mget(clusterInfo* cluster,const char** keys,int count,char** values,size_t capacity,
+                 size_t* valuelens,int* status,int dbnum);
+int cluster_mset(clusterInfo* cluster,const char** keys,const char** values,int count,int dbnum);
 /*
-*getspace and set space are initialized using init_global. currently there are 100 slot. each call to set or get method with their tid 
-*should get their share of the allocated space, without the need to allocated space for every call to set and get.
+*send any command of the key table (DEL, INCRBY, EXPIRE, HSET, LPUSH, ZADD and most other single
+*slot commands) to the node serving its keys, replies like MOVED are handled as for get and set.
+*argvlen may be NULL for NUL terminated arguments. The keys are prefixed with dbnum the way set and
+*get store them, a negative dbnum sends them as they are. Keys of one command have to share a slot.
+*returns the reply, to be freed with freeReplyObject, NULL if the command could not be routed or sent.
 */
-typedef struct getspace{
-     char * getKey;
-     int used;
-}getspace;
+redisReply* cluster_command_argv(clusterInfo* cluster,int argc,const char** argv,const size_t* argvlen,int dbnum);
+/*
+*a command routed by cluster_route_argv. argv and argvlen are the arguments with the keys prefixed with
+*the db number. Up to ROUTE_INLINE_ARGS arguments are kept in the struct itself and longer commands on
+*the heap, so it can live on the stack whatever argc the caller gives.
+*/
+#define ROUTE_INLINE_ARGS 16
 
-typedef struct setspace{
-     char* setKey;
-     int used;
-}setspace;
+typedef struct routedCommand{
+    int argc;
+    const char** argv;
+    size_t* argvlen;
+    int slot;
+    //1 if a replica may serve the command
+    int read;
+    //the prefixed keys
+    char* arena;
+    const char* inline_argv[ROUTE_INLINE_ARGS];
+    size_t inline_argvlen[ROUTE_INLINE_ARGS];
+}routedCommand;
 
-getspace global_getspace[100];
-setspace global_setspace[100];
+/*
+*the routing of cluster_command_argv without sending anything, for clients built on other connections.
+*returns the slot, -1 for unknown commands, wrong arity or keys in different slots. Once it succeeded
+*the command has to be freed with cluster_route_release, nothing is left to free when it fails.
+*/
+int cluster_route_argv(int argc,const char** argv,const size_t* argvlen,int dbnum,routedCommand* routed);
+void cluster_route_release(routedCommand* routed);
+/*
+*plan a fan-out in one pass: slots[i] gets the slot of keys[i] and, if nodes is not NULL, nodes[i] the
+*index in cluster->parse of the node serving it, -1 if no node does. lens may be NULL for NUL terminated
+*keys, the keys are hashed as they are, without the db prefix of set and get.
+*If order is not NULL, it receives the key indices grouped by node, in ascending node order and in the
+*original order inside a group. The group of node n is order[node_start[n]] to order[node_start[n+1]-1],
+*node_start[cluster->len] starts the keys no node serves, so node_start needs cluster->len+2 entries
+*and nodes must be given as well. Node indices hold until the next command moves the client to a newer
+*layout. returns 0 on success, -1 on errors.
+*/
+int cluster_keys_to_slots(clusterInfo* cluster,const char** keys,const int* lens,int count,
+                          uint16_t* slots,int* nodes,int* order,int* node_start);
+void disconnectDatabase(clusterInfo* cluster);
+int flushDb(clusterInfo* cluster);
 
-//these two functions are for testing purposes
-void init_global();
-int release_global();
 /*
 *use singleContext to connect to one redis instance.and use the conresponding functions to try pipeline with single redis instance. This structure does not 
 *support redis cluster.
@@ -101,6 +272,8 @@ typedef struct singleClient{
 singleClient* single_connect(int port,const char* ip);
 void pipe_set(singleClient*sc, char*key, char*value);
 void pipe_get(singleClient*sc, char*key);
+void pipe_setn(singleClient*sc,const char*key,size_t keylen,const char*value,size_t valuelen);
+void pipe_getn(singleClient*sc,const char*key,size_t keylen);
 void pipe_getReply(singleClient*sc,char* revalue);
 void pipe_getAllReply(singleClient*sc);
 void single_disconnect(singleClient* sc);
@@ -114,7 +287,11 @@ void single_disconnect(singleClient* sc);
 *everytime we can get_reply, we get an redisReply*, and store it in pipe_reply_buffer[cur_index]
 *
 */
-#define MAX_PIPE_COUNT 100
+//default for clusterInfo->connect_timeout_ms
+#define CONNECT_TIMEOUT_MS 2000
+
+//room of a new clusterPipe, set_pipeline_count grows it for larger counts
+#define PIPE_INITIAL_CAPACITY 100
 typedef struct clusterPipe{
 //preset the total number of pipeline operations 
     int pipe_count;
@@ -124,15 +301,19 @@ typedef struct clusterPipe{
 //we get the replies from pipe_reply_buffer, using front and end pointers
     int reply_index_front;
     int reply_index_end;
+//number of commands the three arrays below have room for
+    int capacity;
 
-    int send_slot[MAX_PIPE_COUNT];
+    int* send_slot;
 //one pipeline buffer for one cluster
     clusterInfo* cluster;
 //one parseArgv struct represents one host in the cluster,if we send the first command through host_1, then sending_queue[0] points to host_1
-    parseArgv* sending_queue[MAX_PIPE_COUNT];
+    parseArgv** sending_queue;
 //each pointer points to a reply, we send the the first command through host_1, then send_queue[0] points to host_1, so we get a reply through host_1, and pipe_reply_buffer[0] points to 
 //the first reply, thus getting the replies in order
-    redisReply* pipe_reply_buffer[MAX_PIPE_COUNT];
+    redisReply** pipe_reply_buffer;
+//next_same[i] is the next command sent to the same host as command i, -1 for its last one
+    int* next_same;
 }clusterPipe;
 
 typedef struct clusterPipelineReply{
@@ -141,12 +322,21 @@ typedef struct clusterPipelineReply{
 
 //initialize a pipeline structure
 clusterPipe* get_pipeline();
+/*
+*the number of commands of the next transaction, any n >= 0. The pipeline grows to n if it has
+*less room, bulk loads can use counts in the thousands to pay for one round trip per batch.
+*/
 int set_pipeline_count(clusterPipe* mypipe,int n);
 int bind_pipeline_to_cluster(clusterInfo* cluster, clusterPipe* mypipe);
 
 //after setting the pipeline, these two functions can be used to issue set/get commands
 int cluster_pipeline_set(clusterInfo *cluster,clusterPipe *mypipe,char *key,char *value );
 int cluster_pipeline_get(clusterInfo *cluster,clusterPipe *mypipe,char *key);
+//binary-safe versions of the two above
+int cluster_pipeline_setn(clusterInfo *cluster,clusterPipe *mypipe,const char *key,size_t keylen,const char *value,size_t valuelen);
+int cluster_pipeline_getn(clusterInfo *cluster,clusterPipe *mypipe,const char *key,size_t keylen);
+//cluster_command_argv in the pipeline, its reply comes back in order like the others
+int cluster_pipeline_command_argv(clusterInfo *cluster,clusterPipe *mypipe,int argc,const char** argv,const size_t* argvlen,int dbnum);
 
 
 //get one reply from the pipeline buffer
@@ -160,6 +350,72 @@ int reset_pipeline_count(clusterPipe* mypipe, int n);
 
 int release_pipeline(clusterPipe* mypipe);
 
+/*
+*a pipeline without batch boundaries. Commands are submitted one at a time and their replies are
+*taken back in submission order whenever the caller likes, so the nodes always have work queued.
+*At most window commands are in flight on each node, submitting to a full node first reads that
+*node's oldest reply into the stream, where it waits for cluster_stream_next.
+*A cluster runs one stream at a time, clusterPipe and the blocking commands must not be used on
+*it while the stream has commands in flight.
+*/
+#define STREAM_DEFAULT_WINDOW 64
+//room of a new clusterStream, it doubles when more commands are submitted than handed out
+#define STREAM_INITIAL_CAPACITY 256
+//the commands buffered for a node are written to its socket once they take this many bytes
+#define STREAM_FLUSH_BYTES 16384
+
+typedef struct streamEntry{
+    //the instance the command was sent to
+    parseArgv* node;
+    //NULL until the reply is read, and for good if the connection broke first
+    redisReply* reply;
+    //1 once the reply is read or the connection broke
+    int done;
+    //the next command sent to the same instance, -1 if none yet
+    long long next;
+}streamEntry;
+
+typedef struct clusterStream{
+    clusterInfo* cluster;
+    //commands in flight per node
+    int window;
+    //ring of the commands not handed out yet, entry seq is entries[seq & (capacity-1)]
+    streamEntry* entries;
+    long long capacity;
+    //sequence number of the oldest command not handed out yet and of the next one submitted
+    long long head;
+    long long tail;
+    /*
+    *the target of the last MOVED reply read, -1 as moved_slot if there is none. Patching the layout
+    *may free parseArgv that are still in use while replies are read, so it waits for the next
+    *command or the next cluster_stream_next. An earlier MOVED overwritten here is simply seen again.
+    */
+    int moved_slot;
+    int moved_port;
+    char moved_ip[64];
+}clusterStream;
+
+//a stream on the cluster with the given window per node, STREAM_DEFAULT_WINDOW if window <= 0
+clusterStream* cluster_stream_open(clusterInfo* cluster,int window);
+//a smaller window takes effect as the nodes drain below it
+int set_stream_window(clusterStream* stream,int window);
+//the stream counterparts of cluster_pipeline_setn/getn/command_argv, 0 once the command is queued
+int cluster_stream_setn(clusterStream* stream,const char* key,size_t keylen,const char* value,size_t valuelen);
+int cluster_stream_getn(clusterStream* stream,const char* key,size_t keylen);
+int cluster_stream_command_argv(clusterStream* stream,int argc,const char** argv,const size_t* argvlen,int dbnum);
+//write every buffered command to its node without waiting for replies
+int cluster_stream_flush(clusterStream* stream);
+/*
+*the reply of the oldest command not handed out yet. wait=1 blocks until it arrives, wait=0 only
+*takes what the nodes have already sent. returns 1 and sets *reply, NULL if the connection of the
+*command broke, or 0 if there is nothing to hand out. The caller frees the reply.
+*/
+int cluster_stream_next(clusterStream* stream,redisReply** reply,int wait);
+//commands submitted and not handed out yet
+long long cluster_stream_pending(clusterStream* stream);
+//wait for every command still in flight, drop the replies and free the stream
+void cluster_stream_close(clusterStream* stream);
+
 
 
 #endif
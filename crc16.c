@@ -1,5 +1,6 @@
 #include "crc16.h"
 #include<stdint.h>
+#include<string.h>
 /*      
  * Copyright 2001-2010 Georges Menie (www.menie.org)
  * Copyright 2010-2012 Salvatore Sanfilippo (adapted to Redis coding style)
@@ -79,10 +80,265 @@ static const uint16_t crc16tab[256]= {
     0x6e17,0x7e36,0x4e55,0x5e74,0x2e93,0x3eb2,0x0ed1,0x1ef0
 };
   
-uint16_t crc16(const char *buf, int len){ 
+/* The original byte at a time loop, kept as the reference the faster kernels
+ * are checked against. */
+uint16_t crc16_bytewise(const char *buf, int len){ 
     int counter;
     uint16_t crc = 0;
     for (counter = 0; counter < len; counter++)
             crc = (crc<<8) ^ crc16tab[((crc>>8) ^ *buf++)&0x00FF];
     return crc;
 }
+
+/* Slicing tables: crc16slice[k][b] is the CRC of byte b followed by k zero
+ * bytes, so eight input bytes can be folded with eight independent lookups
+ * instead of eight dependent ones. crc16slice[0] is crc16tab. */
+static uint16_t crc16slice[8][256];
+
+/* One slicing-by-8 step. */
+#define CRC16_SLICE8_STEP(crc,p) \
+    (crc16slice[7][(p)[0] ^ ((crc)>>8)] ^ crc16slice[6][(p)[1] ^ ((crc)&0xff)] ^ \
+     crc16slice[5][(p)[2]] ^ crc16slice[4][(p)[3]] ^ \
+     crc16slice[3][(p)[4]] ^ crc16slice[2][(p)[5]] ^ \
+     crc16slice[1][(p)[6]] ^ crc16slice[0][(p)[7]])
+
+static uint16_t __crc16_slice8(uint16_t crc, const unsigned char *p, int len);
+#if defined(__x86_64__) || defined(__i386__)
+static uint16_t __crc16_clmul(uint16_t crc, const unsigned char *p, int len);
+static void __crc16_clmul_x4(const unsigned char **p, int *len, uint16_t *crc);
+#endif
+static uint16_t (*crc16_long)(uint16_t crc, const unsigned char *p, int len) = __crc16_slice8;
+
+/* Below this length the carry-less multiply path has nothing to fold. */
+#define CRC16_CLMUL_MIN 32
+
+/* Fill the slicing tables and pick the kernel for long keys once, before
+ * main() runs, so crc16() needs neither a lock nor an init call. */
+__attribute__((constructor)) static void __crc16_init(void){
+    int b, k;
+    for (b = 0; b < 256; b++) crc16slice[0][b] = crc16tab[b];
+    for (k = 1; k < 8; k++) {
+        for (b = 0; b < 256; b++) {
+            uint16_t prev = crc16slice[k-1][b];
+            crc16slice[k][b] = (prev<<8) ^ crc16tab[prev>>8];
+        }
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3"))
+        crc16_long = __crc16_clmul;
+#endif
+}
+
+static uint16_t __crc16_slice8(uint16_t crc, const unsigned char *p, int len){
+    while (len >= 8) {
+        crc = CRC16_SLICE8_STEP(crc,p);
+        p += 8;
+        len -= 8;
+    }
+    if (len >= 4) {
+        crc = crc16slice[3][p[0] ^ (crc>>8)] ^ crc16slice[2][p[1] ^ (crc&0xff)] ^
+              crc16slice[1][p[2]] ^ crc16slice[0][p[3]];
+        p += 4;
+        len -= 4;
+    }
+    while (len--)
+        crc = (crc<<8) ^ crc16tab[(crc>>8) ^ *p++];
+    return crc;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/* Fold the key 16 bytes at a time with carry-less multiplies. A block X
+ * followed by 128 more bits is worth X*x^128, which is congruent mod P to
+ * hi64(X)*(x^192 mod P) + lo64(X)*(x^128 mod P), both at most 79 bits wide,
+ * so the running remainder always fits in one register. What is left, the
+ * last folded block and the tail, goes through the slicing tables, which do
+ * the final reduction to 16 bits. */
+/* bytes are loaded most significant first, the CRC is not reflected */
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i __clmul_load(const unsigned char *p){
+    const __m128i bswap = _mm_set_epi8(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15);
+    return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)p),bswap);
+}
+
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i __clmul_fold(__m128i x, const unsigned char *p){
+    /* x^192 mod P in the high lane, x^128 mod P in the low lane */
+    const __m128i k = _mm_set_epi64x(0x650b,0xaefc);
+    __m128i hi = _mm_clmulepi64_si128(x,k,0x11);
+    __m128i lo = _mm_clmulepi64_si128(x,k,0x00);
+    return _mm_xor_si128(_mm_xor_si128(hi,lo),__clmul_load(p));
+}
+
+__attribute__((target("pclmul,ssse3")))
+static inline uint16_t __clmul_finish(__m128i x, const unsigned char *p, int len){
+    const __m128i bswap = _mm_set_epi8(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15);
+    unsigned char folded[16];
+    _mm_storeu_si128((__m128i*)folded,_mm_shuffle_epi8(x,bswap));
+    return __crc16_slice8(__crc16_slice8(0,folded,16),p,len);
+}
+
+__attribute__((target("pclmul,ssse3")))
+static uint16_t __crc16_clmul(uint16_t crc, const unsigned char *p, int len){
+    if (len < CRC16_CLMUL_MIN)
+        return __crc16_slice8(crc,p,len);
+
+    __m128i x = __clmul_load(p);
+    x = _mm_xor_si128(x,_mm_set_epi64x((long long)((unsigned long long)crc<<48),0));
+    p += 16;
+    len -= 16;
+    while (len >= 16) {
+        x = __clmul_fold(x,p);
+        p += 16;
+        len -= 16;
+    }
+    return __clmul_finish(x,p,len);
+}
+
+/* Four keys of at least CRC16_CLMUL_MIN bytes folded side by side. Every fold
+ * waits for the multiplies of the previous one of the same key, the other
+ * keys keep the multiplier busy meanwhile. */
+__attribute__((target("pclmul,ssse3")))
+static void __crc16_clmul_x4(const unsigned char **p, int *len, uint16_t *crc){
+    __m128i x0 = __clmul_load(p[0]), x1 = __clmul_load(p[1]);
+    __m128i x2 = __clmul_load(p[2]), x3 = __clmul_load(p[3]);
+    const unsigned char *p0 = p[0]+16, *p1 = p[1]+16, *p2 = p[2]+16, *p3 = p[3]+16;
+    int l0 = len[0]-16, l1 = len[1]-16, l2 = len[2]-16, l3 = len[3]-16;
+    while (l0 >= 16 && l1 >= 16 && l2 >= 16 && l3 >= 16) {
+        x0 = __clmul_fold(x0,p0);
+        x1 = __clmul_fold(x1,p1);
+        x2 = __clmul_fold(x2,p2);
+        x3 = __clmul_fold(x3,p3);
+        p0 += 16; p1 += 16; p2 += 16; p3 += 16;
+        l0 -= 16; l1 -= 16; l2 -= 16; l3 -= 16;
+    }
+    for (; l0 >= 16; l0 -= 16, p0 += 16) x0 = __clmul_fold(x0,p0);
+    for (; l1 >= 16; l1 -= 16, p1 += 16) x1 = __clmul_fold(x1,p1);
+    for (; l2 >= 16; l2 -= 16, p2 += 16) x2 = __clmul_fold(x2,p2);
+    for (; l3 >= 16; l3 -= 16, p3 += 16) x3 = __clmul_fold(x3,p3);
+    crc[0] = __clmul_finish(x0,p0,l0);
+    crc[1] = __clmul_finish(x1,p1,l1);
+    crc[2] = __clmul_finish(x2,p2,l2);
+    crc[3] = __clmul_finish(x3,p3,l3);
+}
+
+int crc16_has_clmul(void){
+    return crc16_long == __crc16_clmul;
+}
+
+uint16_t crc16_clmul(const char *buf, int len){
+    return __crc16_clmul(0,(const unsigned char*)buf,len);
+}
+#else
+int crc16_has_clmul(void){
+    return 0;
+}
+
+uint16_t crc16_clmul(const char *buf, int len){
+    return __crc16_slice8(0,(const unsigned char*)buf,len);
+}
+#endif
+
+uint16_t crc16_slice8(const char *buf, int len){
+    return __crc16_slice8(0,(const unsigned char*)buf,len);
+}
+
+/* The part of a key that is hashed: what is between the first { and the
+ * following } if that is not empty, the whole key otherwise. */
+static void __hash_tag(const char **key, int *keylen){
+    /* memchr scans a word or a vector at a time, most keys have no tag at all */
+    const char *s = memchr(*key,'{',*keylen);
+    if (s == NULL) return;
+    const char *e = memchr(s+1,'}',*keylen-(s+1-*key));
+    if (e == NULL || e == s+1) return;
+    *key = s+1;
+    *keylen = e-s-1;
+}
+
+/* Slots of many keys at once. Four keys are hashed side by side, their table
+ * lookups don't depend on each other so the CPU overlaps them, while a single
+ * CRC waits for every lookup before starting the next. Keys long enough for
+ * the carry-less multiply kernel go through it one by one. keylens may be
+ * NULL for NUL terminated keys. */
+void keyHashSlots(const char **keys, const int *keylens, int count, uint16_t *slots){
+    int i = 0;
+    for (; i+4 <= count; i += 4) {
+        const unsigned char *p[4];
+        int len[4], j;
+        uint16_t crc[4];
+        for (j = 0; j < 4; j++) {
+            const char *key = keys[i+j];
+            int keylen = keylens ? keylens[i+j] : (int)strlen(key);
+            __hash_tag(&key,&keylen);
+            p[j] = (const unsigned char*)key;
+            len[j] = keylen;
+        }
+        int longest = len[0] > len[1] ? len[0] : len[1];
+        int shortest = len[0] < len[1] ? len[0] : len[1];
+        for (j = 2; j < 4; j++) {
+            if (len[j] > longest) longest = len[j];
+            if (len[j] < shortest) shortest = len[j];
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        if (crc16_long == __crc16_clmul && shortest >= CRC16_CLMUL_MIN) {
+            __crc16_clmul_x4(p,len,crc);
+        } else
+#endif
+        if (crc16_long == __crc16_slice8 || longest < CRC16_CLMUL_MIN) {
+            const unsigned char *p0 = p[0], *p1 = p[1], *p2 = p[2], *p3 = p[3];
+            uint16_t c0 = 0, c1 = 0, c2 = 0, c3 = 0;
+            int n;
+            for (n = shortest; n >= 8; n -= 8) {
+                c0 = CRC16_SLICE8_STEP(c0,p0);
+                c1 = CRC16_SLICE8_STEP(c1,p1);
+                c2 = CRC16_SLICE8_STEP(c2,p2);
+                c3 = CRC16_SLICE8_STEP(c3,p3);
+                p0 += 8; p1 += 8; p2 += 8; p3 += 8;
+            }
+            n = shortest - n;
+            crc[0] = __crc16_slice8(c0,p0,len[0]-n);
+            crc[1] = __crc16_slice8(c1,p1,len[1]-n);
+            crc[2] = __crc16_slice8(c2,p2,len[2]-n);
+            crc[3] = __crc16_slice8(c3,p3,len[3]-n);
+        } else {
+            for (j = 0; j < 4; j++)
+                crc[j] = crc16((const char*)p[j],len[j]);
+        }
+        for (j = 0; j < 4; j++)
+            slots[i+j] = crc[j] & 0x3FFF;
+    }
+    for (; i < count; i++)
+        slots[i] = keyHashSlot(keys[i],keylens ? keylens[i] : (int)strlen(keys[i]));
+}
+
+uint16_t crc16(const char *buf, int len){ 
+    return crc16_update(0,buf,len);
+}
+
+uint16_t crc16_update(uint16_t crc, const char *buf, int len){
+    if (len < CRC16_CLMUL_MIN)
+        return __crc16_slice8(crc,(const unsigned char*)buf,len);
+    return crc16_long(crc,(const unsigned char*)buf,len);
+}
+
+/* Map a key to its cluster slot. If the key contains a {...} pattern with at
+ * least one character between the braces, only that part is hashed, so keys
+ * sharing a hash tag are guaranteed to live on the same node. This is the same
+ * rule the Redis server applies. */
+int keyHashSlot(const char *key, int keylen){
+    __hash_tag(&key,&keylen);
+    return crc16(key,keylen) & 0x3FFF;
+}
+
+/* The prefix has no '{', so the first '{' of the whole key is the first one
+ * of the part after the prefix: a tag found there is hashed alone, exactly
+ * as keyHashSlot would do it, otherwise the hash carries on from the prefix. */
+int keyHashSlotPrefixed(uint16_t prefix_crc, const char *key, int keylen){
+    const char *tag = key;
+    __hash_tag(&tag,&keylen);
+    if (tag != key)
+        return crc16(tag,keylen) & 0x3FFF;
+    return crc16_update(prefix_crc,key,keylen) & 0x3FFF;
+}
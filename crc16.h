@@ -1,2 +1,21 @@
 #include<stdint.h>
 uint16_t crc16(const char *buf, int len); 
+//the cluster slot of a key, honouring {hash tags}
+int keyHashSlot(const char *key, int keylen);
+/*
+*the kernels behind crc16, exposed for benchmarks and checks. crc16 uses slicing-by-8 for short keys
+*and, on CPUs with PCLMULQDQ, carry-less multiply folding for keys of 32 bytes and more.
+*/
+uint16_t crc16_bytewise(const char *buf, int len);
+uint16_t crc16_slice8(const char *buf, int len);
+uint16_t crc16_clmul(const char *buf, int len);
+int crc16_has_clmul(void);
+/*
+*continue a crc16 over more bytes, crc16_update(crc16(a,n),b,m) is the crc16 of a followed by b.
+*keyHashSlotPrefixed is keyHashSlot of a key stored behind a prefix without '{', given the crc16
+*of the prefix, so a constant prefix is hashed once instead of with every key.
+*/
+uint16_t crc16_update(uint16_t crc, const char *buf, int len);
+int keyHashSlotPrefixed(uint16_t prefix_crc, const char *key, int keylen);
+//keyHashSlot for count keys at once, keylens may be NULL for NUL terminated keys
+void keyHashSlots(const char **keys, const int *keylens, int count, uint16_t *slots);
@@ -0,0 +1,609 @@
+#include "shared_connect.h"
+#include "connect.h"
+#include "crc16.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <hiredis/hiredis.h>
+
+//the following are a list of internal function that are not intended to be used outsize this file.
+static sharedNode* __new_shared_node(sharedCluster* cluster,const char* ip,int port);
+static void __free_shared_node(sharedNode* node);
+static sharedNode* __shared_find_node(sharedCluster* cluster,const char* ip,int port);
+static sharedNode* __shared_node(sharedCluster* cluster,const char* ip,int port);
+static sharedNode* __shared_known_node(sharedCluster* cluster,const char* ip,int port);
+static void __shared_sync_topology(sharedCluster* cluster);
+static void __shared_refresh_topology(sharedCluster* cluster);
+static void __shared_note_error(sharedCluster* cluster);
+static void __shared_follow_moved(sharedCluster* cluster,int slot,const char* ip,int port);
+static sharedNode* __shared_route(sharedCluster* cluster,int slot);
+static void __shared_push(sharedNode* node,sharedRequest* req);
+static void __shared_answer(sharedRequest* req,redisReply* reply);
+static int __shared_node_connect(sharedNode* node);
+static void __shared_node_lost(sharedNode* node);
+static int __shared_node_write(sharedNode* node,sharedRequest* batch);
+static int __shared_node_read(sharedNode* node);
+static void* __shared_node_main(void* arg);
+static redisReply* __shared_one_off(sharedCluster* cluster,const char* ip,int port,sharedRequest* req);
+static redisReply* __shared_submit(sharedCluster* cluster,int slot,int argc,const char** argv,const size_t* argvlen);
+
+
+sharedCluster* shared_connect(const char* ip,int port){
+    if(ip == NULL){
+        printf("NULL pointer %s %d\n",__FILE__,__LINE__);
+        return NULL;
+    }
+    topologyEntry* entry = topology_lookup(ip,port);
+    if(entry == NULL)
+        return NULL;
+    clusterTopology* topology = topology_attach(entry);
+    if(topology == NULL){
+        printf("return error in shared_connect\n");
+        return NULL;
+    }
+    //the routing table is built from the entry, the snapshot itself is not kept
+    topology_release(topology);
+
+    sharedCluster* cluster = (sharedCluster*)malloc(sizeof(sharedCluster));
+    if(cluster == NULL){
+        printf("panic! %s %d\n",__FILE__,__LINE__);
+        topology_detach(entry);
+        return NULL;
+    }
+    memset(cluster->slot_to_node,0,sizeof(cluster->slot_to_node));
+    cluster->version = 0;
+    cluster->entry = entry;
+    pthread_mutex_init(&cluster->lock,NULL);
+    cluster->nodes = NULL;
+    cluster->len = 0;
+    cluster->capacity = 0;
+    cluster->connect_timeout_ms = CONNECT_TIMEOUT_MS;
+    cluster->reload = 0;
+    cluster->stopping = 0;
+    __shared_sync_topology(cluster);
+    return cluster;
+}
+
+/*
+*a node and its thread, the connection is made by the thread. returns NULL if the thread can't start.
+*/
+static sharedNode* __new_shared_node(sharedCluster* cluster,const char* ip,int port){
+    sharedNode* node = (sharedNode*)malloc(sizeof(sharedNode));
+    if(node == NULL){
+        printf("panic! %s %d\n",__FILE__,__LINE__);
+        return NULL;
+    }
+    node->ip = (char*)malloc(strlen(ip)+1);
+    strcpy(node->ip,ip);
+    node->port = port;
+    node->cluster = cluster;
+    node->queue = NULL;
+    node->sent_head = NULL;
+    node->sent_tail = NULL;
+    node->context = NULL;
+    node->stop = 0;
+    node->wakefd = eventfd(0,0);
+    if(node->wakefd < 0){
+        printf("eventfd failed, errno %d\n",errno);
+        free(node->ip);
+        free(node);
+        return NULL;
+    }
+    if(pthread_create(&node->thread,NULL,__shared_node_main,node) != 0){
+        printf("unable to start the thread of ip=%s, port=%d\n",ip,port);
+        close(node->wakefd);
+        free(node->ip);
+        free(node);
+        return NULL;
+    }
+    return node;
+}
+
+static void __free_shared_node(sharedNode* node){
+    uint64_t one = 1;
+    __atomic_store_n(&node->stop,1,__ATOMIC_RELEASE);
+    if(write(node->wakefd,&one,sizeof(one)) != sizeof(one))
+        printf("unable to wake the thread of ip=%s, port=%d\n",node->ip,node->port);
+    pthread_join(node->thread,NULL);
+    close(node->wakefd);
+    if(node->context != NULL)
+        redisFree(node->context);
+    free(node->ip);
+    free(node);
+}
+
+//cluster->lock is held. returns NULL for a new node once the cluster is stopping
+static sharedNode* __shared_find_node(sharedCluster* cluster,const char* ip,int port){
+    int i;
+    for(i=0;i<cluster->len;i++){
+        if(cluster->nodes[i]->port == port && strcmp(cluster->nodes[i]->ip,ip) == 0)
+            return cluster->nodes[i];
+    }
+    if(cluster->stopping)
+        return NULL;
+    if(cluster->len == cluster->capacity){
+        int capacity = cluster->capacity > 0 ? cluster->capacity*2 : 8;
+        sharedNode** nodes = (sharedNode**)realloc(cluster->nodes,sizeof(sharedNode*)*capacity);
+        if(nodes == NULL){
+            printf("panic! %s %d\n",__FILE__,__LINE__);
+            return NULL;
+        }
+        cluster->nodes = nodes;
+        cluster->capacity = capacity;
+    }
+    sharedNode* node = __new_shared_node(cluster,ip,port);
+    if(node != NULL)
+        cluster->nodes[cluster->len++] = node;
+    return node;
+}
+
+//the node of ip:port, started now if the cluster has none
+static sharedNode* __shared_node(sharedCluster* cluster,const char* ip,int port){
+    pthread_mutex_lock(&cluster->lock);
+    sharedNode* node = __shared_find_node(cluster,ip,port);
+    pthread_mutex_unlock(&cluster->lock);
+    return node;
+}
+
+//the node of ip:port if the cluster has one, no node is started
+static sharedNode* __shared_known_node(sharedCluster* cluster,const char* ip,int port){
+    int i;
+    sharedNode* node = NULL;
+    pthread_mutex_lock(&cluster->lock);
+    for(i=0;i<cluster->len && node == NULL;i++){
+        if(cluster->nodes[i]->port == port && strcmp(cluster->nodes[i]->ip,ip) == 0)
+            node = cluster->nodes[i];
+    }
+    pthread_mutex_unlock(&cluster->lock);
+    return node;
+}
+
+/*
+*rebuild slot_to_node from the newest shared layout. Threads routing meanwhile see either the old or
+*the new node of a slot, both stay valid until shared_disconnect.
+*/
+static void __shared_sync_topology(sharedCluster* cluster){
+    pthread_mutex_lock(&cluster->lock);
+    if(cluster->stopping || (cluster->version != 0 && topology_version(cluster->entry) == cluster->version)){
+        //the cluster is stopping, or another thread got here first
+        pthread_mutex_unlock(&cluster->lock);
+        return;
+    }
+    clusterTopology* topology = topology_acquire(cluster->entry);
+    if(topology == NULL){
+        pthread_mutex_unlock(&cluster->lock);
+        return;
+    }
+    sharedNode** owners = (sharedNode**)calloc(topology->len > 0 ? topology->len : 1,sizeof(sharedNode*));
+    if(owners == NULL){
+        printf("panic! %s %d\n",__FILE__,__LINE__);
+        pthread_mutex_unlock(&cluster->lock);
+        topology_release(topology);
+        return;
+    }
+    int slot;
+    for(slot=0;slot<16384;slot++){
+        uint16_t index = __atomic_load_n(&topology->slot_to_node[slot],__ATOMIC_RELAXED);
+        sharedNode* node = NULL;
+        if(index != SLOT_UNASSIGNED){
+            if(owners[index] == NULL)
+                owners[index] = __shared_find_node(cluster,topology->nodes[index]->ip,topology->nodes[index]->port);
+            node = owners[index];
+        }
+        __atomic_store_n(&cluster->slot_to_node[slot],node,__ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&cluster->version,topology->version,__ATOMIC_RELEASE);
+    pthread_mutex_unlock(&cluster->lock);
+    free(owners);
+    topology_release(topology);
+}
+
+/*
+*fetch the whole layout again, with a blocking connection. A running refresher is woken instead
+*by topology_note_redirect and topology_note_error, so this is only reached without one. Only the
+*calling threads get here, a node thread must not hold up its connection for the round trip.
+*/
+static void __shared_refresh_topology(sharedCluster* cluster){
+    if(topology_reload(cluster->entry,cluster->entry->ip,cluster->entry->port) != 0){
+        printf("unable to refresh the cluster layout\n");
+        return;
+    }
+    __shared_sync_topology(cluster);
+}
+
+/*
+*a node could not be reached, which is what a failover looks like from here. Called by the node
+*threads, the reload is left to the next command routed.
+*/
+static void __shared_note_error(sharedCluster* cluster){
+    if(topology_note_error(cluster->entry))
+        __atomic_store_n(&cluster->reload,1,__ATOMIC_RELEASE);
+}
+
+/*
+*a MOVED reply, patch the slot in the shared layout as clusterInfo does.
+*/
+static void __shared_follow_moved(sharedCluster* cluster,int slot,const char* ip,int port){
+    if(topology_note_redirect(cluster->entry)){
+        __shared_refresh_topology(cluster);
+        return;
+    }
+    clusterTopology* topology = topology_acquire(cluster->entry);
+    if(topology == NULL)
+        return;
+    int re = topology_patch_slot(cluster->entry,topology,slot,ip,port);
+    topology_release(topology);
+    if(re == 1){
+        __shared_sync_topology(cluster);
+    }else if(re == 0){
+        //patched in place, the version doesn't change
+        sharedNode* node = __shared_node(cluster,ip,port);
+        if(node != NULL)
+            __atomic_store_n(&cluster->slot_to_node[slot],node,__ATOMIC_RELEASE);
+    }
+}
+
+static sharedNode* __shared_route(sharedCluster* cluster,int slot){
+    if(__atomic_load_n(&cluster->reload,__ATOMIC_ACQUIRE) && __atomic_exchange_n(&cluster->reload,0,__ATOMIC_ACQ_REL))
+        __shared_refresh_topology(cluster);
+    else if(topology_version(cluster->entry) != __atomic_load_n(&cluster->version,__ATOMIC_ACQUIRE))
+        __shared_sync_topology(cluster);
+    sharedNode* node = __atomic_load_n(&cluster->slot_to_node[slot],__ATOMIC_ACQUIRE);
+    if(node == NULL)
+        printf("can't find the host for slot %d\n",slot);
+    return node;
+}
+
+/*
+*push the request on the queue of the node. Only the thread that finds the queue empty wakes the
+*node thread, it takes everything queued until then with the same wake up.
+*/
+static void __shared_push(sharedNode* node,sharedRequest* req){
+    sharedRequest* head = __atomic_load_n(&node->queue,__ATOMIC_RELAXED);
+    do{
+        req->next = head;
+    }while(!__atomic_compare_exchange_n(&node->queue,&head,req,1,__ATOMIC_RELEASE,__ATOMIC_RELAXED));
+    if(head == NULL){
+        uint64_t one = 1;
+        if(write(node->wakefd,&one,sizeof(one)) != sizeof(one))
+            printf("unable to wake the thread of ip=%s, port=%d\n",node->ip,node->port);
+    }
+}
+
+//the request may be gone as soon as this returns
+static void __shared_answer(sharedRequest* req,redisReply* reply){
+    req->reply = reply;
+    sem_post(&req->done);
+}
+
+//the node thread starts from here
+
+/*
+*connect with a blocking connect, then make the socket non blocking for the loop of the node thread.
+*/
+static int __shared_node_connect(sharedNode* node){
+    struct timeval tv;
+    tv.tv_sec = node->cluster->connect_timeout_ms/1000;
+    tv.tv_usec = (node->cluster->connect_timeout_ms%1000)*1000;
+    redisContext* c = redisConnectWithTimeout(node->ip,node->port,tv);
+    if(c == NULL || c->err){
+        printf("connection refused ip=%s, port=%d\n",node->ip,node->port);
+        if(c != NULL)
+            redisFree(c);
+        return -1;
+    }
+    fcntl(c->fd,F_SETFL,fcntl(c->fd,F_GETFL) | O_NONBLOCK);
+    c->flags &= ~REDIS_BLOCK;
+    node->context = c;
+    return 0;
+}
+
+/*
+*the connection is gone, every request written to it fails. The next batch connects again.
+*/
+static void __shared_node_lost(sharedNode* node){
+    printf("connection to ip=%s, port=%d lost\n",node->ip,node->port);
+    redisFree(node->context);
+    node->context = NULL;
+    while(node->sent_head != NULL){
+        sharedRequest* req = node->sent_head;
+        node->sent_head = req->next;
+        __shared_answer(req,NULL);
+    }
+    node->sent_tail = NULL;
+    __shared_note_error(node->cluster);
+}
+
+/*
+*append a batch taken from the queue, newest first, to the output buffer in the order it was
+*queued and write as much as the socket takes. returns 1 if some of it is still to be written.
+*/
+static int __shared_node_write(sharedNode* node,sharedRequest* batch){
+    sharedRequest* ordered = NULL;
+    while(batch != NULL){
+        sharedRequest* next = batch->next;
+        batch->next = ordered;
+        ordered = batch;
+        batch = next;
+    }
+    if(node->context == NULL && __shared_node_connect(node) != 0){
+        while(ordered != NULL){
+            sharedRequest* next = ordered->next;
+            __shared_answer(ordered,NULL);
+            ordered = next;
+        }
+        __shared_note_error(node->cluster);
+        return 0;
+    }
+    while(ordered != NULL){
+        sharedRequest* req = ordered;
+        ordered = req->next;
+        req->next = NULL;
+        //ASKING and the command are one buffer, so either both are queued or none is
+        req->skip = req->asking;
+        if(redisAppendFormattedCommand(node->context,req->cmd,req->len) != REDIS_OK){
+            __shared_answer(req,NULL);
+            continue;
+        }
+        if(node->sent_tail == NULL)
+            node->sent_head = req;
+        else
+            node->sent_tail->next = req;
+        node->sent_tail = req;
+    }
+    int done = 0;
+    if(redisBufferWrite(node->context,&done) != REDIS_OK){
+        __shared_node_lost(node);
+        return 0;
+    }
+    return !done;
+}
+
+/*
+*read what the socket has and hand every complete reply to its request. returns -1 once the
+*connection is lost.
+*/
+static int __shared_node_read(sharedNode* node){
+    if(redisBufferRead(node->context) != REDIS_OK){
+        __shared_node_lost(node);
+        return -1;
+    }
+    void* reply = NULL;
+    while(1){
+        if(redisGetReplyFromReader(node->context,&reply) != REDIS_OK){
+            __shared_node_lost(node);
+            return -1;
+        }
+        if(reply == NULL)
+            return 0;
+        sharedRequest* req = node->sent_head;
+        if(req == NULL){
+            freeReplyObject(reply);
+            continue;
+        }
+        if(req->skip > 0){
+            //the reply of ASKING
+            req->skip--;
+            freeReplyObject(reply);
+            continue;
+        }
+        node->sent_head = req->next;
+        if(node->sent_head == NULL)
+            node->sent_tail = NULL;
+        __shared_answer(req,(redisReply*)reply);
+    }
+}
+
+static void* __shared_node_main(void* arg){
+    sharedNode* node = (sharedNode*)arg;
+    int unsent = 0;
+    while(!__atomic_load_n(&node->stop,__ATOMIC_ACQUIRE)){
+        //everything queued goes out with one write, the requests that arrive meanwhile make the next one
+        //a request pushed after the exchange finds the queue empty and wakes the poll below
+        sharedRequest* batch = __atomic_exchange_n(&node->queue,NULL,__ATOMIC_ACQUIRE);
+        if(batch != NULL)
+            unsent = __shared_node_write(node,batch);
+
+        struct pollfd fds[2];
+        fds[0].fd = node->wakefd;
+        fds[0].events = POLLIN;
+        fds[1].fd = node->context != NULL ? node->context->fd : -1;
+        fds[1].events = (node->sent_head != NULL ? POLLIN : 0) | (unsent ? POLLOUT : 0);
+        fds[0].revents = fds[1].revents = 0;
+        if(poll(fds,2,-1) < 0){
+            if(errno == EINTR)
+                continue;
+            printf("poll failed, errno %d\n",errno);
+            break;
+        }
+        if(fds[0].revents & POLLIN){
+            uint64_t count;
+            if(read(node->wakefd,&count,sizeof(count)) != sizeof(count))
+                printf("unable to read the wake up of ip=%s, port=%d\n",node->ip,node->port);
+        }
+        if(node->context == NULL)
+            continue;
+        if(fds[1].revents & POLLOUT){
+            int done = 0;
+            if(redisBufferWrite(node->context,&done) != REDIS_OK){
+                __shared_node_lost(node);
+                unsent = 0;
+                continue;
+            }
+            unsent = !done;
+        }
+        if(fds[1].revents & (POLLIN | POLLERR | POLLHUP)){
+            if(__shared_node_read(node) != 0)
+                unsent = 0;
+        }
+    }
+    return NULL;
+}
+
+//the calling threads start from here
+
+/*
+*send the request over a connection of the calling thread, closed right after. For a redirect to
+*an address outside the layout, which would otherwise get a node thread kept until shared_disconnect.
+*/
+static redisReply* __shared_one_off(sharedCluster* cluster,const char* ip,int port,sharedRequest* req){
+    struct timeval tv;
+    tv.tv_sec = cluster->connect_timeout_ms/1000;
+    tv.tv_usec = (cluster->connect_timeout_ms%1000)*1000;
+    redisContext* c = redisConnectWithTimeout(ip,port,tv);
+    if(c == NULL || c->err){
+        printf("unable to follow the redirect to %s:%d\n",ip,port);
+        if(c != NULL)
+            redisFree(c);
+        return NULL;
+    }
+    void* reply = NULL;
+    if(redisAppendFormattedCommand(c,req->cmd,req->len) == REDIS_OK){
+        int skip;
+        for(skip=req->asking;skip>=0;skip--){
+            if(reply != NULL)
+                freeReplyObject(reply);
+            reply = NULL;
+            if(redisGetReply(c,&reply) != REDIS_OK)
+                break;
+        }
+    }
+    redisFree(c);
+    return (redisReply*)reply;
+}
+
+/*
+*send the command through the node of the slot and wait for its reply, following redirects.
+*/
+static redisReply* __shared_submit(sharedCluster* cluster,int slot,int argc,const char** argv,const size_t* argvlen){
+    sharedNode* node = __shared_route(cluster,slot);
+    if(node == NULL)
+        return NULL;
+    static const char asking_frame[] = "*1\r\n$6\r\nASKING\r\n";
+    char* command;
+    int len = redisFormatCommandArgv(&command,argc,argv,argvlen);
+    if(len < 0){
+        printf("unable to format the command %s %d\n",__FILE__,__LINE__);
+        return NULL;
+    }
+    //the command behind ASKING, made on the first ASK redirect
+    char* asking = NULL;
+    sharedRequest req;
+    req.cmd = command;
+    req.len = len;
+    req.asking = 0;
+    sem_init(&req.done,0,0);
+
+    redisReply* reply = NULL;
+    int redirects;
+    for(redirects=0;;redirects++){
+        req.reply = NULL;
+        __shared_push(node,&req);
+        while(sem_wait(&req.done) != 0 && errno == EINTR)
+            ;
+        reply = req.reply;
+        if(reply == NULL || reply->type != REDIS_REPLY_ERROR || redirects == SHARED_MAX_REDIRECTS)
+            break;
+        int moved = !strncmp(reply->str,"MOVED ",6);
+        char ip[64];
+        int port,target;
+        if(!(moved || !strncmp(reply->str,"ASK ",4))
+           || topology_parse_redirect(reply->str,&target,ip,sizeof(ip),&port) != 0)
+            break;
+        if(moved)
+            __shared_follow_moved(cluster,target,ip,port);
+        if(!moved && asking == NULL){
+            asking = (char*)malloc(sizeof(asking_frame)-1+len);
+            if(asking == NULL){
+                printf("panic! %s %d\n",__FILE__,__LINE__);
+                break;
+            }
+            memcpy(asking,asking_frame,sizeof(asking_frame)-1);
+            memcpy(asking+sizeof(asking_frame)-1,command,len);
+        }
+        freeReplyObject(reply);
+        reply = NULL;
+        req.asking = !moved;
+        req.cmd = moved ? command : asking;
+        req.len = moved ? len : (int)(sizeof(asking_frame)-1)+len;
+        //a MOVED to a new node has started it with the rebuild of slot_to_node
+        node = __shared_known_node(cluster,ip,port);
+        if(node == NULL){
+            reply = __shared_one_off(cluster,ip,port,&req);
+            break;
+        }
+    }
+    sem_destroy(&req.done);
+    free(asking);
+    redisFreeCommand(command);
+    return reply;
+}
+
+int shared_setn(sharedCluster* cluster,const char* key,size_t keylen,const char* value,size_t valuelen){
+    if(cluster == NULL || key == NULL || value == NULL){
+        printf("NULL pointer %s %d\n",__FILE__,__LINE__);
+        return -1;
+    }
+    const char* argv[3] = {"set",key,value};
+    size_t argvlen[3] = {3,keylen,valuelen};
+    redisReply* reply = __shared_submit(cluster,keyHashSlot(key,keylen),3,argv,argvlen);
+    if(reply == NULL)
+        return -1;
+    int re = reply->type == REDIS_REPLY_STATUS ? 0 : -1;
+    if(re != 0)
+        printf("set failed: %s\n",reply->type == REDIS_REPLY_ERROR ? reply->str : "unexpected reply");
+    freeReplyObject(reply);
+    return re;
+}
+
+redisReply* shared_getn(sharedCluster* cluster,const char* key,size_t keylen){
+    if(cluster == NULL || key == NULL){
+        printf("NULL pointer %s %d\n",__FILE__,__LINE__);
+        return NULL;
+    }
+    const char* argv[2] = {"get",key};
+    size_t argvlen[2] = {3,keylen};
+    return __shared_submit(cluster,keyHashSlot(key,keylen),2,argv,argvlen);
+}
+
+redisReply* shared_command_argv(sharedCluster* cluster,int argc,const char** argv,const size_t* argvlen,int dbnum){
+    if(cluster == NULL || argv == NULL || argc <= 0){
+        printf("invalid arguments %s %d\n",__FILE__,__LINE__);
+        return NULL;
+    }
+    routedCommand routed;
+    if(cluster_route_argv(argc,argv,argvlen,dbnum,&routed) < 0)
+        return NULL;
+    redisReply* reply = __shared_submit(cluster,routed.slot,routed.argc,routed.argv,routed.argvlen);
+    cluster_route_release(&routed);
+    return reply;
+}
+
+int start_shared_topology_refresher(sharedCluster* cluster,int interval_ms){
+    if(cluster == NULL){
+        printf("NULL pointer %s %d\n",__FILE__,__LINE__);
+        return -1;
+    }
+    return topology_start_refresher(cluster->entry,interval_ms);
+}
+
+void shared_disconnect(sharedCluster* cluster){
+    if(cluster == NULL)
+        return;
+    //from here on nodes and len stay as they are, so they are read without the lock
+    pthread_mutex_lock(&cluster->lock);
+    cluster->stopping = 1;
+    pthread_mutex_unlock(&cluster->lock);
+    int i;
+    for(i=0;i<cluster->len;i++)
+        __free_shared_node(cluster->nodes[i]);
+    free(cluster->nodes);
+    pthread_mutex_destroy(&cluster->lock);
+    topology_detach(cluster->entry);
+    free(cluster);
+}
@@ -0,0 +1,110 @@
+#ifndef SHARED_CONNECT_H
+#define SHARED_CONNECT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <hiredis/hiredis.h>
+#include "topology.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+*a command waiting in a sharedCluster. It lives on the stack of the thread that sent it, which
+*sleeps on done until the reply is in.
+*/
+typedef struct sharedRequest{
+    //the formatted command, behind the frame of ASKING for an ASK redirect
+    char* cmd;
+    int len;
+    //1 if cmd starts with ASKING
+    int asking;
+    //replies still to read before the one of the command, the one of ASKING
+    int skip;
+    //NULL if the command could not be delivered
+    redisReply* reply;
+    sem_t done;
+    struct sharedRequest* next;
+}sharedRequest;
+
+/*
+*sharedNode is the one connection of a sharedCluster to an instance, and the thread writing to it.
+*Any thread pushes its request on queue, the node thread takes everything queued at once, sends it
+*with a single write and hands the replies back in order.
+*/
+typedef struct sharedNode{
+    char* ip;
+    int port;
+    struct sharedCluster* cluster;
+    //requests waiting to be written, newest first. pushed with a compare and swap, taken whole by the node thread
+    sharedRequest* queue;
+    //written requests waiting for their reply, oldest first. only touched by the node thread
+    sharedRequest* sent_head;
+    sharedRequest* sent_tail;
+    //NULL until the first request, and again once the connection is lost. only touched by the node thread
+    redisContext* context;
+    //an eventfd, written by the thread which finds queue empty so that the node thread wakes up
+    int wakefd;
+    //1 once shared_disconnect wants the thread to end
+    int stop;
+    pthread_t thread;
+}sharedNode;
+
+/*
+*a client of a redis cluster that any number of threads use at once. clusterInfo has to be one per
+*thread, so T threads open T connections to every node. A sharedCluster opens one per master, and
+*the commands of all threads are pipelined on it: the more threads wait, the larger every write.
+*Every call blocks the calling thread until its reply is in. It routes with the same shared
+*clusterTopology as clusterInfo, MOVED and ASK replies are followed up to SHARED_MAX_REDIRECTS times.
+*Only the nodes of the layout get a thread, a redirect to any other address is sent over a connection
+*of the calling thread that is closed again. Nodes are never dropped before shared_disconnect, a node
+*that leaves the layout is only idle.
+*/
+#define SHARED_MAX_REDIRECTS 5
+
+typedef struct sharedCluster{
+    //the node serving each slot, NULL if no node does. read without lock, stored atomically
+    sharedNode* slot_to_node[16384];
+    //version of the shared layout slot_to_node was built from
+    unsigned long version;
+    //where new snapshots are published
+    topologyEntry* entry;
+    //guards nodes, len, capacity, stopping and the rebuild of slot_to_node
+    pthread_mutex_t lock;
+    //every node ever routed to
+    sharedNode** nodes;
+    int len;
+    int capacity;
+    //timeout of the connect of a node thread
+    int connect_timeout_ms;
+    //1 once a node thread has seen enough errors, the next command routed reloads the layout
+    int reload;
+    //1 once shared_disconnect has begun, no node is added and slot_to_node is left as it is
+    int stopping;
+}sharedCluster;
+
+/*
+*connect to the cluster behind ip:port. The layout is fetched now, the connection to a node is made
+*by its thread when the first command is routed to it. returns NULL if errors occur.
+*/
+sharedCluster* shared_connect(const char* ip,int port);
+//the counterparts of setn and get without dbnum, safe to call from any thread
+int shared_setn(sharedCluster* cluster,const char* key,size_t keylen,const char* value,size_t valuelen);
+//the reply has to be freed with freeReplyObject, NULL if errors occur
+redisReply* shared_getn(sharedCluster* cluster,const char* key,size_t keylen);
+//any command of the key table, routed and prefixed with dbnum like cluster_command_argv
+redisReply* shared_command_argv(sharedCluster* cluster,int argc,const char** argv,const size_t* argvlen,int dbnum);
+//start the refresher thread of the shared layout, see start_topology_refresher
+int start_shared_topology_refresher(sharedCluster* cluster,int interval_ms);
+//stop the node threads and close the connections, no call may be running or follow
+void shared_disconnect(sharedCluster* cluster);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,715 @@
+#include "topology.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <hiredis/hiredis.h>
+
+//the following are a list of internal function that are not intended to be used outsize this file.
+static clusterTopology* __load_topology(const char* ip, int port);
+static void __free_topology(clusterTopology* topology);
+static topologyNode* __new_node(int index, const char* ip, int port);
+static clusterTopology* __copy_topology(clusterTopology* src);
+static clusterTopology* __new_topology();
+static int __append_node(clusterTopology* topology, topologyNode* node);
+static void __add_replica(topologyNode* master, topologyNode* replica);
+static void __free_node(topologyNode* node);
+static void* __refresher_main(void* arg);
+static int __launch_refresher(topologyEntry* entry);
+static void __stop_refresher(topologyEntry* entry, int unused_only);
+static int __same_topology(clusterTopology* a, clusterTopology* b);
+
+//all the entries, one for each seed address. Entries are never freed.
+static topologyEntry* topology_registry = NULL;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+topologyEntry* topology_lookup(const char* ip, int port) {
+    topologyEntry* entry;
+    pthread_mutex_lock(&registry_lock);
+    for(entry = topology_registry;entry != NULL;entry = entry->next) {
+        if(entry->port == port && strcmp(entry->ip,ip) == 0)
+            break;
+    }
+    if(entry == NULL) {
+        entry = (topologyEntry*)malloc(sizeof(topologyEntry));
+        if(entry == NULL) {
+            printf("malloc fail %s %d\n",__FILE__,__LINE__);
+            pthread_mutex_unlock(&registry_lock);
+            return NULL;
+        }
+        entry->ip = (char*)malloc(strlen(ip)+1);
+        if(entry->ip == NULL) {
+            printf("malloc fail %s %d\n",__FILE__,__LINE__);
+            free(entry);
+            pthread_mutex_unlock(&registry_lock);
+            return NULL;
+        }
+        strcpy(entry->ip,ip);
+        entry->port = port;
+        entry->current = NULL;
+        entry->version = 0;
+        entry->clients = 0;
+        entry->redirects = 0;
+        pthread_mutex_init(&entry->lock,NULL);
+        entry->refresher_state = REFRESHER_OFF;
+        entry->refresh_interval_ms = 0;
+        entry->refresh_requested = 0;
+        entry->restart_requested = 0;
+        pthread_cond_init(&entry->refresh_cond,NULL);
+        entry->next = topology_registry;
+        topology_registry = entry;
+    }
+    pthread_mutex_unlock(&registry_lock);
+    return entry;
+}
+
+/*
+*Only the first client of an entry sends 'cluster slots', the others wait on the entry lock
+*and share the snapshot it built.
+*/
+clusterTopology* topology_attach(topologyEntry* entry) {
+    clusterTopology* topology;
+    pthread_mutex_lock(&entry->lock);
+    if(entry->current == NULL) {
+        topology = __load_topology(entry->ip,entry->port);
+        if(topology == NULL) {
+            pthread_mutex_unlock(&entry->lock);
+            return NULL;
+        }
+        topology->version = __atomic_add_fetch(&entry->version,1,__ATOMIC_RELEASE);
+        entry->current = topology;
+    }
+    topology = entry->current;
+    __atomic_add_fetch(&topology->refcount,1,__ATOMIC_RELAXED);
+    entry->clients++;
+    pthread_mutex_unlock(&entry->lock);
+    return topology;
+}
+
+clusterTopology* topology_acquire(topologyEntry* entry) {
+    clusterTopology* topology;
+    pthread_mutex_lock(&entry->lock);
+    topology = entry->current;
+    if(topology != NULL)
+        __atomic_add_fetch(&topology->refcount,1,__ATOMIC_RELAXED);
+    pthread_mutex_unlock(&entry->lock);
+    return topology;
+}
+
+void topology_release(clusterTopology* topology) {
+    if(topology == NULL)
+        return;
+    if(__atomic_sub_fetch(&topology->refcount,1,__ATOMIC_ACQ_REL) == 0)
+        __free_topology(topology);
+}
+
+unsigned long topology_version(topologyEntry* entry) {
+    return __atomic_load_n(&entry->version,__ATOMIC_ACQUIRE);
+}
+
+void topology_publish(topologyEntry* entry, clusterTopology* topology) {
+    clusterTopology* old;
+    pthread_mutex_lock(&entry->lock);
+    old = entry->current;
+    topology->version = entry->version + 1;
+    entry->current = topology;
+    __atomic_store_n(&entry->version,topology->version,__ATOMIC_RELEASE);
+    pthread_mutex_unlock(&entry->lock);
+    //clients still using the old snapshot keep it alive until they move to the new one
+    topology_release(old);
+}
+
+int topology_reload(topologyEntry* entry, const char* ip, int port) {
+    clusterTopology* topology = __load_topology(ip,port);
+    if(topology == NULL)
+        return -1;
+    topology_publish(entry,topology);
+    return 0;
+}
+
+topologyNode* topology_slot_owner(clusterTopology* topology, int slot) {
+    uint16_t index = __atomic_load_n(&topology->slot_to_node[slot],__ATOMIC_ACQUIRE);
+    if(index == SLOT_UNASSIGNED)
+        return NULL;
+    return topology->nodes[index];
+}
+
+topologyNode* topology_find_node(clusterTopology* topology, const char* ip, int port) {
+    int i;
+    for(i=0;i<topology->len;i++){
+        if(topology->nodes[i]->port == port && strcmp(topology->nodes[i]->ip,ip) == 0)
+            return topology->nodes[i];
+    }
+    return NULL;
+}
+
+int topology_parse_redirect(const char* str, int* slot, char* ip, int ip_len, int* port) {
+    const char *s_slot,*s_ip,*s_port;
+    s_slot = strchr(str,' ');
+    if(s_slot == NULL)
+        return -1;
+    s_slot++;
+    s_ip = strchr(s_slot,' ');
+    if(s_ip == NULL)
+        return -1;
+    s_ip++;
+    //the last ':' so that ipv6 addresses work too
+    s_port = strrchr(s_ip,':');
+    if(s_port == NULL || s_port - s_ip >= ip_len)
+        return -1;
+
+    *slot = atoi(s_slot);
+    memcpy(ip,s_ip,s_port-s_ip);
+    ip[s_port-s_ip] = '\0';
+    *port = atoi(s_port+1);
+    return 0;
+}
+
+int topology_patch_slot(topologyEntry* entry, clusterTopology* topology, int slot, const char* ip, int port) {
+    if(slot < 0 || slot >= 16384) {
+        printf("invalid slot %d %s %d\n",slot,__FILE__,__LINE__);
+        return -1;
+    }
+    //patches of the same entry are serialized, readers never wait
+    pthread_mutex_lock(&entry->lock);
+    topologyNode* node = topology_find_node(topology,ip,port);
+    if(node != NULL) {
+        topologyNode* old = topology_slot_owner(topology,slot);
+        if(old == node) {
+            pthread_mutex_unlock(&entry->lock);
+            return 0;
+        }
+        if(old != NULL)
+            old->slot_count--;
+        node->slot_count++;
+        __atomic_store_n(&topology->slot_to_node[slot],(uint16_t)node->index,__ATOMIC_RELEASE);
+        pthread_mutex_unlock(&entry->lock);
+        return 0;
+    }
+    if(topology != entry->current) {
+        //a newer snapshot is already published, let the caller look there first
+        pthread_mutex_unlock(&entry->lock);
+        return 1;
+    }
+    clusterTopology* copy = __copy_topology(topology);
+    if(copy == NULL) {
+        pthread_mutex_unlock(&entry->lock);
+        return -1;
+    }
+    node = __new_node(copy->len,ip,port);
+    if(node == NULL || __append_node(copy,node) != 0) {
+        if(node != NULL)
+            __free_node(node);
+        topology_release(copy);
+        pthread_mutex_unlock(&entry->lock);
+        return -1;
+    }
+    node->slot_count = 1;
+    if(topology_slot_owner(copy,slot) != NULL)
+        topology_slot_owner(copy,slot)->slot_count--;
+    copy->slot_to_node[slot] = (uint16_t)node->index;
+
+    copy->version = entry->version + 1;
+    entry->current = copy;
+    __atomic_store_n(&entry->version,copy->version,__ATOMIC_RELEASE);
+    pthread_mutex_unlock(&entry->lock);
+    topology_release(topology);
+    return 1;
+}
+
+int topology_note_redirect(topologyEntry* entry) {
+    int seen = __atomic_add_fetch(&entry->redirects,1,__ATOMIC_RELAXED);
+    if(seen < REDIRECT_REFRESH_THRESHOLD)
+        return 0;
+    //only the thread which resets the counter does the reload
+    if(!__atomic_compare_exchange_n(&entry->redirects,&seen,0,false,__ATOMIC_RELAXED,__ATOMIC_RELAXED))
+        return 0;
+    //with a refresher the reload happens in the background, the caller goes on with the old layout
+    return topology_request_refresh(entry) == 0 ? 0 : 1;
+}
+
+int topology_note_error(topologyEntry* entry) {
+    return topology_note_redirect(entry);
+}
+
+int topology_start_refresher(topologyEntry* entry, int interval_ms) {
+    if(interval_ms <= 0) {
+        printf("invalid refresh interval %d\n",interval_ms);
+        return -1;
+    }
+    pthread_mutex_lock(&entry->lock);
+    if(entry->refresher_state == REFRESHER_RUNNING) {
+        entry->refresh_interval_ms = interval_ms;
+        pthread_cond_signal(&entry->refresh_cond);
+        pthread_mutex_unlock(&entry->lock);
+        return 0;
+    }
+    entry->refresh_interval_ms = interval_ms;
+    if(entry->refresher_state == REFRESHER_STOPPING) {
+        //the thread stopping the old refresher starts the new one
+        entry->restart_requested = 1;
+        pthread_mutex_unlock(&entry->lock);
+        return 0;
+    }
+    int re = __launch_refresher(entry);
+    pthread_mutex_unlock(&entry->lock);
+    return re;
+}
+
+//entry->lock is held
+static int __launch_refresher(topologyEntry* entry) {
+    entry->refresh_requested = 0;
+    if(pthread_create(&entry->refresher,NULL,__refresher_main,entry) != 0) {
+        printf("unable to start the refresher %s %d\n",__FILE__,__LINE__);
+        return -1;
+    }
+    entry->refresher_state = REFRESHER_RUNNING;
+    return 0;
+}
+
+/*
+*stop the refresher and wait for it. With unused_only it is only stopped if the entry has no client,
+*decided under the same lock that marks it stopping, so a client attaching meanwhile keeps it.
+*/
+static void __stop_refresher(topologyEntry* entry, int unused_only) {
+    pthread_mutex_lock(&entry->lock);
+    if(entry->refresher_state != REFRESHER_RUNNING || (unused_only && entry->clients != 0)) {
+        pthread_mutex_unlock(&entry->lock);
+        return;
+    }
+    entry->refresher_state = REFRESHER_STOPPING;
+    pthread_cond_signal(&entry->refresh_cond);
+    pthread_mutex_unlock(&entry->lock);
+
+    pthread_join(entry->refresher,NULL);
+
+    pthread_mutex_lock(&entry->lock);
+    entry->refresher_state = REFRESHER_OFF;
+    if(entry->restart_requested) {
+        entry->restart_requested = 0;
+        __launch_refresher(entry);
+    }
+    pthread_mutex_unlock(&entry->lock);
+}
+
+void topology_stop_refresher(topologyEntry* entry) {
+    __stop_refresher(entry,0);
+}
+
+int topology_request_refresh(topologyEntry* entry) {
+    int running;
+    pthread_mutex_lock(&entry->lock);
+    running = entry->refresher_state == REFRESHER_RUNNING;
+    if(running) {
+        entry->refresh_requested = 1;
+        pthread_cond_signal(&entry->refresh_cond);
+    }
+    pthread_mutex_unlock(&entry->lock);
+    return running ? 0 : -1;
+}
+
+void topology_detach(topologyEntry* entry) {
+    clusterTopology* old = NULL;
+    int last;
+    pthread_mutex_lock(&entry->lock);
+    entry->clients--;
+    last = entry->clients == 0;
+    pthread_mutex_unlock(&entry->lock);
+
+    if(!last)
+        return;
+    __stop_refresher(entry,1);
+    pthread_mutex_lock(&entry->lock);
+    if(entry->clients == 0) {
+        //nobody is connected any more, the next client fetches a fresh snapshot
+        old = entry->current;
+        entry->current = NULL;
+    }
+    pthread_mutex_unlock(&entry->lock);
+    topology_release(old);
+}
+
+/*
+*the refresher sleeps on refresh_cond, polls the cluster through the nodes of the current snapshot
+*(the seed last) and publishes what it got if the layout changed. The entry lock is not held while
+*talking to the cluster, so clients are never held up by a refresh.
+*/
+static void* __refresher_main(void* arg) {
+    topologyEntry* entry = (topologyEntry*)arg;
+    pthread_mutex_lock(&entry->lock);
+    while(entry->refresher_state == REFRESHER_RUNNING) {
+        if(!entry->refresh_requested) {
+            struct timeval now;
+            struct timespec deadline;
+            gettimeofday(&now,NULL);
+            long long ns = (long long)now.tv_usec*1000 + (long long)entry->refresh_interval_ms*1000000;
+            deadline.tv_sec = now.tv_sec + ns/1000000000;
+            deadline.tv_nsec = ns%1000000000;
+            int rc = 0;
+            while(entry->refresher_state == REFRESHER_RUNNING && !entry->refresh_requested && rc != ETIMEDOUT)
+                rc = pthread_cond_timedwait(&entry->refresh_cond,&entry->lock,&deadline);
+            if(entry->refresher_state != REFRESHER_RUNNING)
+                break;
+        }
+        entry->refresh_requested = 0;
+        clusterTopology* current = entry->current;
+        if(current == NULL)
+            continue;
+        __atomic_add_fetch(&current->refcount,1,__ATOMIC_RELAXED);
+        pthread_mutex_unlock(&entry->lock);
+
+        clusterTopology* fresh = NULL;
+        int i;
+        for(i=0;i<current->len && fresh == NULL;i++)
+            fresh = __load_topology(current->nodes[i]->ip,current->nodes[i]->port);
+        if(fresh == NULL)
+            fresh = __load_topology(entry->ip,entry->port);
+        if(fresh != NULL) {
+            __atomic_store_n(&entry->redirects,0,__ATOMIC_RELAXED);
+            if(__same_topology(current,fresh))
+                topology_release(fresh);
+            else
+                topology_publish(entry,fresh);
+        }
+        topology_release(current);
+        pthread_mutex_lock(&entry->lock);
+    }
+    pthread_mutex_unlock(&entry->lock);
+    return NULL;
+}
+
+/*
+*1 if both snapshots route every slot to the same address and have the same nodes in the same roles
+*/
+static int __same_topology(clusterTopology* a, clusterTopology* b) {
+    int i;
+    if(a->len != b->len)
+        return 0;
+    for(i=0;i<a->len;i++) {
+        topologyNode* x = a->nodes[i];
+        topologyNode* y = b->nodes[i];
+        if(x->port != y->port || x->master != y->master || strcmp(x->ip,y->ip) != 0)
+            return 0;
+    }
+    //clients may be patching slots of a in place
+    for(i=0;i<16384;i++) {
+        if(__atomic_load_n(&a->slot_to_node[i],__ATOMIC_RELAXED) != b->slot_to_node[i])
+            return 0;
+    }
+    return 1;
+}
+
+/*
+*connect to the given node, send "cluster slots" and build a snapshot from the reply.
+*the returned snapshot carries one reference which belongs to the caller.
+*/
+static clusterTopology* __load_topology(const char* ip, int port) {
+    redisContext* c = redisConnect(ip,port);
+    if(c == NULL || c->err) {
+        if(c != NULL) {
+            printf("global connection error %s %d %s\n",c->errstr,__LINE__,__FILE__);
+            redisFree(c);
+        }else{
+            printf("can not allocate global context %d %s",__LINE__,__FILE__);
+        }
+        return NULL;
+    }
+    redisReply* r = (redisReply*)redisCommand(c,"cluster slots");
+    if(r == NULL || r->type != REDIS_REPLY_ARRAY) {
+        printf("panic! %s %d\n",__FILE__,__LINE__);
+        if(r != NULL)
+            freeReplyObject(r);
+        redisFree(c);
+        return NULL;
+    }
+    clusterTopology* topology = topology_from_slots_reply(r,ip);
+    freeReplyObject(r);
+    redisFree(c);
+    return topology;
+}
+
+static unsigned int __address_hash(const char* ip, size_t len, int port) {
+    unsigned int h = 2166136261u;
+    size_t i;
+    for(i=0;i<len;i++){
+        h ^= (unsigned char)ip[i];
+        h *= 16777619u;
+    }
+    return h ^ (unsigned int)port * 2654435761u;
+}
+
+/*
+*return the node with this address, adding it to the snapshot the first time it is seen.
+*table is an open addressing index of the nodes by address, mask+1 entries, -1 when empty.
+*/
+static topologyNode* __address_to_node(clusterTopology* topology, int* table, unsigned int mask,
+                                       const char* ip, size_t len, int port) {
+    unsigned int h = __address_hash(ip,len,port) & mask;
+    while(table[h] != -1) {
+        topologyNode* node = topology->nodes[table[h]];
+        if(node->port == port && strlen(node->ip) == len && memcmp(node->ip,ip,len) == 0)
+            return node;
+        h = (h+1) & mask;
+    }
+    topologyNode* node = (topologyNode*)malloc(sizeof(topologyNode));
+    char* copy = (char*)malloc(len+1);
+    if(node == NULL || copy == NULL) {
+        printf("malloc fail %s %d\n",__FILE__,__LINE__);
+        free(node);
+        free(copy);
+        return NULL;
+    }
+    node->index = topology->len;
+    node->ip = copy;
+    memcpy(node->ip,ip,len);
+    node->ip[len] = '\0';
+    node->port = port;
+    node->slot_count = 0;
+    node->master = -1;
+    node->replicas = NULL;
+    node->replica_count = 0;
+    if(__append_node(topology,node) != 0) {
+        __free_node(node);
+        return NULL;
+    }
+    table[h] = node->index;
+    return node;
+}
+
+/*
+*the reply of cluster slots is an array with one element per slot range:
+*    1) start slot  2) end slot  3) master [ip, port, id]  4..) replicas [ip, port, id]
+*a node shows up once for every range it owns, whether the ranges are adjacent or not. An empty ip
+*means the node that answered, which is default_ip. Replicas are kept as nodes which own no slot,
+*their master lists them in replicas.
+*/
+clusterTopology* topology_from_slots_reply(redisReply* reply, const char* default_ip) {
+    if(reply == NULL || reply->type != REDIS_REPLY_ARRAY) {
+        printf("cluster slots reply is not an array %s %d\n",__FILE__,__LINE__);
+        return NULL;
+    }
+    clusterTopology* topology = __new_topology();
+    if(topology == NULL)
+        return NULL;
+
+    //at most one node per address in a range entry, so twice their number keeps the index sparse
+    size_t addresses = 0;
+    size_t i;
+    for(i=0;i<reply->elements;i++){
+        if(reply->element[i]->type == REDIS_REPLY_ARRAY && reply->element[i]->elements > 2)
+            addresses += reply->element[i]->elements - 2;
+    }
+    unsigned int size = 16;
+    while(size < addresses*2)
+        size <<= 1;
+    int* table = (int*)malloc(sizeof(int)*size);
+    if(table == NULL) {
+        printf("malloc fail %s %d\n",__FILE__,__LINE__);
+        topology_release(topology);
+        return NULL;
+    }
+    memset(table,-1,sizeof(int)*size);
+
+    for(i=0;i<reply->elements;i++){
+        redisReply* range = reply->element[i];
+        if(range->type != REDIS_REPLY_ARRAY || range->elements < 3 ||
+           range->element[0]->type != REDIS_REPLY_INTEGER || range->element[1]->type != REDIS_REPLY_INTEGER ||
+           range->element[2]->type != REDIS_REPLY_ARRAY || range->element[2]->elements < 2 ||
+           range->element[2]->element[0]->type != REDIS_REPLY_STRING ||
+           range->element[2]->element[1]->type != REDIS_REPLY_INTEGER) {
+            printf("malformed cluster slots entry %lu %s %d\n",(unsigned long)i,__FILE__,__LINE__);
+            continue;
+        }
+        long long start = range->element[0]->integer;
+        long long end = range->element[1]->integer;
+        redisReply* master = range->element[2];
+        if(start < 0 || end >= 16384 || start > end) {
+            printf("invalid slot range %lld-%lld %s %d\n",start,end,__FILE__,__LINE__);
+            continue;
+        }
+
+        const char* ip = master->element[0]->str;
+        size_t ip_len = master->element[0]->len;
+        if(ip_len == 0 && default_ip != NULL) {
+            ip = default_ip;
+            ip_len = strlen(default_ip);
+        }
+        topologyNode* node = __address_to_node(topology,table,size-1,ip,ip_len,(int)master->element[1]->integer);
+        if(node == NULL) {
+            //a layout with the slots of this range unassigned would send their keys nowhere
+            free(table);
+            topology_release(topology);
+            return NULL;
+        }
+
+        long long j;
+        for(j=start;j<=end;j++){
+            topology->slot_to_node[j] = (uint16_t)node->index;
+        }
+        node->slot_count += (int)(end-start+1);
+
+        size_t r;
+        for(r=3;r<range->elements;r++){
+            redisReply* replica = range->element[r];
+            if(replica->type != REDIS_REPLY_ARRAY || replica->elements < 2 ||
+               replica->element[0]->type != REDIS_REPLY_STRING || replica->element[1]->type != REDIS_REPLY_INTEGER)
+                continue;
+            ip = replica->element[0]->str;
+            ip_len = replica->element[0]->len;
+            if(ip_len == 0 && default_ip != NULL) {
+                ip = default_ip;
+                ip_len = strlen(default_ip);
+            }
+            topologyNode* replica_node = __address_to_node(topology,table,size-1,ip,ip_len,(int)replica->element[1]->integer);
+            if(replica_node == NULL) {
+                free(table);
+                topology_release(topology);
+                return NULL;
+            }
+            if(replica_node == node)
+                continue;
+            replica_node->master = node->index;
+            __add_replica(node,replica_node);
+        }
+    }
+    free(table);
+    //the node array only grows while parsing, give back what the real cluster doesn't need
+    if(topology->len > 0 && topology->len < topology->capacity) {
+        topologyNode** nodes = (topologyNode**)realloc(topology->nodes,sizeof(topologyNode*)*topology->len);
+        if(nodes != NULL) {
+            topology->nodes = nodes;
+            topology->capacity = topology->len;
+        }
+    }
+    return topology;
+}
+
+static topologyNode* __new_node(int index, const char* ip, int port) {
+    topologyNode* node = (topologyNode*)malloc(sizeof(topologyNode));
+    char* copy = (char*)malloc(strlen(ip)+1);
+    if(node == NULL || copy == NULL) {
+        printf("malloc fail %s %d\n",__FILE__,__LINE__);
+        free(node);
+        free(copy);
+        return NULL;
+    }
+    node->index = index;
+    node->ip = copy;
+    strcpy(node->ip,ip);
+    node->port = port;
+    node->slot_count = 0;
+    node->master = -1;
+    node->replicas = NULL;
+    node->replica_count = 0;
+    return node;
+}
+
+/*
+*deep copy of a snapshot, used when a redirect points to a node the snapshot doesn't know.
+*/
+static clusterTopology* __copy_topology(clusterTopology* src) {
+    clusterTopology* topology = __new_topology();
+    if(topology == NULL)
+        return NULL;
+    int i;
+    for(i=0;i<src->len;i++){
+        topologyNode* node = __new_node(i,src->nodes[i]->ip,src->nodes[i]->port);
+        if(node == NULL) {
+            topology_release(topology);
+            return NULL;
+        }
+        node->slot_count = src->nodes[i]->slot_count;
+        if(__append_node(topology,node) != 0) {
+            __free_node(node);
+            topology_release(topology);
+            return NULL;
+        }
+    }
+    for(i=0;i<src->len;i++){
+        int j;
+        topology->nodes[i]->master = src->nodes[i]->master;
+        for(j=0;j<src->nodes[i]->replica_count;j++)
+            __add_replica(topology->nodes[i],topology->nodes[src->nodes[i]->replicas[j]]);
+    }
+    for(i=0;i<16384;i++){
+        topology->slot_to_node[i] = __atomic_load_n(&src->slot_to_node[i],__ATOMIC_ACQUIRE);
+    }
+    return topology;
+}
+
+static clusterTopology* __new_topology() {
+    clusterTopology* topology = (clusterTopology*)malloc(sizeof(clusterTopology));
+    if(topology == NULL) {
+        printf("malloc fail %s %d\n",__FILE__,__LINE__);
+        return NULL;
+    }
+    topology->refcount = 1;
+    topology->version = 0;
+    topology->len = 0;
+    topology->capacity = 0;
+    topology->nodes = NULL;
+    memset(topology->slot_to_node,0xff,sizeof(topology->slot_to_node));
+    return topology;
+}
+
+/*
+*add a node at the end of the node array, the array doubles when it is full.
+*node indices have to fit in slot_to_node, so SLOT_UNASSIGNED nodes is the hard limit.
+*/
+static int __append_node(clusterTopology* topology, topologyNode* node) {
+    if(topology->len >= SLOT_UNASSIGNED) {
+        printf("too many nodes in the cluster %s %d\n",__FILE__,__LINE__);
+        return -1;
+    }
+    if(topology->len == topology->capacity) {
+        int capacity = topology->capacity == 0 ? 8 : topology->capacity*2;
+        topologyNode** nodes = (topologyNode**)realloc(topology->nodes,sizeof(topologyNode*)*capacity);
+        if(nodes == NULL) {
+            printf("malloc fail %s %d\n",__FILE__,__LINE__);
+            return -1;
+        }
+        topology->nodes = nodes;
+        topology->capacity = capacity;
+    }
+    node->index = topology->len;
+    topology->nodes[topology->len++] = node;
+    return 0;
+}
+
+//the replicas of a master are listed once, however many ranges the master owns
+static void __add_replica(topologyNode* master, topologyNode* replica) {
+    int i;
+    for(i=0;i<master->replica_count;i++){
+        if(master->replicas[i] == replica->index)
+            return;
+    }
+    int* replicas = (int*)realloc(master->replicas,sizeof(int)*(master->replica_count+1));
+    if(replicas == NULL) {
+        printf("malloc fail %s %d\n",__FILE__,__LINE__);
+        return;
+    }
+    replicas[master->replica_count++] = replica->index;
+    master->replicas = replicas;
+}
+
+static void __free_node(topologyNode* node) {
+    if(node->ip != NULL)
+        free(node->ip);
+    if(node->replicas != NULL)
+        free(node->replicas);
+    free(node);
+}
+
+static void __free_topology(clusterTopology* topology) {
+    int len = topology->len;
+    int i;
+    for(i=0;i<len;i++){
+        if(topology->nodes[i] != NULL)
+            __free_node(topology->nodes[i]);
+    }
+    free(topology->nodes);
+    free(topology);
+}
@@ -0,0 +1,149 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <hiredis/hiredis.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+*topologyNode describes one redis instance as it is seen by the whole process.It only keeps the
+*information that is the same for every thread, the connections are kept by parseArgv in connect.h.
+*/
+typedef struct topologyNode{
+    //position of this node in clusterTopology::nodes, also the position of its parseArgv in clusterInfo::parse
+    int index;
+    //ip address of the redis instance
+    char * ip;
+    //port of the redis instance
+    int port;
+    //number of slots owned by the instance, they may be spread over any number of ranges
+    int slot_count;
+    //index of the master this instance replicates, -1 for a master
+    int master;
+    //indices of the replicas of a master, replica_count entries
+    int* replicas;
+    int replica_count;
+}topologyNode;
+
+//slot_to_node value of a slot no node owns
+#define SLOT_UNASSIGNED 0xffff
+
+/*
+*clusterTopology is a snapshot of the cluster layout which is built once and then shared by every
+*clusterInfo in the process, threads read it without any lock. The node list never changes after
+*the snapshot is published. topology_patch_slot may still move slot_to_node entries, each with an
+*atomic store, so a reader sees either the old or the new owner of a slot. It adjusts slot_count
+*without atomics, slot_count is only approximate once a snapshot has been patched. A refresh builds
+*a new snapshot and publishes it, the old one is freed when the last clusterInfo holding it lets it go.
+*/
+typedef struct clusterTopology{
+    //number of holders, the registry holds one reference to the current snapshot
+    int refcount;
+    //version of the registry entry at the time this snapshot was published
+    unsigned long version;
+    //number of nodes
+    int len;
+    //allocated size of nodes
+    int capacity;
+    //one entry per instance, masters and replicas, in the order they first appear in the reply of cluster slots
+    topologyNode** nodes;
+    //index in nodes of the owner of each slot, 32KB so the whole table stays in cache on the hot path
+    uint16_t slot_to_node[16384];
+}clusterTopology;
+
+/*
+*there is one topologyEntry for every seed address used with connectRedis. It holds the
+*current snapshot, and the version is bumped each time a new snapshot is published.
+*/
+//after this many redirects the whole layout is fetched again instead of being patched slot by slot
+#define REDIRECT_REFRESH_THRESHOLD 64
+
+typedef struct topologyEntry{
+    char * ip;
+    int port;
+    //the snapshot handed out to new clients, NULL until the first client connects
+    clusterTopology* current;
+    unsigned long version;
+    //number of clusterInfo using this entry
+    int clients;
+    //MOVED replies and connection errors seen since the last full reload
+    int redirects;
+    pthread_mutex_t lock;
+    //background refresher, one of REFRESHER_ and the interval between two polls
+    int refresher_state;
+    int refresh_interval_ms;
+    //set to wake the refresher before the interval is over
+    int refresh_requested;
+    //set by topology_start_refresher while the old refresher is stopping, it is started again once that is done
+    int restart_requested;
+    pthread_cond_t refresh_cond;
+    pthread_t refresher;
+    struct topologyEntry* next;
+}topologyEntry;
+
+#define REFRESHER_OFF 0
+#define REFRESHER_RUNNING 1
+#define REFRESHER_STOPPING 2
+
+//find the entry for a seed address, the entry is created on first use and lives as long as the process
+topologyEntry* topology_lookup(const char* ip, int port);
+//register a new client of the entry and return a reference to the current snapshot, the first client loads it from the seed node
+clusterTopology* topology_attach(topologyEntry* entry);
+//get another reference to the current snapshot, returns NULL if there is no snapshot
+clusterTopology* topology_acquire(topologyEntry* entry);
+/*
+*build a snapshot from the reply of "cluster slots", default_ip replaces the empty ip some servers
+*report for themselves. The snapshot carries one reference which belongs to the caller, NULL on error.
+*/
+clusterTopology* topology_from_slots_reply(redisReply* reply, const char* default_ip);
+//drop a reference, the snapshot is freed when no one holds it
+void topology_release(clusterTopology* topology);
+//read the current version without taking the lock, used by clients to notice a new snapshot
+unsigned long topology_version(topologyEntry* entry);
+//fetch a new snapshot through the given ip and port and publish it, returns 0 on success
+int topology_reload(topologyEntry* entry, const char* ip, int port);
+//replace the current snapshot, the entry takes over the caller's reference
+void topology_publish(topologyEntry* entry, clusterTopology* topology);
+/*
+*a MOVED reply said that ip:port now serves the slot. If the node is in the snapshot, the slot is
+*patched in place and 0 is returned. Otherwise a copy of the snapshot with the new node is published
+*and 1 is returned, the caller has to move to the new snapshot. -1 on error.
+*/
+int topology_patch_slot(topologyEntry* entry, clusterTopology* topology, int slot, const char* ip, int port);
+/*
+*count one redirect, returns 1 when REDIRECT_REFRESH_THRESHOLD is reached and the caller has to reload.
+*if a refresher is running it is woken up instead and 0 is returned.
+*/
+int topology_note_redirect(topologyEntry* entry);
+//same as topology_note_redirect, for a node which could not be reached
+int topology_note_error(topologyEntry* entry);
+/*
+*start a thread which fetches the layout every interval_ms, and sooner when redirects or errors pile
+*up. A snapshot is published only if it differs from the current one. returns 0 on success.
+*/
+int topology_start_refresher(topologyEntry* entry, int interval_ms);
+//stop the refresher and wait for it, the last topology_detach does it too
+void topology_stop_refresher(topologyEntry* entry);
+//wake the refresher, it polls the cluster right away. returns -1 if there is no refresher
+int topology_request_refresh(topologyEntry* entry);
+//the owner of a slot, NULL if no node owns it
+topologyNode* topology_slot_owner(clusterTopology* topology, int slot);
+//find a node by address, NULL if the snapshot doesn't know it
+topologyNode* topology_find_node(clusterTopology* topology, const char* ip, int port);
+/*
+*read the target of a redirect, str looks like "MOVED 3999 127.0.0.1:6381" or "ASK 3999 127.0.0.1:6381".
+*the target is stored in slot, ip and port. returns 0 on success.
+*/
+int topology_parse_redirect(const char* str, int* slot, char* ip, int ip_len, int* port);
+//a client registered by topology_attach has disconnected, the snapshot is dropped with the last client
+void topology_detach(topologyEntry* entry);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif